@@ -148,6 +148,22 @@ extern "C"   {
 
 
 #define UPC2_INVALID_ITEM			            -40
+#define UPC2_STREAMING_ACTIVE		            -41
+#define UPC2_STREAMING_NOT_ACTIVE	            -42
+#define UPC2_OUT_OF_MEMORY			            -43
+#define UPC2_INVALID_PARAM			            -44
+#define UPC2_NOT_RAW_MODE			            -45
+#define UPC2_NOT_AVERAGING			            -46
+#define UPC2_NOT_MERGING			            -47
+#define UPC2_NO_CLOCK_FIT			            -48
+#define UPC2_INVALID_CURSOR			            -49
+#define UPC2_CURSORS_OPEN			            -50
+#define UPC2_NO_BATCH_POOL			            -51
+#define UPC2_NO_FREE_BATCH			            -52
+#define UPC2_NO_BUS					            -53
+#define UPC2_BUS_EXISTS				            -54
+#define UPC2_SERVER_ACTIVE			            -55
+#define UPC2_SOCKET_ERR				            -56
 
 
 // DSP Commands
@@ -195,6 +211,58 @@ extern "C"   {
 #define	UPC2_FROM_START_FRAME  	0x00000003
 #define	UPC2_NEWEST_DATA		0x00000004
 #define	UPC2_FROM_LOAD_PTR		0x00000005
+#define	UPC2_NEWEST_N_FRAMES	0x00000006		// the last nFrames frames up to the newest (pStart untouched)
+
+// Streaming backpressure policies (applied when the host ring buffer is full)
+#define	UPC2_STREAM_DROP_OLDEST	0x00000001		// discard the oldest buffered frames
+#define	UPC2_STREAM_DROP_NEWEST	0x00000002		// discard the frames arriving from the DSP
+#define	UPC2_STREAM_BLOCK		0x00000003		// stop draining the DSP until there is room
+
+#define UPC2_MAX_STREAM_FRAMES	0x00400000		// largest host ring buffer (frames)
+
+// Host moving average (UPC2_PCI_StartHostAverage)
+#define UPC2_MAX_AVG_WINDOWS	8				// window lengths per card
+#define UPC2_MAX_HOST_AVG		0x00400000		// longest window (frames)
+
+// Frame loss accounting (UPC2_PCI_GetLossStats)
+#define UPC2_MAX_GAPS			16				// breaks in frame_no described per batch
+
+// Host cursors (UPC2_PCI_OpenCursor)
+#define UPC2_MAX_CURSORS		8				// cursors per card
+#define UPC2_CURSOR_FROM_START	0x00000001		// first read at the oldest unread frame (pStart)
+#define UPC2_CURSOR_FROM_NEWEST	0x00000002		// first read at the newest frame
+
+// Shared frame batches (UPC2_PCI_StartBatchPool)
+#define UPC2_MAX_BATCHES		4096			// batches per card pool
+
+// Shared-memory frame bus (UPC2_PCI_StartBus)
+#define UPC2_BUS_NAME			"UPC2_FrameBus"	// default file mapping name
+#define UPC2_MAX_BUS_FRAMES		0x00010000		// largest ring per card (frames)
+#define UPC2_MAX_BUS_SUBS		8				// buses open per process (UPC2_PCI_OpenBus)
+
+// Streaming server (UPC2_PCI_StartServer)
+#define UPC2_SERVER_PORT		5025			// default TCP port
+#define UPC2_SERVER_BATCH		256				// default frames per message
+#define UPC2_MAX_SERVER_BATCH	4096			// most frames per message
+#define UPC2_MAX_CLIENTS		8				// clients per server
+#define UPC2_MAX_SERVER_CONNS	8				// connections per process (UPC2_PCI_ConnectServer)
+#define UPC2_SERVER_ANY_HOST	0x00000001		// server option: listen on every interface (not just loopback)
+#define UPC2_SERVER_DELTA		0x00000001		// client option: delta-code the frame columns
+
+// Poll scheduler (UPC2_PCI_SetPollTarget)
+#define UPC2_POLL_LATENCY		10000			// default target latency (usecs)
+#define UPC2_POLL_WATERMARK		50				// default occupancy limit (percent of the DSP ring buffer)
+
+// Merged stream (UPC2_PCI_StartMerge)
+#define UPC2_MERGE_BATCH		256				// default frames read from a card at a time
+
+// Clock sync (UPC2_PCI_StartClockSync)
+#define UPC2_TIMESTAMP_RATE		100000.0		// card timestamp counts per second (10 usec units)
+#define UPC2_CLOCK_PERIOD		100				// default msecs between samples of a card
+
+// UPC2_PCI_GetDataEx output layouts
+#define	UPC2_LAYOUT_ROWS		0x00000001		// frames (less check word) at a caller-chosen stride
+#define	UPC2_LAYOUT_COLUMNS		0x00000002		// one array per item, plus frame_no and timestamp arrays
 
 // DSP Converted Data Frame Status (masks)
 #define	UPC2_DSP_DATA_OVERRUN	0x00000004
@@ -20,19 +20,27 @@
 //
 // hex2bin								- converts ASCII hex to binary
 // parseHexLine     					- parses one line of Intel Hex
-// DownloadHexFile 						- reads Intel hex file into pgm_buf
+// DownloadHexFile 						- reads Intel hex file into a buffer
 //
 // UPC2_PCI_UploadArray	 				- tests writing a large array
 // UPC2_PCI_DownloadArray				- tests reading a large array
 // UPC2_PCI_Test						- performs tests during development
+// UPC2_PCI_BenchmarkCRC				- times the CRC engines
+// UPC2_PCI_BenchmarkGetData			- times UPC2_PCI_GetData in one access type
+// UPC2_PCI_BenchmarkDataPath			- times UPC2_PCI_GetData in every access type on a simulated card
 //
-// BuildCRCTable						- builds table for CRC calculation
+// SelectCRCEngine						- selects the CRC engine for the CPU
+// SelectRawEngine						- selects the raw conversion engine for the CPU
 // Calculate32BitCRC					- calculates 32-bit CRC
+// CRC32_Slice8, CRC32_Pclmul			- CRC engines (slice-by-8, PCLMULQDQ folding)
 //
 // GetStatus 							- gets command status
 //
 // GetMemoryMapPlus						- gets a copy of SDRAM segment
 // GetConvertedDataFramePoolHdr			- gets a copy of SDRAM segment
+// GetShadowMemoryMap, GetShadowConfig,
+// GetShadowCalib						- load the shadow copies of IRAM (once)
+// InvalidateShadow						- marks shadow copies stale
 // IsConnected							- checks for card connected
 // IsAwaitingCommand					- checks DSP operational state
 // SetCommandBuffer						- sets up the command buffer
@@ -43,8 +51,18 @@
 // UnMap_BAR							- unmaps the Bas Address Register
 // ClosePCI  							- closes a PCI device
 //
+// HpidReadSum_Fac1, HpidReadSum_Fac200	- HPID read kernels that checksum the words as they are read
+// HpiHw_xxx, HpiSim_xxx				- HPI register access (PLX BAR or simulated card)
+// SimDspThread, SimRunCommand,
+// SimMakeFrames, StopSimulation		- the simulated card's DSP
 // WriteToLocalAddressSpace 			- performs virtual write of SDRAM
 // ReadFromLocalAddressSpace 			- performs virtual read	of SDRAM
+// ReadWithCheckFromLocalAddressSpace	- performs virtual read of SDRAM and verifies check word
+// ReadFramesWithCheckFromLocalAddressSpace - reads a burst of frames and verifies check words
+// ReadFramesVerified					- reads bursts of frames, re-reading the frames that fail
+// WriteToLocalAddressSpaceV			- writes a list of regions of SDRAM (merged bursts)
+// ReadFromLocalAddressSpaceV			- reads a list of regions of SDRAM (merged bursts)
+// SetHPIA, HpidWrite, SortSegments		- support for the vectored transfers
 //
 // UPC2_PCI_WriteToLocalBus 			- (vestigial)
 // UPC2_PCI_ReadFromLocalBus 			- (vestigial)
@@ -55,6 +73,7 @@
 // Connect/Disconnect
 // UPC2_PCI_GetInventory				- gets the number of PCI cards and their serial numbers
 // UPC2_PCI_Connect						- connects to n-th PCI card
+// UPC2_PCI_ConnectSimulated			- connects an index to a simulated card (no hardware)
 // UPC2_PCI_Disconnect              	- disconnects from n-th PCI card
 //
 // UPC2_PCI_Reset						- performs a reset of the PLX chip
@@ -62,13 +81,84 @@
 //
 // Data Collection:					
 //
+// WriteConfigDelta						- writes the changed words of UPC2_Config
 // UPC2_PCI_UploadConfig 				- writes the UPC2_Config structure to SDRAM
 // UPC2_PCI_UploadConfigFromPath 		- writes the UPC2_Config structure (from .cfg file) to SDRAM
 // UPC2_PCI_StartDataCollection 		- sends a command to initiate data collection
 // UPC2_PCI_SetStartFrame 				- sets the starting frame for GetData (UPC2_FROM_START_FRAME)
+// FindBreak_Scalar, _SSE2				- frame_no continuity check engines
+// CheckFrameNo, CheckOverrun			- frame loss and DSP overrun accounting
+// UPC2_PCI_GetLossStats				- gets the frame loss and DSP overrun counters
+// UPC2_PCI_ResetLossStats				- clears the frame loss and DSP overrun counters
+// ReadNewestFrames						- reads the last frames up to the newest (UPC2_NEWEST_N_FRAMES)
 // UPC2_PCI_GetData 					- reads converted data from the ring buffer
+// CursorCommit							- moves the StartFrame pointer up to the slowest cursor
+// CursorRead							- reads at a cursor
+// UPC2_PCI_OpenCursor					- opens a non-consuming reader of the DSP ring buffer
+// UPC2_PCI_ReadCursor					- reads converted data at a cursor
+// UPC2_PCI_CloseCursor					- closes a cursor
+// FindFrameSince						- binary search of the DSP ring buffer by timestamp
+// UPC2_PCI_GetDataSince				- reads converted data from the first frame at or after a timestamp
+// UPC2_PCI_SeekCursor					- moves a cursor to the first frame at or after a timestamp
+// GetDataRows							- UPC2_PCI_GetData with a caller-chosen frame spacing
+// UPC2_PCI_GetDataEx					- reads converted data as packed rows or item-major columns
+// UnwrapWords_Scalar, _SSE2			- 32 to 64-bit count extension engines
+// UnwrapColumn							- extends a frame field to 64 bits
+// UPC2_PCI_UnwrapFrames				- gets 64-bit frame numbers and timestamps of frames
+// UPC2_PCI_ResetUnwrap					- starts a new run of 64-bit frame numbers and timestamps
+// RawToFloat_Scalar, _SSE2, _AVX2		- raw conversion engines
+// BuildRawPlan, ConvertRaw				- raw frame conversion (config and calibration data)
+// UPC2_PCI_ConvertRawFrames			- converts raw frames
+// UPC2_PCI_GetRawData					- reads raw frames from the ring buffer and converts them
+// AvgUpdate_Scalar, _SSE2				- host moving average engines
+// HostAvgAdd, HostAvgGet, HostAvgResum	- host moving average support
+// UPC2_PCI_StartHostAverage			- sets up moving averages of the items on the host
+// UPC2_PCI_AddFramesToAverage			- adds frames to the host moving averages
+// UPC2_PCI_GetHostAverage				- gets the host moving averages
+// UPC2_PCI_StopHostAverage				- frees the host moving averages
+// PoolRelease, BatchFree				- shared frame batch support
+// UPC2_PCI_StartBatchPool				- sets up a pool of frame batches shared by reference
+// UPC2_PCI_GetBatch					- reads frames into a batch from the pool
+// UPC2_PCI_HoldBatch					- adds a reference to a batch
+// UPC2_PCI_ReleaseBatch				- drops a reference (the last returns the batch to the pool)
+// UPC2_PCI_StopBatchPool				- frees the pool (once its batches are released)
+// ClockFit, ClockSample, ClockThread,
+// ClockUnwrap, ClockHostTime, ResetClock	- clock sync support
+// UPC2_PCI_StartClockSync				- starts sampling the cards' clocks against the host clock
+// UPC2_PCI_StopClockSync				- stops sampling the cards' clocks
+// UPC2_PCI_SampleClock					- samples a card's clock
+// UPC2_PCI_GetClockFit					- gets the offset and drift of a card's clock
+// UPC2_PCI_HostTimeFor					- maps a card timestamp to host time
+// MergeBefore, MergeSift, MergePush,
+// MergeRefill, FreeMerge				- merged stream support
+// UPC2_PCI_StartMerge					- sets up a time ordered stream of the frames of several cards
+// UPC2_PCI_GetMergedData				- takes frames from the merged stream
+// UPC2_PCI_SetTimeOffset				- sets a card's timestamp correction for merging
+// UPC2_PCI_StopMerge					- stops the merged stream
 
 // UPC2_PCI_GetCountUnreadFrames		- reads count of unread frames in the buffer
+// UPC2_PCI_StartStreaming				- starts a thread that drains the ring buffer into host memory
+// UPC2_PCI_StopStreaming				- stops the thread and frees the host ring buffer
+// UPC2_PCI_GetStreamStats				- gets the host ring buffer occupancy counters
+// BusPublish							- copies drained frames to the shared-memory frame bus
+// UPC2_PCI_StartBus					- publishes the streaming cards' frames in shared memory
+// UPC2_PCI_StopBus						- stops publishing
+// UPC2_PCI_OpenBus						- maps a published frame bus (any process)
+// UPC2_PCI_ReadBus						- reads a card's frames from the bus at the subscriber's cursor
+// UPC2_PCI_CloseBus					- unmaps the bus
+// RecvAll, SendAll, ServerEncode,
+// ServerFanOut, ServerAccept,
+// ClientThread, ServerThread			- streaming server support
+// UPC2_PCI_StartServer					- serves the cards' frames to clients over TCP
+// UPC2_PCI_StopServer					- stops the server and disconnects its clients
+// UPC2_PCI_GetServerStats				- gets the server's counters
+// UPC2_PCI_ConnectServer				- connects to a streaming server (client)
+// UPC2_PCI_ReadServer					- reads frames from a streaming server
+// UPC2_PCI_DisconnectServer			- closes a connection to a streaming server
+// UPC2_PCI_WaitForFrames				- waits for a number of unread frames (or a timeout)
+// SchedObserve						- poll scheduler: records a poll and plans the next one
+// UPC2_PCI_SetPollTarget				- sets the latency and occupancy the poll scheduler aims for
+// UPC2_PCI_GetPollStats				- gets the next poll's plan and the poll rate achieved
 
 // UPC2_PCI_StopDataCollection 			- sends a command to terminate data collection
 // UPC2_PCI_SaveConfigToFlash 			- saves the current configuration to Flash memory
@@ -113,6 +203,7 @@
 // For detecting memory leaks (insert this call in the code)
 //_CrtDumpMemoryLeaks();
 
+#include <winsock2.h>				// before windows.h (PlxApi.h)
 #include "PlxApi.h"
 #include "PlxError.h"
 
@@ -122,27 +213,96 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <process.h>
+
+// PCLMULQDQ intrinsics are available from VC 9 (Visual Studio 2008)
+#if defined(_MSC_VER) && _MSC_VER >= 1500
+#define CRC32_USE_PCLMUL	1
+#include <intrin.h>
+#include <wmmintrin.h>
+#else
+#define CRC32_USE_PCLMUL	0
+#endif
+
+// SSE2 intrinsics (and __cpuid) are available from VC 8 (Visual Studio 2005), AVX2 from VC 11
+// (Visual Studio 2012)
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#define RAW_USE_SSE2		1
+#include <intrin.h>
+#include <emmintrin.h>
+#else
+#define RAW_USE_SSE2		0
+#endif
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define RAW_USE_AVX2		1
+#include <immintrin.h>
+#else
+#define RAW_USE_AVX2		0
+#endif
+
+#include "upc2_crc.h"
+
+#pragma comment(lib, "ws2_32.lib")
 
 //#define LOG_ERROR
 #define SIZE_BUFFER         0x100           // Number of bytes to transfer
 #define SOFTWARE_HRDY	    0
 #define USE_SEND_COMMAND
+#define BURST_BUF_SIZE      0x20000         // Max bytes read in one multi-frame burst
+#define SEEK_GUARD_FRAMES   8               // Oldest frames of the ring buffer not searched (the DSP is near)
+#define CURSOR_COMMIT_PART  8               // pStart follows the slowest cursor in steps of MaxFrames / this
+#define REREAD_MAX          8               // Frames of a burst re-read one at a time (more => burst again)
+#define BURST_GROW_CLEAN    16              // Clean bursts before a shortened burst limit doubles
+#define BUS_MAGIC           0x55504342      // "UPCB" -- frame bus header set up
+#define SERVER_MAGIC        0x46435055      // "UPCF" -- streaming server hello and message header
+#define SERVER_QUEUE        16              // Batches queued per client (more => dropped for the client)
+#define SERVER_TIMEOUT      5000            // msecs for the hello of a connection
+#define SCHED_EWMA          8               // Poll scheduler averages weigh the latest poll 1 / this
+#define SCHED_MIN_INTERVAL  1000            // Shortest wait (usecs) between polls (Sleep resolution)
+#define PGM_BUF_SIZE        200000          // Max bytes in a program image (Intel hex file)
+
+// Shadow cache regions (UPC2_Card_t.ShadowValid)
+#define SHADOW_MEMORY_MAP   0x00000001
+#define SHADOW_CONFIG       0x00000002
+#define SHADOW_CALIB        0x00000004
+#define SHADOW_ALL          0x00000007
+
+// Delta config upload (WriteConfigDelta)
+#define DELTA_HPIA_COST     2               // Bus words to set up HPIA (write + read back)
+#define DELTA_FULL_PERCENT  75              // Write the whole struct if the delta costs more than this
+
+// Vectored HPI transfers (ReadFromLocalAddressSpaceV, WriteToLocalAddressSpaceV)
+#define HPI_SEG_LOCAL       32              // Segments sorted without a heap allocation
+#define HPI_SEG_GAP         DELTA_HPIA_COST // Max words read through between segments in one burst
+
+// Simulated card (UPC2_PCI_ConnectSimulated)
+#define SIM_IRAM_SIZE       0x40000         // Bytes of IRAM emulated from IRAM_BASE
+#define SIM_MAX_FRAMES      4096            // Frames in the emulated converted data frame ring
+
+// UPC2_PCI_GetDataEx
+#define COLUMN_CHUNK_FRAMES 128             // Frames read per pass before transposing into columns
+
+// UPC2_PCI_GetRawData
+#define RAW_CHUNK_FRAMES    32              // Raw frames read per pass before converting
+#define RAW_FRAME_MAX       ((8 + 2 * MAX_SBITS + 3) & ~3)	// largest raw frame (less check word)
+
+// Clock sync (UPC2_PCI_StartClockSync)
+#define CLOCK_SAMPLES       64              // Samples fitted per card
+#define CLOCK_BURST         4               // Timestamp reads per sample (shortest round trip kept)
+#define CLOCK_MIN_SPAN      0.001           // Secs between samples for a pairwise slope
 //////////////////////////////////////////////////////////////////////////////
 //                            Global Variables                              //
 //////////////////////////////////////////////////////////////////////////////
 //U32 ddata[1024];		// for DEBUG
 //U32 wdata[1024];		// for DEBUG
 
-U32     newFrameAddr;
-
 // for DEBUG
-long    frame_no;
 long    retry_count;
 long    frame_count;
 
 LARGE_INTEGER frq;		// for DEBUG
 
-U8  pgm_buf[200000];
+U8  pgm_buf[PGM_BUF_SIZE];		// for UPC2_PCI_UploadArray/UPC2_PCI_DownloadArray
 H_DATA hData;
 UWB hexCodeChecksum;
 
@@ -154,27 +314,255 @@ typedef struct
 	UPC2_CommandBuffer_t     CommandBuffer;
 } SDRAM_Image_t;
 
-long cmd_status;
-
-SDRAM_Image_t     SDRAM_Image;
 UPC2_Calib_data_t Calib_Image;
 
-UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
-
 // for DEBUG
 U32 dframe[100];
 
-UPC2_Config_t           UPC2_Config;
+// Background acquisition (see UPC2_PCI_StartStreaming)
+//
+//   The acquisition thread is the only writer of wr_seq and the frame slots. The consumer
+//   (UPC2_PCI_GetData) advances rd_seq with a compare-exchange so that the UPC2_STREAM_DROP_OLDEST
+//   policy can also advance it from the acquisition thread.
+typedef struct
+{
+	HANDLE              hThread;
+	volatile LONG       run;			// cleared to stop the acquisition thread
+	long                policy;			// UPC2_STREAM_DROP_OLDEST, _DROP_NEWEST or _BLOCK
+	U8 *                pRing;			// nSlots frames of EZ_SENSE_FRAME_SIZE bytes
+	U32                 nSlots;
+	volatile LONG       wr_seq;			// number of frames put in the ring
+	volatile LONG       rd_seq;			// number of frames taken from (or dropped from) the ring
+	volatile LONG       frm_size;		// DSP frame size (including check word)
+	UPC2_StreamStats_t  stats;
+} UPC2_Stream_t;
+
+// Simulated card (see UPC2_PCI_ConnectSimulated)
+//
+//   The DSP thread is the only writer of the frame ring and the command status word; host
+//   HPI accesses go through HpiSimOps under the card's HpiLock like the hardware, and the
+//   DSP thread holds HpiLock too while it works on the emulator's memory.
+typedef struct
+{
+	U32                 hpic;
+	U32                 hpia;
+	U8 *                pIram;			// SIM_IRAM_SIZE bytes from IRAM_BASE
+	U8 *                pSdram;			// SDRAM_BASE to SDRAM_END
+	HANDLE              hThread;		// simulated DSP (SimDspThread)
+	HANDLE              hDoorbell;		// auto-reset, set when a command is written
+	volatile LONG       run;			// cleared to stop the DSP thread
+	long                frames_per_sec;	// 0 => from the config
+	BOOL                collecting;
+	double              period;			// seconds per frame
+	U32                 nItems;
+	LARGE_INTEGER       t_start;		// data collection started
+	U32                 nMade;			// frames made since t_start
+} UPC2_Sim_t;
+
+// Raw mode conversion plan (see BuildRawPlan)
+typedef struct
+{
+	long                nSbits;
+	long                nItems;
+	float               A[MAX_SBITS];	// volts = raw * A + B (per sbit)
+	float               B[MAX_SBITS];
+	long                nTerms[MAX_ITEMS];	// conversions summed per item
+	long                term[MAX_ITEMS][4];	// sbits summed per item
+	float               scale[MAX_ITEMS];	// scale_factor / nTerms
+	float               offset[MAX_ITEMS];
+} UPC2_RawPlan_t;
+
+// Host moving average (see UPC2_PCI_StartHostAverage)
+typedef struct
+{
+	long                nItems;
+	long                nWindows;
+	long                cap;			// rows in the frame history (longest window)
+	long                pos;			// next row
+	U32                 nAdded;			// frames added (up to cap)
+	float *             pHist;			// cap rows of nItems values
+	float               zero[MAX_ITEMS];
+	BOOL                uniform[UPC2_MAX_AVG_WINDOWS];	// every item has the same length
+	long                len[UPC2_MAX_AVG_WINDOWS][MAX_ITEMS];
+	double              sum[UPC2_MAX_AVG_WINDOWS][MAX_ITEMS];
+} UPC2_HostAvg_t;
+
+// Shared frame batch pool (see UPC2_PCI_StartBatchPool)
+//
+//   One slab of nBlocks blocks, each a UPC2_Batch_t followed by nCap frames and rounded up to
+//   a cache line. refs counts the card's reference plus the batches out of the pool, so the
+//   slab outlives UPC2_PCI_StopBatchPool until the last batch is released.
+typedef struct
+{
+	U8 *                pSlab;
+	U32                 block_size;
+	long                nBlocks;
+	long                nCap;			// frames per batch
+	long                frm_incr;		// frame size less check word
+	CRITICAL_SECTION    Lock;			// free list
+	long                free;			// first free block (-1 => none)
+	volatile LONG       refs;
+} UPC2_BatchPool_t;
+
+// Clock sync (see UPC2_PCI_StartClockSync)
+typedef struct
+{
+	long                nSamples;				// in the ring (up to CLOCK_SAMPLES)
+	long                next;					// next slot
+	LONGLONG            last;					// latest card timestamp (unwrapped)
+	double              host[CLOCK_SAMPLES];	// host secs at the middle of the read
+	LONGLONG            card[CLOCK_SAMPLES];	// card timestamp (unwrapped, usecs x 10)
+	double              rtt[CLOCK_SAMPLES];		// secs
+	BOOL                valid;					// fit below
+	double              h_ref;					// latest sample
+	LONGLONG            c_ref;
+	double              rate;					// card counts per host sec
+	double              offset;					// card = c_ref + offset + rate * (host - h_ref)
+	double              resid;					// median absolute residual (counts)
+} UPC2_Clock_t;
+
+// Host cursor over the DSP ring buffer (see UPC2_PCI_OpenCursor)
+typedef struct
+{
+	long                from;					// 0 => closed, UPC2_CURSOR_FROM_START or _FROM_NEWEST
+	BOOL                placed;					// pos set (FALSE until the first read)
+	U32                 pos;					// frame index (from pFrame1) of the next frame
+} UPC2_Cursor_t;
 
-DEVICE_LOCATION         UPC2_Device[MAX_PCI_CARDS];
-HANDLE                  UPC2_hDevice[MAX_PCI_CARDS];
-U32                     UPC2_Va[MAX_PCI_CARDS];			  // virtual address
-U32                     UPC2_Fac[MAX_PCI_CARDS];		  // offset factor
+// Shared-memory frame bus (see UPC2_PCI_StartBus)
+//
+//   Header, then nSlots frame slots per card (card-major). Only the publisher writes. A slot's
+//   stamp is odd (2 * seq + 1) while frame seq is being written and 2 * seq + 2 once it is
+//   there, so a subscriber can tell a frame it copied was overwritten meanwhile (seqlock).
+typedef struct
+{
+	volatile LONG       wr_seq;			// frames published
+	volatile LONG       frm_size;		// frame size less check word (0 => not publishing)
+	U32                 pad[14];		// one card per cache line
+} UPC2_BusCard_t;
 
-long            nPCI_cards;
-long            UPC2_SysSerNum[MAX_PCI_CARDS];
-long            UPC2_PCI_State[MAX_PCI_CARDS];
-long            UPC2_DSP_State[MAX_PCI_CARDS];
+typedef struct
+{
+	U32                 magic;			// BUS_MAGIC once set up
+	U32                 nSlots;			// frames per card (power of two)
+	U32                 pad[14];
+	UPC2_BusCard_t      card[MAX_PCI_CARDS];
+} UPC2_BusHdr_t;
+
+typedef struct
+{
+	volatile LONG       stamp;
+	U32                 reserved;
+	U8                  frame[EZ_SENSE_FRAME_SIZE];
+} UPC2_BusSlot_t;
+
+// A subscriber's view of a bus (see UPC2_PCI_OpenBus)
+typedef struct
+{
+	HANDLE              hMap;			// 0 => not open
+	const UPC2_BusHdr_t * pHdr;			// mapped read only
+	LONG                rd_seq[MAX_PCI_CARDS];	// next frame of each card
+} UPC2_BusSub_t;
+
+// Streaming server (see UPC2_PCI_StartServer)
+//
+//   Hello (client to server): SERVER_MAGIC, card mask, options. Reply: SERVER_MAGIC, frames
+//   per message. Then messages of a UPC2_SrvMsg_t and the frames, packed or delta coded.
+//   All words are little endian (x86).
+typedef struct
+{
+	U32                 magic;			// SERVER_MAGIC
+	U32                 card_ndx;
+	U32                 nFrames;
+	U32                 frm_size;		// bytes per frame (less check word)
+	U32                 options;		// UPC2_SERVER_DELTA => delta coded
+	U32                 dropped;		// frames dropped for the client since the last message
+	U32                 bytes;			// following the header
+} UPC2_SrvMsg_t;
+
+typedef struct
+{
+	SOCKET              sock;
+	HANDLE              hThread;		// ClientThread
+	volatile LONG       run;			// cleared to stop ClientThread
+	volatile LONG       mask;			// cards subscribed (0 until the hello)
+	long                options;
+	CRITICAL_SECTION    Lock;			// queue, mask and dropped
+	HANDLE              hReady;			// auto-reset, set as batches are queued
+	UPC2_Batch_t *      queue[SERVER_QUEUE];
+	long                head;
+	long                count;
+	long                dropped;		// frames not queued since the last message
+	U8 *                pMsg;			// message being sent
+	struct UPC2_Server *pSrv;			// server the client belongs to
+} UPC2_SrvClient_t;
+
+typedef struct UPC2_Server
+{
+	SOCKET              listen;
+	HANDLE              hThread;		// ServerThread
+	volatile LONG       run;			// cleared to stop ServerThread
+	long                nBatch;
+	BOOL                own_pool[MAX_PCI_CARDS];	// batch pool set up by the server
+	UPC2_SrvClient_t *  pClient[UPC2_MAX_CLIENTS];
+	CRITICAL_SECTION    Lock;			// stats
+	UPC2_ServerStats_t  stats;
+} UPC2_Server_t;
+
+// Connection to a streaming server (see UPC2_PCI_ConnectServer)
+typedef struct
+{
+	SOCKET              sock;
+	long                nBatch;			// most frames per message
+	U8 *                pMsg;			// payload received (NULL => not open)
+	U8 *                pFrames;		// frames of the last message, decoded
+	long                card_ndx;
+	long                frm_size;
+	long                nFrames;
+	long                next;			// next frame to hand out
+	long                dropped;		// frames the server dropped, not yet reported
+} UPC2_SrvConn_t;
+
+// Poll scheduler (see SchedObserve)
+typedef struct
+{
+	long                latency_us;				// target (0 => UPC2_POLL_LATENCY)
+	long                watermark_pct;			// (0 => UPC2_POLL_WATERMARK)
+	LARGE_INTEGER       t_last;					// last poll (0 => none since SchedReset)
+	long                left;					// unread frames left by the last poll
+	double              arrived;				// frames arriving between polls (averaged)
+	double              dt;						// secs between polls (averaged)
+	UPC2_PollStats_t    stats;
+} UPC2_Sched_t;
+
+// 64-bit frame_no and timestamp (see UPC2_PCI_UnwrapFrames)
+typedef struct
+{
+	LONGLONG            frame_no;				// of the last frame unwrapped
+	LONGLONG            timestamp;
+	BOOL                frame_no_valid;			// FALSE => the next frame_no starts a new run
+	BOOL                timestamp_valid;
+} UPC2_Unwrap_t;
+
+// Merged stream (see UPC2_PCI_StartMerge)
+typedef struct
+{
+	long                nCards;
+	long                card[MAX_PCI_CARDS];	// card index of each slot
+	long                nBatch;					// frames per batch
+	U8 *                pBatch[MAX_PCI_CARDS];	// nBatch frames of EZ_SENSE_FRAME_SIZE per slot
+	Int32 *             pKey[MAX_PCI_CARDS];	// corrected timestamp of each frame in the batch
+	BOOL                host_time;				// keys are host time (every card's clock fitted)
+	long                count[MAX_PCI_CARDS];	// frames in the slot's batch
+	long                next[MAX_PCI_CARDS];	// next frame in the slot's batch
+	long                heap[MAX_PCI_CARDS];	// slots with frames (see MergeBefore)
+	long                nHeap;
+	long                pending[MAX_PCI_CARDS];	// slots to refill
+	long                nPending;
+} UPC2_Merge_t;
+
+extern const UPC2_HpiOps_t HpiHwOps;
+extern const UPC2_HpiOps_t HpiSimOps;
 
 // For Demo mode (i.e.not connected)
 
@@ -189,12 +577,110 @@ typedef struct
 	float    offset[MAX_ITEMS];
 } demo_config_t;
 
-demo_config_t demo_config[MAX_PCI_CARDS];
+// Per-card context
+//
+//   Everything the data and command paths of one card touch, so threads driving different
+//   cards share no state. HpiLock serializes HPI transactions and CmdLock serializes DSP
+//   command sequences on the card (both may be re-entered by the owning thread).
+//   StreamLock guards pStream from start/stop while it's read; it is taken before HpiLock,
+//   never while holding it, and never by the acquisition thread.
+//   Each context starts on a cache line.
+#if defined(_MSC_VER) && _MSC_VER >= 1300
+#define UPC2_CACHE_ALIGN	__declspec(align(64))
+#else
+#define UPC2_CACHE_ALIGN
+#endif
+
+typedef UPC2_CACHE_ALIGN struct
+{
+	U32                 Va;					// virtual address
+	U32                 Fac;				// offset factor
+	const UPC2_HpiOps_t * pHpi;				// HPI transport (HpiHwOps or HpiSimOps)
+	UPC2_Sim_t *        pSim;				// emulator state (NULL unless simulated)
+	long                PCI_State;
+	long                DSP_State;
+	CRITICAL_SECTION    HpiLock;
+	CRITICAL_SECTION    CmdLock;
+	CRITICAL_SECTION    StreamLock;
+
+	UPC2_Stream_t *     pStream;			// background acquisition (NULL if not streaming)
+	UPC2_HostAvg_t *    pHostAvg;			// host moving averages (NULL if not averaging)
+	UPC2_BatchPool_t *  pBatchPool;			// shared frame batches (NULL if no pool)
+	Int32               TimeOffset;			// added to timestamps when merging (see UPC2_PCI_SetTimeOffset)
+	UPC2_Clock_t        Clock;				// fit of the card's clock (under UPC2_ClockLock)
+	UPC2_Unwrap_t       Unwrap;				// 64-bit frame_no and timestamp of the card's frames
+	UPC2_LossStats_t    Loss;				// frame loss and DSP overrun counters (see CheckFrameNo)
+	Int32               LastFrameNo;		// frame_no of the last frame checked
+	long                BurstLimit;			// frames per burst (0 => BURST_BUF_SIZE, see ReadFramesVerified)
+	long                BurstClean;			// bursts without errors since the limit changed
+	UPC2_Cursor_t       Cursor[UPC2_MAX_CURSORS];	// host cursors (under HpiLock)
+	long                nCursors;			// open cursors (StartFrame reads not allowed if any)
+	UPC2_Sched_t        Sched;				// poll scheduler (under HpiLock)
+	BOOL                LastFrameValid;		// FALSE => the next frame starts the sequence
+	HANDLE              FrameEvent;			// auto-reset, set as frames arrive (see UPC2_PCI_WaitForFrames)
+	volatile LONG       FrameNotify;		// number of sources setting FrameEvent
+	U32                 FramePeriod;		// usecs, from the last config uploaded
+#ifdef UPC2_HINT_INTERRUPT
+	HANDLE              hHintThread;
+	volatile LONG       HintRun;
+#endif
+
+	DEVICE_LOCATION     Device;
+	HANDLE              hDevice;
+	long                SysSerNum;
+	long                cmd_status;
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+
+	// Shadow cache of the IRAM memory map, config and calibration data (see GetShadowConfig)
+	U32                 ShadowValid;		// SHADOW_MEMORY_MAP, SHADOW_CONFIG, SHADOW_CALIB
+	SDRAM_Image_t       SDRAM_Image;		// memory map (the command buffer part is not cached)
+	UPC2_Config_t       Config;
+	UPC2_Calib_data_t   Calib;
+	demo_config_t       Demo;				// for Demo mode (i.e.not connected)
+} UPC2_Card_t;
+
+UPC2_Card_t             UPC2_Card[MAX_PCI_CARDS];
+
+// Serializes the Intel hex parser (parseHexLine uses hData)
+CRITICAL_SECTION        UPC2_HexLock;
+
+// Set by DllMain on DLL_PROCESS_DETACH. Threads aren't waited for then (a thread can't exit
+// while DllMain holds the loader lock): at process exit (lpReserved != NULL) they are already
+// gone, and before FreeLibrary the caller must stop them (see UPC2_PCI_StopStreaming).
+BOOL                    UPC2_Detaching;
+BOOL                    UPC2_ProcessExit;
+
+long            nPCI_cards;
 
 
 RETURN_CODE             UPC2_Orig_rc;				// return code from PLX API
 
-U32 CRCTable[ 256 ];
+BOOL CRC32_HavePclmul;			// CPU supports PCLMULQDQ (see SelectCRCEngine)
+
+RawToFloat_t RawToFloat = RawToFloat_Scalar;	// raw conversion engine (see SelectRawEngine)
+AvgUpdate_t  AvgUpdate = AvgUpdate_Scalar;		// host moving average engine (see SelectRawEngine)
+UnwrapWords_t UnwrapWords = UnwrapWords_Scalar;	// 32 to 64-bit count extension (see SelectRawEngine)
+FindBreak_t  FindBreak = FindBreak_Scalar;		// frame_no continuity check (see SelectRawEngine)
+
+UPC2_Merge_t * pMergeStream;	// merged stream of several cards (NULL if not merging)
+
+// Shared-memory frame bus (see UPC2_PCI_StartBus)
+CRITICAL_SECTION        UPC2_BusLock;		// pBus (publisher) and BusSub
+HANDLE                  hBusMap;
+UPC2_BusHdr_t *         pBus;				// published bus (NULL if not publishing)
+LONG                    BusPins;			// BusPublish calls copying to pBus
+UPC2_BusSub_t           BusSub[UPC2_MAX_BUS_SUBS];
+
+// Streaming server (see UPC2_PCI_StartServer)
+UPC2_Server_t *         pServer;			// NULL if not serving
+UPC2_SrvConn_t          SrvConn[UPC2_MAX_SERVER_CONNS];
+
+// Clock sync (see UPC2_PCI_StartClockSync)
+CRITICAL_SECTION        UPC2_ClockLock;		// the cards' Clock
+HANDLE                  hClockThread;
+HANDLE                  hClockWake;			// auto-reset, wakes ClockThread early
+volatile LONG           ClockRun;			// cleared to stop ClockThread
+long                    ClockPeriod;		// msecs
 
 // CRC test data
 U32 CRCTest1[] = 
@@ -240,8 +726,6 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 
 
 		// Initialize specific globals 
-		newFrameAddr = 0;
-		frame_no = 1;
         retry_count = 0;
 		frame_count  = 0;
 
@@ -249,20 +733,37 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 		UPC2_Orig_rc = 0;
 		nPCI_cards = 0;
 
+		InitializeCriticalSection(&UPC2_HexLock);
+		InitializeCriticalSection(&UPC2_ClockLock);
+		InitializeCriticalSection(&UPC2_BusLock);
+		hClockWake = CreateEvent(NULL, FALSE, FALSE, NULL);
 		for (i = 0; i < MAX_PCI_CARDS;i++)
 		{
-			UPC2_SysSerNum[i] = 0;
-			UPC2_PCI_State[i] = 0;
-			UPC2_DSP_State[i] = 0;
-			demo_config[i].nItems = 0;
-			demo_config[i].nSbits = 0;
-			demo_config[i].scan_interval = 0;
-			demo_config[i].frame_no = 0;
-			demo_config[i].time_in_ms = 0;
+			InitializeCriticalSection(&UPC2_Card[i].HpiLock);
+			InitializeCriticalSection(&UPC2_Card[i].CmdLock);
+			InitializeCriticalSection(&UPC2_Card[i].StreamLock);
+			UPC2_Card[i].pStream = NULL;
+			UPC2_Card[i].pHostAvg = NULL;
+			UPC2_Card[i].pBatchPool = NULL;
+			UPC2_Card[i].TimeOffset = 0;
+			memset(&UPC2_Card[i].Clock, 0, sizeof(UPC2_Clock_t));
+			UPC2_Card[i].pHpi = &HpiHwOps;
+			UPC2_Card[i].pSim = NULL;
+			UPC2_Card[i].FrameEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+			UPC2_Card[i].FrameNotify = 0;
+			UPC2_Card[i].FramePeriod = 0;
+			UPC2_Card[i].SysSerNum = 0;
+			UPC2_Card[i].PCI_State = 0;
+			UPC2_Card[i].DSP_State = 0;
+			UPC2_Card[i].Demo.nItems = 0;
+			UPC2_Card[i].Demo.nSbits = 0;
+			UPC2_Card[i].Demo.scan_interval = 0;
+			UPC2_Card[i].Demo.frame_no = 0;
+			UPC2_Card[i].Demo.time_in_ms = 0;
 			for (j = 0; j < MAX_ITEMS; j++)
 			{
-				demo_config[i].scale[j] = 1.0;
-				demo_config[i].offset[j] = 0;
+				UPC2_Card[i].Demo.scale[j] = 1.0;
+				UPC2_Card[i].Demo.offset[j] = 0;
 			}
 		}
 
@@ -271,10 +772,24 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 
 		// srand( (unsigned)time( NULL ) );
 
-		BuildCRCTable();
+		SelectCRCEngine();
+		SelectRawEngine();
 	}
 	else if (ul_reason_for_call == DLL_PROCESS_DETACH)
 	{
+		// Don't wait for threads under the loader lock (see UPC2_Detaching)
+		UPC2_Detaching = TRUE;
+		UPC2_ProcessExit = (lpReserved != NULL);
+
+		UPC2_PCI_StopMerge();
+		UPC2_PCI_StopClockSync();
+		UPC2_PCI_StopBus();
+		for (i = 0; i < UPC2_MAX_BUS_SUBS; i++)
+			UPC2_PCI_CloseBus(i);
+		UPC2_PCI_StopServer();
+		for (i = 0; i < UPC2_MAX_SERVER_CONNS; i++)
+			UPC2_PCI_DisconnectServer(i);
+
 		// Disconnect all connected devices
 		for (i = 0; i < MAX_PCI_CARDS; i++)
 		{
@@ -282,7 +797,17 @@ BOOL APIENTRY DllMain( HANDLE hModule,
 			{
 				UPC2_PCI_Disconnect(i);
 			}
+			UPC2_PCI_StopHostAverage(i);
+			UPC2_PCI_StopBatchPool(i);
+			DeleteCriticalSection(&UPC2_Card[i].HpiLock);
+			DeleteCriticalSection(&UPC2_Card[i].CmdLock);
+			DeleteCriticalSection(&UPC2_Card[i].StreamLock);
+			CloseHandle(UPC2_Card[i].FrameEvent);
 		}
+		DeleteCriticalSection(&UPC2_HexLock);
+		DeleteCriticalSection(&UPC2_ClockLock);
+		DeleteCriticalSection(&UPC2_BusLock);
+		CloseHandle(hClockWake);
 
 	}
 	retval = QueryPerformanceFrequency(&frq);
@@ -469,11 +994,13 @@ H_STATUS parseHexLine(CHAR *pStr)
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// DownloadHexFile -- Reads Intel hex file into pgm_buf
+// DownloadHexFile -- Reads Intel hex file into a buffer
 //
 // parameters:
 //
 // pFilePath -- pointer to a file path string
+// pBuf      -- pointer to a buffer for the binary image
+// buf_size  -- size of the buffer in bytes
 //
 // Returns -- size in bytes of downloaded image or
 //            
@@ -482,7 +1009,7 @@ H_STATUS parseHexLine(CHAR *pStr)
 //			  		    UPC2_CKSUM_ERR
 //			  		    UPC2_HEX_FILE_ERR
 //
-long DownloadHexFile(char * pFilePath)
+long DownloadHexFile(char * pFilePath, U8 * pBuf, long buf_size)
 {
 	FILE *handle;
 	long ret_val = 0;
@@ -502,7 +1029,10 @@ long DownloadHexFile(char * pFilePath)
 	}
 
 	// Init buffer
-	memset(pgm_buf, -1, sizeof(pgm_buf));
+	memset(pBuf, -1, buf_size);
+
+	// parseHexLine works in hData -- one file at a time
+	EnterCriticalSection(&UPC2_HexLock);
 
 	// MaxG 9-08-05 Init hData to clear bit 16
 	hData.addr.u = 0;
@@ -514,13 +1044,13 @@ long DownloadHexFile(char * pFilePath)
 		switch (s = parseHexLine(line_buf))
 		{
 			case H_00:							  /* Valid 00 data record */
-				// Transfer data to pgm_buf
-				if ((hData.addr.u + (unsigned long)hData.number_bytes) < sizeof(pgm_buf))
+				// Transfer data to buffer
+				if ((hData.addr.u + (unsigned long)hData.number_bytes) < (unsigned long)buf_size)
 				{
 					/* its OK so copy it */
 					for (idx=0;idx < (long)hData.number_bytes;idx++)
 					{
-						pgm_buf[hData.addr.u + idx] = hData.data[idx];
+						pBuf[hData.addr.u + idx] = hData.data[idx];
 					}
 					pgm_size += hData.number_bytes; 
 				}
@@ -558,6 +1088,7 @@ long DownloadHexFile(char * pFilePath)
 		if ((s > H_04) && (ret_val == 0))
 			ret_val = UPC2_HEX_FILE_ERR;
 	}
+	LeaveCriticalSection(&UPC2_HexLock);
 	fclose(handle);
 
 	if ((s == H_01) && (ret_val == 0))
@@ -631,6 +1162,7 @@ DllExport long __stdcall UPC2_PCI_Test(void)
 	long     ret_val = 1;
 	size_t   numread;
 	char     flpath[] = "c:\\test.cfg";
+	UPC2_Config_t  Config;
 
 	// Open file
 
@@ -640,10 +1172,256 @@ DllExport long __stdcall UPC2_PCI_Test(void)
 		ret_val = UPC2_FILE_OPEN_ERR;
 		return ret_val;
 	}
-	numread = fread((void *)&UPC2_Config, sizeof(UPC2_Config_t), 1, handle);
+	numread = fread((void *)&Config, sizeof(UPC2_Config_t), 1, handle);
 	fclose(handle);
 	return ret_val;
 }
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_BenchmarkCRC -- times the CRC engines on a buffer of pseudo-random data
+//
+// parameters:
+//
+// size  -- buffer size in bytes
+//
+// nIter -- number of passes over the buffer per engine
+//
+// pMBps -- pointer to 3 doubles for the throughput (MB/s) of
+//          [0] the byte-at-a-time loop (Calculate32BitCRC before version 1.0.0.27)
+//          [1] slice-by-8
+//          [2] PCLMULQDQ folding (0 if the CPU or build doesn't support it)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_NULL_PARAM		if pMBps is NULL
+//			  UPC2_INVALID_PARAM	if size or nIter < 1
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the buffer
+//			  UPC2_BAD_CRC			if the engines don't agree
+//
+DllExport long __stdcall UPC2_PCI_BenchmarkCRC(long size, long nIter, double * pMBps)
+{
+	U8  *           pBuf;
+	long            i;
+	U32             crc[3];
+	LARGE_INTEGER   t0, t1;
+	double          MB;
+
+	if (pMBps == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (size < 1 || nIter < 1)
+		return UPC2_INVALID_PARAM;
+
+	if ((pBuf = (U8 *) malloc(size)) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+
+	for (i = 0; i < size; i++)
+		pBuf[i] = (U8) rand();
+
+	MB = (double) size * nIter / 1e6;
+	crc[2] = 0;
+	pMBps[2] = 0;
+
+	QueryPerformanceCounter(&t0);
+	for (i = 0; i < nIter; i++)
+		crc[0] = Calculate32BitCRC_Bytewise(size, pBuf);
+	QueryPerformanceCounter(&t1);
+	pMBps[0] = MB / ((double)(t1.QuadPart - t0.QuadPart) / (double)frq.QuadPart);
+
+	QueryPerformanceCounter(&t0);
+	for (i = 0; i < nIter; i++)
+		crc[1] = CRC32_Slice8(0, pBuf, size);
+	QueryPerformanceCounter(&t1);
+	pMBps[1] = MB / ((double)(t1.QuadPart - t0.QuadPart) / (double)frq.QuadPart);
+
+#if CRC32_USE_PCLMUL
+	if (CRC32_HavePclmul && size >= 64)
+	{
+		long  n = size & ~15;
+
+		QueryPerformanceCounter(&t0);
+		for (i = 0; i < nIter; i++)
+			crc[2] = CRC32_Slice8(CRC32_Pclmul(0, pBuf, n), pBuf + n, size - n);
+		QueryPerformanceCounter(&t1);
+		pMBps[2] = MB / ((double)(t1.QuadPart - t0.QuadPart) / (double)frq.QuadPart);
+	}
+	else
+		crc[2] = crc[0];
+#else
+	crc[2] = crc[0];
+#endif
+	free(pBuf);
+
+	if (crc[1] != crc[0] || crc[2] != crc[0])
+		return UPC2_BAD_CRC;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CompareDouble -- qsort comparison of two doubles (ascending)
+//
+static int CompareDouble(const void * a, const void * b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da < db) ? -1 : (da > db);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_BenchmarkGetData -- times nCalls calls of UPC2_PCI_GetData
+//
+// parameters:
+//
+// card_ndx    -- long 0, 1, 2, .. representing the card's index (collecting data)
+// access_type -- UPC2_NO_GAPS, UPC2_FROM_START_FRAME, UPC2_NEWEST_DATA, UPC2_FROM_LOAD_PTR
+//                or UPC2_NEWEST_N_FRAMES
+// nCalls      -- number of calls
+// nFrames     -- frames requested per call
+// pResult     -- pointer to a UPC2_Benchmark_t for the results (frames/s, bytes/s of frame
+//                data returned, per-call latency percentiles)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_NULL_PARAM		if pResult is NULL
+//			  UPC2_INVALID_PARAM	if access_type unknown or nCalls or nFrames < 1
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the buffers
+//			  UPC2_NO_CONNECTION	if not connected
+//
+DllExport long __stdcall UPC2_PCI_BenchmarkGetData(long card_ndx, long access_type, long nCalls, long nFrames,
+												   UPC2_Benchmark_t * pResult)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	LARGE_INTEGER   t0, t1, tb, freq;
+	double *        pLat;
+	U8 *            pBuf;
+	long            i, n, ret_val;
+
+	if (pResult == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (nCalls < 1 || nFrames < 1 || access_type < UPC2_NO_GAPS || access_type > UPC2_NEWEST_N_FRAMES)
+		return UPC2_INVALID_PARAM;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	pLat = (double *) malloc(nCalls * sizeof(double));
+	pBuf = (U8 *) malloc((nFrames + 1) * (EZ_SENSE_FRAME_SIZE + 4));
+	if (pLat == NULL || pBuf == NULL)
+	{
+		free(pLat);
+		free(pBuf);
+		return UPC2_OUT_OF_MEMORY;
+	}
+
+	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+							  &FrameHdrImage, sizeof(FrameHdrImage));
+
+	memset(pResult, 0, sizeof(UPC2_Benchmark_t));
+	pResult->access_type = access_type;
+	pResult->calls = nCalls;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&tb);
+	t1 = tb;
+	for (i = 0; i < nCalls; i++)
+	{
+		QueryPerformanceCounter(&t0);
+		n = UPC2_PCI_GetData(card_ndx, access_type, nFrames, pBuf);
+		QueryPerformanceCounter(&t1);
+		pLat[i] = (double)(t1.QuadPart - t0.QuadPart) * 1e6 / (double)freq.QuadPart;
+		if (n < 0)
+			pResult->errors++;
+		else
+			pResult->frames += n;
+	}
+	pResult->seconds = (double)(t1.QuadPart - tb.QuadPart) / (double)freq.QuadPart;
+	pResult->bytes = (double) pResult->frames * (FrameHdrImage.FrameSize - 4);
+	if (pResult->seconds > 0)
+	{
+		pResult->frames_per_sec = pResult->frames / pResult->seconds;
+		pResult->bytes_per_sec = pResult->bytes / pResult->seconds;
+	}
+
+	qsort(pLat, nCalls, sizeof(double), CompareDouble);
+	pResult->lat_p50 = pLat[((nCalls - 1) * 50) / 100];
+	pResult->lat_p90 = pLat[((nCalls - 1) * 90) / 100];
+	pResult->lat_p99 = pLat[((nCalls - 1) * 99) / 100];
+	pResult->lat_max = pLat[nCalls - 1];
+
+	free(pLat);
+	free(pBuf);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_BenchmarkDataPath -- runs UPC2_PCI_BenchmarkGetData in every access type against a
+//                               simulated card (no UPC2100 needed)
+//
+//  Connects the first unconnected index with UPC2_PCI_ConnectSimulated, uploads a 24 item
+//  config, starts data collection, lets the ring fill, runs the benchmarks and disconnects.
+//
+// parameters:
+//
+// frames_per_sec -- simulated frame rate (set it above what the host can take to measure
+//                   the data path rather than the DSP)
+// nCalls         -- calls per access type
+// nFrames        -- frames requested per call
+// pResults       -- pointer to 5 UPC2_Benchmark_t for UPC2_NO_GAPS, UPC2_FROM_START_FRAME,
+//                   UPC2_NEWEST_DATA, UPC2_FROM_LOAD_PTR and UPC2_NEWEST_N_FRAMES
+//
+// Returns -- negative if an error occurs (see UPC2_PCI_ConnectSimulated and
+//            UPC2_PCI_BenchmarkGetData)
+//			  UPC2_INVALID_INDEX	if every card index is connected
+//		   -- number of results (5) if no error
+//
+DllExport long __stdcall UPC2_PCI_BenchmarkDataPath(long frames_per_sec, long nCalls, long nFrames,
+													UPC2_Benchmark_t * pResults)
+{
+	static const long access[5] = { UPC2_NO_GAPS, UPC2_FROM_START_FRAME, UPC2_NEWEST_DATA, UPC2_FROM_LOAD_PTR,
+								   UPC2_NEWEST_N_FRAMES };
+	UPC2_Config_t     Config;
+	long              card_ndx, i, ret_val;
+
+	if (pResults == NULL)
+		return UPC2_NULL_PARAM;
+
+	for (card_ndx = 0; card_ndx < MAX_PCI_CARDS; card_ndx++)
+	{
+		if (IsConnected(card_ndx) == UPC2_NO_CONNECTION)
+			break;
+	}
+	if (card_ndx == MAX_PCI_CARDS)
+		return UPC2_INVALID_INDEX;
+
+	if ((ret_val = UPC2_PCI_ConnectSimulated(card_ndx, frames_per_sec)) < 0)
+		return ret_val;
+
+	memset(&Config, 0, sizeof(Config));
+	strcpy(Config.description, "Data path benchmark");
+	Config.nItems = MAX_ITEMS;
+	Config.nSbits = 48;
+	Config.scan_interval = 1;
+	Config.McBSP0_clk_div = 40;
+	for (i = 0; i < MAX_ITEMS; i++)
+	{
+		Config.item[i].item_number = i;
+		Config.item[i].scale_factor = 1.0f;
+		Config.item[i].related_item_number = -1;
+	}
+
+	if ((ret_val = UPC2_PCI_UploadConfig(card_ndx, &Config)) >= 0 &&
+		(ret_val = UPC2_PCI_StartDataCollection(card_ndx)) >= 0)
+	{
+		// Let the ring fill
+		Sleep(100);
+		for (i = 0; i < 5 && ret_val >= 0; i++)
+			ret_val = UPC2_PCI_BenchmarkGetData(card_ndx, access[i], nCalls, nFrames, &pResults[i]);
+		UPC2_PCI_StopDataCollection(card_ndx);
+	}
+	UPC2_PCI_Disconnect(card_ndx);
+
+	return (ret_val < 0) ? ret_val : 5;
+}
 #if 0
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -674,8 +1452,6 @@ DllExport long __stdcall UPC2_PCI_Test(void)
 	ret_val = UPC2_BAD_CRC;
 	UPC2_Orig_rc +=1;
 
-	BuildCRCTable();
-
 	crc1 = Calculate32BitCRC( sizeof(CRCTest1), CRCTest1);
 	crc2 = Calculate32BitCRC( sizeof(CRCTest2), CRCTest2);
 
@@ -755,28 +1531,57 @@ DllExport long __stdcall UPC2_PCI_Test(void)
 //////////////////////////////////////////////////////////////////////////////
 //                   Functions for internal use								//
 //////////////////////////////////////////////////////////////////////////////
-//  DDJ 1992 Mark Nelson
-// 
-//  BuildCRCTable -- builds table for use by Calculate32BitCRC
 //
-void BuildCRCTable(void)
+//  SelectCRCEngine -- picks the fastest CRC engine the CPU supports (called from DllMain)
+//
+//  The lookup tables (upc2_crc.h) are built at compile time.
+//
+void SelectCRCEngine(void)
 {
-	long i;
-	long j;
-	U32 crc;
+#if CRC32_USE_PCLMUL
+	int  info[4];
 
-	for ( i = 0; i <= 255 ; i++ )
+	__cpuid(info, 1);
+	CRC32_HavePclmul = (info[2] & 0x00000002) != 0;		// ECX bit 1 = PCLMULQDQ
+#else
+	CRC32_HavePclmul = FALSE;
+#endif
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  SelectRawEngine -- picks the fastest raw conversion and moving average engines the CPU
+//                     (and OS) supports (called from DllMain)
+//
+void SelectRawEngine(void)
+{
+#if RAW_USE_SSE2
+	int  info[4];
+	BOOL sse2;
+
+	__cpuid(info, 1);
+	sse2 = (info[3] & 0x04000000) != 0;						// EDX bit 26 = SSE2
+	AvgUpdate = sse2 ? AvgUpdate_SSE2 : AvgUpdate_Scalar;
+	UnwrapWords = sse2 ? UnwrapWords_SSE2 : UnwrapWords_Scalar;
+	FindBreak = sse2 ? FindBreak_SSE2 : FindBreak_Scalar;
+#if RAW_USE_AVX2
+	// ECX bit 27 = OSXSAVE, bit 28 = AVX and the OS saves the YMM registers
+	if ((info[2] & 0x18000000) == 0x18000000 && (_xgetbv(0) & 6) == 6)
 	{
-		crc = i;
-		for ( j = 8 ; j > 0; j-- )
+		__cpuidex(info, 7, 0);
+		if (info[1] & 0x00000020)							// EBX bit 5 = AVX2
 		{
-			if ( crc & 1 )
-				crc = ( crc >> 1 ) ^ CRC32_POLYNOMIAL;
-			else
-				crc >>= 1;
+			RawToFloat = RawToFloat_AVX2;
+			return;
 		}
-		CRCTable[ i ] = crc;
 	}
+#endif
+	if (sse2)
+	{
+		RawToFloat = RawToFloat_SSE2;
+		return;
+	}
+#endif
+	RawToFloat = RawToFloat_Scalar;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -792,7 +1597,33 @@ void BuildCRCTable(void)
 // The original version accepted an initial value for the crc and returned an updated value.
 // U32 CalculateBufferCRC( long count, U32 crc, void * buffer )
 //
+// Blocks of 64 bytes or more go through CRC32_Pclmul when the CPU supports it, the rest
+// through CRC32_Slice8.
+//
 U32 Calculate32BitCRC(long count, void * buffer )
+{
+	U8   *p = (U8 *) buffer;
+	U32  crc = 0;
+#if CRC32_USE_PCLMUL
+	long n;
+
+	if (CRC32_HavePclmul && count >= 64)
+	{
+		n = count & ~15;
+		crc = CRC32_Pclmul(crc, p, n);
+		p += n;
+		count -= n;
+	}
+#endif
+	return CRC32_Slice8(crc, p, count);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//  DDJ 1992 Mark Nelson
+// 
+// Calculate32BitCRC_Bytewise -- calculates the 32-bit CRC a byte at a time
+//                               (reference for UPC2_PCI_BenchmarkCRC)
+//
+U32 Calculate32BitCRC_Bytewise(long count, void * buffer )
 {
 	U8  *p;
 	U32 crc = 0;
@@ -803,11 +1634,160 @@ U32 Calculate32BitCRC(long count, void * buffer )
 	while ( count-- != 0 )
 	{
 		temp1 = ( crc >> 8 ) & 0x00FFFFFFL;
-		temp2 = CRCTable[ ( (U32) crc ^ *p++ ) & 0xff ];
+		temp2 = CRC32Table[0][ ( (U32) crc ^ *p++ ) & 0xff ];
 		crc = temp1 ^ temp2;
 	}
 	return crc;
 }
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CRC32_Slice8 -- updates a CRC eight bytes at a time (slice-by-8)
+//
+// parameters:
+//
+// crc 		-- CRC so far (0 to start)
+// p 		-- pointer to a block of data
+// count 	-- count (in bytes)
+//
+// Returns  -- updated 32-bit CRC
+//
+U32 CRC32_Slice8(U32 crc, const U8 * p, long count)
+{
+	U32  lo, hi;
+
+	// Byte at a time up to a 4-byte boundary
+	while (count != 0 && ((U32) p & 3) != 0)
+	{
+		crc = CRC32Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		count--;
+	}
+
+	for ( ; count >= 8; count -= 8)
+	{
+		lo = *(const U32 *) p ^ crc;
+		hi = *(const U32 *) (p + 4);
+		crc = CRC32Table[7][ lo        & 0xff] ^
+			  CRC32Table[6][(lo >>  8) & 0xff] ^
+			  CRC32Table[5][(lo >> 16) & 0xff] ^
+			  CRC32Table[4][ lo >> 24        ] ^
+			  CRC32Table[3][ hi        & 0xff] ^
+			  CRC32Table[2][(hi >>  8) & 0xff] ^
+			  CRC32Table[1][(hi >> 16) & 0xff] ^
+			  CRC32Table[0][ hi >> 24        ];
+		p += 8;
+	}
+
+	while (count-- != 0)
+		crc = CRC32Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+#if CRC32_USE_PCLMUL
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CRC32_Pclmul -- updates a CRC by carry-less multiplication folding (PCLMULQDQ)
+//
+// parameters:
+//
+// crc 		-- CRC so far (0 to start)
+// p 		-- pointer to a block of data
+// count 	-- count (in bytes) (at least 64 and a multiple of 16)
+//
+// Returns  -- updated 32-bit CRC
+//
+// Folds four 128-bit lanes 64 bytes at a time, then one lane 16 bytes at a time, and finishes
+// with a Barrett reduction ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction", Intel 2009). The constants are x^n mod P for the reflected CRC32_POLYNOMIAL.
+//
+U32 CRC32_Pclmul(U32 crc, const U8 * p, long count)
+{
+	__m128i  x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+	__m128i  k1k2 = _mm_setr_epi32(0x54442bd4, 1, 0xc6e41596, 1);
+	__m128i  k3k4 = _mm_setr_epi32(0x751997d0, 1, 0xccaa009e, 0);
+	__m128i  k5k0 = _mm_setr_epi32(0x63cd6124, 1, 0, 0);
+	__m128i  poly = _mm_setr_epi32(0xdb710641, 1, 0xf7011641, 1);
+	__m128i  mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	count -= 64;
+
+	// Fold 64 bytes at a time
+	x0 = k1k2;
+	for ( ; count >= 64; count -= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		p += 64;
+	}
+
+	// Fold the four lanes into one
+	x0 = k3k4;
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Fold 16 bytes at a time
+	for ( ; count >= 16; count -= 16)
+	{
+		x2 = _mm_loadu_si128((const __m128i *) p);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+	}
+
+	// 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = k5k0;
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = poly;
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (U32) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
 ///////////////////////////////////////////////////////////////////////////
 //
 // Calculate32BitChecksum -- calculates the 32-bit checksum for a block of data
@@ -844,7 +1824,7 @@ long GetStatus(long card_ndx)
 		return UPC2_NO_CONNECTION;
 
 	ReadFromLocalAddressSpace(card_ndx, (U32) COMMAND_BUFFER_ADDR + sizeof(UPC2_CommandBuffer_t) - 4,
-									  &cmd_status, sizeof(cmd_status));
+									  &UPC2_Card[card_ndx].cmd_status, sizeof(UPC2_Card[card_ndx].cmd_status));
 	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -860,7 +1840,7 @@ long GetMemoryMapPlus(long card_ndx)
 		return UPC2_NO_CONNECTION;
 
 	ReadFromLocalAddressSpace(card_ndx, (U32) SDRAM_MEMORY_MAP_ADDR,
-									  &SDRAM_Image, sizeof(SDRAM_Image));
+									  &UPC2_Card[card_ndx].SDRAM_Image, sizeof(UPC2_Card[card_ndx].SDRAM_Image));
 	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -876,26 +1856,120 @@ long GetConvertedDataFramePoolHdr(long card_ndx)
 		return UPC2_NO_CONNECTION;
 
 	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
-									  &FrameHdrImage, sizeof(FrameHdrImage));
+									  &UPC2_Card[card_ndx].FrameHdrImage, sizeof(UPC2_ConvertedDataFramePoolHdr_t));
 	return UPC2_NORMAL_RETURN;
 }
-/////////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////
 //
-//  IsConnected --  tests for card connected
+//  GetShadowMemoryMap -- makes sure the shadow copy of the SDRAM memory map is loaded
 //
-//  Returns -- negative if error
-//					UPC2_INVALID_INDEX
-//             		UPC2_NO_CONNECTION
-//			   positive if connected
-//  				UPC2_CONNECTED		
+//  The memory map, config and calibration data only change when the DLL uploads them, when
+//  the DSP loads them from flash or when the card is reset, so they are read over the HPI once
+//  and then served from the card's shadow copy (see InvalidateShadow).
 //
+//  Returns -- negative if an error occurs
+//			-- positive if UPC2_Card[card_ndx].SDRAM_Image.MemoryMap loaded
 //
-long IsConnected(long card_ndx)
+long GetShadowMemoryMap(long card_ndx)
 {
-	if (card_ndx > MAX_PCI_CARDS || card_ndx < 0)
-		return UPC2_INVALID_INDEX;
+	long ret_val;
+
+	if (UPC2_Card[card_ndx].ShadowValid & SHADOW_MEMORY_MAP)
+		return UPC2_NORMAL_RETURN;
+
+	if ((ret_val = GetMemoryMapPlus(card_ndx)) < 0)
+		return ret_val;
+
+	UPC2_Card[card_ndx].ShadowValid |= SHADOW_MEMORY_MAP;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  GetShadowConfig -- makes sure the shadow copy of UPC2_Config is loaded
+//
+//  Returns -- negative if an error occurs
+//					UPC2_NO_CONFIG		if no config in IRAM
+//			-- positive if UPC2_Card[card_ndx].Config loaded
+//
+long GetShadowConfig(long card_ndx)
+{
+	long ret_val;
+
+	if ((ret_val = GetShadowMemoryMap(card_ndx)) < 0)
+		return ret_val;
+
+	// Verify UPC2_Config loaded
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config == 0)
+		return UPC2_NO_CONFIG;
+
+	if (UPC2_Card[card_ndx].ShadowValid & SHADOW_CONFIG)
+		return UPC2_NORMAL_RETURN;
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CONFIG_STRUCT_ADDR,
+										&UPC2_Card[card_ndx].Config, sizeof(UPC2_Config_t));
+	if (ret_val < 0)
+		return ret_val;
+
+	UPC2_Card[card_ndx].ShadowValid |= SHADOW_CONFIG;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  GetShadowCalib -- makes sure the shadow copy of the calibration data is loaded
+//
+//  Returns -- negative if an error occurs
+//					UPC2_NO_CALIB_DATA	if no calibration data in IRAM
+//			-- positive if UPC2_Card[card_ndx].Calib loaded
+//
+long GetShadowCalib(long card_ndx)
+{
+	long ret_val;
+
+	if ((ret_val = GetShadowMemoryMap(card_ndx)) < 0)
+		return ret_val;
+
+	// Verify that Calibration data is loaded 
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Calib == 0)
+		return UPC2_NO_CALIB_DATA;
+
+	if (UPC2_Card[card_ndx].ShadowValid & SHADOW_CALIB)
+		return UPC2_NORMAL_RETURN;
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CALIB_STRUCT_TABLE_ADDR,
+										&UPC2_Card[card_ndx].Calib, sizeof(UPC2_Calib_data_t));
+	if (ret_val < 0)
+		return ret_val;
+
+	UPC2_Card[card_ndx].ShadowValid |= SHADOW_CALIB;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  InvalidateShadow -- marks regions of the shadow cache as stale (re-read on next use)
+//
+//  regions -- SHADOW_MEMORY_MAP, SHADOW_CONFIG, SHADOW_CALIB or SHADOW_ALL
+//
+void InvalidateShadow(long card_ndx, U32 regions)
+{
+	UPC2_Card[card_ndx].ShadowValid &= ~regions;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  IsConnected --  tests for card connected
+//
+//  Returns -- negative if error
+//					UPC2_INVALID_INDEX
+//             		UPC2_NO_CONNECTION
+//			   positive if connected
+//  				UPC2_CONNECTED		
+//
+//
+long IsConnected(long card_ndx)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
 
-	if (UPC2_PCI_State[card_ndx] & UPC2_CONNECTED)
+	if (UPC2_Card[card_ndx].PCI_State & UPC2_CONNECTED)
 		return UPC2_CONNECTED;
 	else
 		return UPC2_NO_CONNECTION;
@@ -914,10 +1988,15 @@ long IsAwaitingCommand(long card_ndx)
 {
 	long ret_val;
 
-	if ((ret_val = GetMemoryMapPlus(card_ndx)) < 0)
+	if ((ret_val = GetShadowMemoryMap(card_ndx)) < 0)
 		return ret_val;
 
-	if (SDRAM_Image.CommandBuffer.control_status & UPC2_DSP_BUSY)
+	// Only the control/status word changes from command to command
+	if ((ret_val = GetStatus(card_ndx)) < 0)
+		return ret_val;
+	UPC2_Card[card_ndx].SDRAM_Image.CommandBuffer.control_status = UPC2_Card[card_ndx].cmd_status;
+
+	if (UPC2_Card[card_ndx].SDRAM_Image.CommandBuffer.control_status & UPC2_DSP_BUSY)
 		return UPC2_BUSY;
 	else
 		return UPC2_NORMAL_RETURN;
@@ -1050,7 +2129,7 @@ long Map_BAR(long card_ndx)
 	long  			  ret_val = UPC2_NORMAL_RETURN;
 
 	PlxPciBarMap(
-					UPC2_hDevice[card_ndx],
+					UPC2_Card[card_ndx].hDevice,
 					3,			 // BarIndex 3 => space 1
 					&Va
 					);
@@ -1058,7 +2137,7 @@ long Map_BAR(long card_ndx)
 
 	// MaxG 3-8-10 Reinstated PCI Reset to get operational on Win2K box
 	// Reset n-th PLX PCI device
-	PlxPciBoardReset(UPC2_hDevice[card_ndx]);
+	PlxPciBoardReset(UPC2_Card[card_ndx].hDevice);
 
 	// Delay ~ one second
 	Sleep(1000);
@@ -1072,7 +2151,7 @@ long Map_BAR(long card_ndx)
 	// Setup HPIC
 	*(U32*)(Va) = 0x00010001;	  // = HWOB = 1 => first halfword is least significant
 
-	UPC2_Va[card_ndx] = Va;
+	UPC2_Card[card_ndx].Va = Va;
 	//return TRUE;
     
     
@@ -1085,7 +2164,7 @@ long Map_BAR(long card_ndx)
     if (i != j)
        Fac = 1;               // Card is unmodifed
 
-    UPC2_Fac[card_ndx] = Fac;	 
+    UPC2_Card[card_ndx].Fac = Fac;	 
     
     // MaxG 6-18-09 Extended test
     
@@ -1147,8 +2226,8 @@ long Map_BAR(long card_ndx)
 void UnMap_BAR(long card_ndx)
 {
 	PlxPciBarUnmap(
-					  UPC2_hDevice[card_ndx],
-					  &UPC2_Va[card_ndx]
+					  UPC2_Card[card_ndx].hDevice,
+					  &UPC2_Card[card_ndx].Va
 					  );
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1197,7 +2276,7 @@ DllExport long __stdcall UPC2_PCI_WriteToLocalBus(long card_ndx, void * src, U32
 
 	rc = PlxBusIopWrite(
 							 //DrvHandle,
-							 UPC2_hDevice[card_ndx],
+							 UPC2_Card[card_ndx].hDevice,
 							 //IopSpace0,
 							 //MsLcs1,
 							 IopSpace1,
@@ -1236,7 +2315,7 @@ DllExport long __stdcall UPC2_PCI_ReadFromLocalBus(long card_ndx, U32 src, void
 
 	rc = PlxBusIopRead(
 							//DrvHandle,
-							UPC2_hDevice[card_ndx],
+							UPC2_Card[card_ndx].hDevice,
 							IopSpace1,
 							//IopSpace0,
 							src,					 // relative local address
@@ -1257,6 +2336,379 @@ DllExport long __stdcall UPC2_PCI_ReadFromLocalBus(long card_ndx, U32 src, void
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
+// HpidReadSum_Fac1, HpidReadSum_Fac200 -- fused HPID read and 32-bit checksum kernels
+//
+// parameters:
+//
+// Va         -- virtual address of the card's HPI (HPIA already set up)
+// dest       -- pointer to destination buffer
+// nwords     -- number of words to read (auto-increment)
+//
+// Returns -- sum of the words read (see Calculate32BitChecksum)
+//
+// The checksum is accumulated as the words come in, so the frame isn't walked a second time.
+// One kernel per board type (Fac = 1 unmodified, 0x200 modified) so the HPID address is a
+// constant offset from Va; the loop is unrolled by 4.
+//
+#define HPID_READ_SUM_KERNEL(name, FAC)											\
+U32 name(U32 Va, U32 * dest, U32 nwords)										\
+{																				\
+	volatile U32 * const pHPID = (volatile U32 *)(Va + 0x8*(FAC));				\
+	U32          sum = 0;														\
+	U32          w0, w1, w2, w3;												\
+																				\
+	for ( ; nwords >= 4; nwords -= 4)											\
+	{																			\
+		w0 = *pHPID;															\
+		w1 = *pHPID;															\
+		w2 = *pHPID;															\
+		w3 = *pHPID;															\
+		dest[0] = w0;															\
+		dest[1] = w1;															\
+		dest[2] = w2;															\
+		dest[3] = w3;															\
+		sum += w0 + w1 + w2 + w3;												\
+		dest += 4;																\
+	}																			\
+	for ( ; nwords != 0; nwords--)												\
+	{																			\
+		w0 = *pHPID;															\
+		*dest++ = w0;															\
+		sum += w0;																\
+	}																			\
+	return sum;																	\
+}
+
+HPID_READ_SUM_KERNEL(HpidReadSum_Fac1, 1)
+HPID_READ_SUM_KERNEL(HpidReadSum_Fac200, 0x200)
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HpiHw_xxx -- HPI register access through the PLX BAR (HpiHwOps)
+//
+// HPIC at Va, HPIA at Va + 4*Fac, HPID at Va + 8*Fac (auto-increment) and Va + 0xc*Fac
+// (fixed-mode). The auto-increment reads use the fused kernels above.
+//
+void HpiHw_WriteHPIC(long card_ndx, U32 value)
+{
+	*(volatile U32*)(UPC2_Card[card_ndx].Va) = value;
+}
+U32 HpiHw_ReadHPIC(long card_ndx)
+{
+	return *(volatile U32*)(UPC2_Card[card_ndx].Va);
+}
+void HpiHw_WriteHPIA(long card_ndx, U32 local_addr)
+{
+	*(volatile U32*)(UPC2_Card[card_ndx].Va + 4*UPC2_Card[card_ndx].Fac) = local_addr;
+}
+U32 HpiHw_ReadHPIA(long card_ndx)
+{
+	return *(volatile U32*)(UPC2_Card[card_ndx].Va + 4*UPC2_Card[card_ndx].Fac);
+}
+U32 HpiHw_ReadHPID(long card_ndx, U32 * dest, U32 nwords)
+{
+	if (UPC2_Card[card_ndx].Fac == 1)
+		return HpidReadSum_Fac1(UPC2_Card[card_ndx].Va, dest, nwords);
+	else
+		return HpidReadSum_Fac200(UPC2_Card[card_ndx].Va, dest, nwords);
+}
+U32 HpiHw_ReadHPIDFixed(long card_ndx)
+{
+	return *(volatile U32*)(UPC2_Card[card_ndx].Va + 0xc*UPC2_Card[card_ndx].Fac);
+}
+void HpiHw_WriteHPID(long card_ndx, U32 * src, U32 nwords)
+{
+	volatile U32 * const pHPID = (volatile U32*)(UPC2_Card[card_ndx].Va + 8*UPC2_Card[card_ndx].Fac);
+	U32          i;
+
+	for (i = 0; i < nwords; i++)
+		*pHPID = src[i];
+}
+void HpiHw_WriteHPIDFixed(long card_ndx, U32 value)
+{
+	*(volatile U32*)(UPC2_Card[card_ndx].Va + 0xc*UPC2_Card[card_ndx].Fac) = value;
+}
+
+const UPC2_HpiOps_t HpiHwOps =
+{
+	HpiHw_WriteHPIC, HpiHw_ReadHPIC,
+	HpiHw_WriteHPIA, HpiHw_ReadHPIA,
+	HpiHw_ReadHPID, HpiHw_ReadHPIDFixed,
+	HpiHw_WriteHPID, HpiHw_WriteHPIDFixed
+};
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Simulated card (see UPC2_PCI_ConnectSimulated)
+//
+// HpiSim_xxx  -- HPI register access to the emulator (HpiSimOps). HPIA addresses IRAM
+//                (IRAM_BASE + SIM_IRAM_SIZE) and SDRAM (SDRAM_BASE to SDRAM_END); anything else
+//                reads as zero and ignores writes. HPID auto-increment accesses advance HPIA by
+//                4, fixed-mode accesses don't. HRDY always reads as ready.
+//
+// SimDspThread -- stands in for the DSP: runs the commands written to the command buffer and,
+//                while collecting, fills the converted data frame ring at the simulated rate
+//                (under the card's HpiLock, so a host HPI transaction sees a whole command or
+//                frame)
+//
+U32 * SimWord(UPC2_Sim_t * pSim, U32 local_addr)
+{
+	if (local_addr - IRAM_BASE < SIM_IRAM_SIZE)
+		return (U32*)(pSim->pIram + ((local_addr - IRAM_BASE) & ~3));
+	if (local_addr >= SDRAM_BASE && local_addr < SDRAM_END)
+		return (U32*)(pSim->pSdram + ((local_addr - SDRAM_BASE) & ~3));
+	return NULL;
+}
+void HpiSim_WriteHPIC(long card_ndx, U32 value)
+{
+	// Only HWOB is kept (HINT isn't simulated -- the DSP thread sets FrameEvent directly)
+	UPC2_Card[card_ndx].pSim->hpic = value & 0x00010001;
+}
+U32 HpiSim_ReadHPIC(long card_ndx)
+{
+	return UPC2_Card[card_ndx].pSim->hpic | 0x00080008;		// HRDY
+}
+void HpiSim_WriteHPIA(long card_ndx, U32 local_addr)
+{
+	UPC2_Card[card_ndx].pSim->hpia = local_addr;
+}
+U32 HpiSim_ReadHPIA(long card_ndx)
+{
+	return UPC2_Card[card_ndx].pSim->hpia;
+}
+U32 HpiSim_ReadHPID(long card_ndx, U32 * dest, U32 nwords)
+{
+	UPC2_Sim_t * pSim = UPC2_Card[card_ndx].pSim;
+	U32          *p;
+	U32          i, sum = 0;
+
+	for (i = 0; i < nwords; i++)
+	{
+		p = SimWord(pSim, pSim->hpia);
+		dest[i] = (p != NULL) ? *p : 0;
+		sum += dest[i];
+		pSim->hpia += 4;
+	}
+	return sum;
+}
+U32 HpiSim_ReadHPIDFixed(long card_ndx)
+{
+	U32 *p = SimWord(UPC2_Card[card_ndx].pSim, UPC2_Card[card_ndx].pSim->hpia);
+
+	return (p != NULL) ? *p : 0;
+}
+void HpiSim_WriteHPIDFixed(long card_ndx, U32 value)
+{
+	UPC2_Sim_t * pSim = UPC2_Card[card_ndx].pSim;
+	U32          *p = SimWord(pSim, pSim->hpia);
+
+	if (p != NULL)
+		*p = value;
+
+	// Ring the DSP's doorbell when the command status word is written (the command is complete)
+	if (pSim->hpia == COMMAND_BUFFER_ADDR + sizeof(UPC2_CommandBuffer_t) - 4)
+		SetEvent(pSim->hDoorbell);
+}
+void HpiSim_WriteHPID(long card_ndx, U32 * src, U32 nwords)
+{
+	UPC2_Sim_t * pSim = UPC2_Card[card_ndx].pSim;
+	U32          i;
+
+	for (i = 0; i < nwords; i++)
+	{
+		HpiSim_WriteHPIDFixed(card_ndx, src[i]);
+		pSim->hpia += 4;
+	}
+}
+
+const UPC2_HpiOps_t HpiSimOps =
+{
+	HpiSim_WriteHPIC, HpiSim_ReadHPIC,
+	HpiSim_WriteHPIA, HpiSim_ReadHPIA,
+	HpiSim_ReadHPID, HpiSim_ReadHPIDFixed,
+	HpiSim_WriteHPID, HpiSim_WriteHPIDFixed
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SimStartCollection -- sets up the converted data frame ring from the config in IRAM
+//
+// Returns -- FALSE if no config has been uploaded
+//
+BOOL SimStartCollection(UPC2_Sim_t * pSim)
+{
+	UPC2_SDRAM_MemoryMap_t *            pMap = (UPC2_SDRAM_MemoryMap_t *) SimWord(pSim, SDRAM_MEMORY_MAP_ADDR);
+	UPC2_Config_t *                     pCfg = (UPC2_Config_t *) SimWord(pSim, UPC2_CONFIG_STRUCT_ADDR);
+	UPC2_ConvertedDataFramePoolHdr_t *  pHdr = (UPC2_ConvertedDataFramePoolHdr_t *) SimWord(pSim, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR);
+	U32                                 clk_div, usecs, nItems, frm_size;
+
+	if (pMap->pUPC2_Config == 0)
+		return FALSE;
+
+	nItems = pCfg->nItems;
+	if (nItems < 1 || nItems > MAX_ITEMS)
+		nItems = MAX_ITEMS;
+	frm_size = 8 + 4*nItems + 4;		// frame_no, timestamp, data, check word
+
+	pHdr->FrameSize = frm_size;
+	pHdr->MaxFrames = SIM_MAX_FRAMES;
+	pHdr->pFrame1 = (UPC2_ConvertedDataFrame_t *) CONVERTED_DATA_FRAMES_ADDR;
+	pHdr->pLast = (UPC2_ConvertedDataFrame_t *) (CONVERTED_DATA_FRAMES_ADDR + (SIM_MAX_FRAMES - 1) * frm_size);
+	pHdr->pLoad = pHdr->pFrame1;
+	pHdr->pNew = pHdr->pFrame1;
+	pHdr->pStart = pHdr->pFrame1;
+
+	// Frame period as in SetFramePeriod unless a rate was given
+	if (pSim->frames_per_sec > 0)
+		pSim->period = 1.0 / pSim->frames_per_sec;
+	else
+	{
+		clk_div = (pCfg->McBSP0_clk_div != 0) ? pCfg->McBSP0_clk_div : 40;
+		usecs = (pCfg->scan_interval * pCfg->nSbits * clk_div) / 4;
+		pSim->period = (usecs != 0) ? usecs / 1e6 : 1e-3;
+	}
+	pSim->nItems = nItems;
+	pSim->nMade = 0;
+	QueryPerformanceCounter(&pSim->t_start);
+	pSim->collecting = TRUE;
+	return TRUE;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SimMakeFrames -- writes the frames due since data collection started into the ring
+//
+// Each frame is frame_no, timestamp (usecs x 10), a sawtooth per item (as in Demo mode) scaled
+// by the item's scale factor and offset, and the check word. pNew is published after the frame
+// is complete. Old frames are overwritten if the host falls behind.
+//
+// Returns -- number of frames written
+//
+long SimMakeFrames(UPC2_Sim_t * pSim)
+{
+	UPC2_ConvertedDataFramePoolHdr_t *  pHdr = (UPC2_ConvertedDataFramePoolHdr_t *) SimWord(pSim, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR);
+	UPC2_Config_t *                     pCfg = (UPC2_Config_t *) SimWord(pSim, UPC2_CONFIG_STRUCT_ADDR);
+	UPC2_ConvertedDataFrame_t *         pF;
+	LARGE_INTEGER                       now;
+	U32                                 due, i, fwords;
+	U32                                 load;
+	long                                n = 0;
+	float                               val;
+
+	QueryPerformanceCounter(&now);
+	due = (U32)((double)(now.QuadPart - pSim->t_start.QuadPart) / (double)frq.QuadPart / pSim->period);
+	if (due - pSim->nMade > SIM_MAX_FRAMES)
+		pSim->nMade = due - SIM_MAX_FRAMES;		// lapped -- only the last ring's worth matters
+
+	fwords = pHdr->FrameSize / 4;
+	for ( ; pSim->nMade != due; pSim->nMade++, n++)
+	{
+		load = (U32) pHdr->pLoad;
+		pF = (UPC2_ConvertedDataFrame_t *) SimWord(pSim, load);
+		pF->frame_no = pSim->nMade;
+		pF->timestamp = (Int32)(U32)(LONGLONG)(pSim->nMade * pSim->period * UPC2_TIMESTAMP_RATE);	// wraps as the card's
+		val = (pSim->nMade % 10) * 0.1f;
+		for (i = 0; i < pSim->nItems; i++)
+			pF->data[i] = (i + 1 + val) * pCfg->item[i].scale_factor + pCfg->item[i].offset;
+		((U32 *) pF)[fwords - 1] = Calculate32BitChecksum(fwords - 1, (U32 *) pF);
+
+		InterlockedExchange((LONG *) &pHdr->pNew, (LONG) load);
+		if (load == (U32) pHdr->pLast)
+			pHdr->pLoad = pHdr->pFrame1;
+		else
+			pHdr->pLoad = (UPC2_ConvertedDataFrame_t *)(load + pHdr->FrameSize);
+	}
+	return n;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SimRunCommand -- runs the command in the command buffer (if there is a new one)
+//
+// Start and stop data collection are simulated. Flash, programming, system info and
+// diagnostic commands complete NG.
+//
+void SimRunCommand(UPC2_Sim_t * pSim)
+{
+	UPC2_CommandBuffer_t *  pCmd = (UPC2_CommandBuffer_t *) SimWord(pSim, COMMAND_BUFFER_ADDR);
+	U32                     status;
+
+	if ((pCmd->control_status & UPC2_DSP_NEW_COMMAND) == 0)
+		return;
+
+	if (Calculate32BitCRC(sizeof(UPC2_CommandBuffer_t) - 4, ((U8 *) pCmd) + 4) != pCmd->CRC)
+		status = UPC2_DSP_BAD_CRC;
+	else if ((U32) pCmd->command == UPC2_DSP_START_DATA_COLLECTION)
+		status = SimStartCollection(pSim) ? 0 : UPC2_DSP_COMPLETED_NG;
+	else if ((U32) pCmd->command == UPC2_DSP_STOP_DATA_COLLECTION)
+	{
+		pSim->collecting = FALSE;
+		status = UPC2_DSP_COMPLETED_OK;
+	}
+	else
+		status = UPC2_DSP_COMPLETED_NG;
+
+	if (pSim->collecting)
+		status |= UPC2_DSP_COLLECTING_DATA;
+	InterlockedExchange((LONG *) &pCmd->control_status, status);
+}
+unsigned __stdcall SimDspThread(void * pArg)
+{
+	long          card_ndx = (long) pArg;
+	UPC2_Sim_t *  pSim = UPC2_Card[card_ndx].pSim;
+	long          made;
+
+	while (pSim->run)
+	{
+		EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		SimRunCommand(pSim);
+		made = pSim->collecting ? SimMakeFrames(pSim) : 0;
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		if (made > 0)
+			SetEvent(UPC2_Card[card_ndx].FrameEvent);
+
+		// Woken at once by a command, otherwise make frames every msec or so
+		WaitForSingleObject(pSim->hDoorbell, 1);
+	}
+	return 0;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SimFree -- frees the emulator's memory
+//
+// StopSimulation -- stops the DSP thread and detaches the emulator from the card
+//
+//                   Under DllMain the thread isn't waited for (see UPC2_Detaching). Its memory
+//                   is only freed at process exit, when the thread is already gone, so
+//                   disconnect a simulated card before FreeLibrary. HpiLock isn't taken then
+//                   either -- the thread may have been ended holding it.
+//
+void SimFree(UPC2_Sim_t * pSim)
+{
+	if (pSim->hDoorbell != NULL)
+		CloseHandle(pSim->hDoorbell);
+	free(pSim->pIram);
+	free(pSim->pSdram);
+	free(pSim);
+}
+void StopSimulation(long card_ndx)
+{
+	UPC2_Sim_t * pSim = UPC2_Card[card_ndx].pSim;
+
+	pSim->run = 0;
+	SetEvent(pSim->hDoorbell);
+	if (!UPC2_Detaching)
+		WaitForSingleObject(pSim->hThread, INFINITE);
+	CloseHandle(pSim->hThread);
+	InterlockedDecrement(&UPC2_Card[card_ndx].FrameNotify);
+
+	if (!UPC2_Detaching)
+		EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	UPC2_Card[card_ndx].pHpi = &HpiHwOps;
+	UPC2_Card[card_ndx].pSim = NULL;
+	if (!UPC2_Detaching)
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	if (!UPC2_Detaching || UPC2_ProcessExit)
+		SimFree(pSim);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
 // WriteToLocalAddressSpace -- performs virtual write of SDRAM
 //
 // parameters:
@@ -1271,10 +2723,11 @@ DllExport long __stdcall UPC2_PCI_ReadFromLocalBus(long card_ndx, U32 src, void
 // 
 DllExport long __stdcall WriteToLocalAddressSpace(long card_ndx, void * src, U32 local_addr, U32 size)
 {
-   U32          Va = UPC2_Va[card_ndx]; 
-	U32          Fac = UPC2_Fac[card_ndx]; 
-	U32          i,j;
-	U32          wrt_size = 32;
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+	U32          i;
+#if SOFTWARE_HRDY != 0
+	U32          j;
+#endif
 	char         str[100];
    
 	//LARGE_INTEGER t0, t1, frq, tm, tf, tg;
@@ -1286,84 +2739,67 @@ DllExport long __stdcall WriteToLocalAddressSpace(long card_ndx, void * src, U32
 	//QueryPerformanceCounter(&t1);
 	//tm.QuadPart = t1.QuadPart-t0.QuadPart;
 
-	while (size)
+	if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
+	{
+		sprintf(str, "Bad address request %x",local_addr);
+		OutputDebugString(str);
+		return UPC2_COMM_ERR;
+	}
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	// Setup HPIA
+	for (i = 0; i < 10000; i++)
 	{
-		// Setup HPIA
-		for (i = 0; i < 10000; i++)
-		{
-			if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
-			{
-				sprintf(str, "Bad address request %x",local_addr);
-				OutputDebugString(str);
-				return UPC2_COMM_ERR;
-			}
 #if SOFTWARE_HRDY != 0	
-			// Wait for HRDY bit to be one
-			for (j = 0; j < 100; j++)
-			{
-				if ((*(U32*)Va & 0x00000008) != 0)
-					break;
-			}
-			if (j == 100)
-				return UPC2_COMM_ERR;
-#endif
-			*(U32*)(Va + 4*Fac) = local_addr; 
-			if (*(U32*)(Va + 4*Fac) == local_addr)
+		// Wait for HRDY bit to be one
+		for (j = 0; j < 100; j++)
+		{
+			if ((pHpi->ReadHPIC(card_ndx) & 0x00000008) != 0)
 				break;
 		}
-
-		if (size < 40)
-			wrt_size = size;
-
-		// Write data to HPID
-		//for (i = 0; i < wrt_size; i += 4)
-		for (i = 0; i < size; i += 4)
+		if (j == 100)
 		{
-#if SOFTWARE_HRDY != 0
-
-			// Wait for HRDY bit to be one
-			for (j = 0; j < 100; j++)
-			{
-				if ((*(U32*)Va & 0x00000008) != 0)
-					break;
-			}
-			if (j == 100)
-				return UPC2_COMM_ERR;
-#endif			
-
-
-			// SPRZ173M workaround: do a fixed-mode access on the last access
-#ifdef SPRZ173M
-			if ( i < (size - 4))
-				*(U32*)(Va + 8*Fac) = *(U32*)((U32)src + i);
-			else
-				*(U32*)(Va + 0xc*Fac)	= *(U32*)((U32)src + i);
-#else
-			*(U32*)(Va + 8*Fac) = *(U32*)((U32)src + i);
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+			return UPC2_COMM_ERR;
+		}
 #endif
+		pHpi->WriteHPIA(card_ndx, local_addr); 
+		if (pHpi->ReadHPIA(card_ndx) == local_addr)
+			break;
+	}
+
+	// Write data to HPID
+#if SOFTWARE_HRDY != 0
+	for (i = 0; i < size; i += 4)
+	{
+		// Wait for HRDY bit to be one
+		for (j = 0; j < 100; j++)
+		{
+			if ((pHpi->ReadHPIC(card_ndx) & 0x00000008) != 0)
+				break;
+		}
+		if (j == 100)
+		{
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+			return UPC2_COMM_ERR;
 		}
-		//(U32)src += wrt_size;
-		//local_addr+= wrt_size;
-		//size -= wrt_size;
-		size = 0;
+		HpidWrite(card_ndx, (U32*)((U32)src + i), 1, i == size - 4);
 	}
+#else
+	HpidWrite(card_ndx, (U32*)src, size / 4, TRUE);
+#endif
+
 	//QueryPerformanceCounter(&t0);
 	//tf.QuadPart = t0.QuadPart-t1.QuadPart;
 
-	//for (i=0; i<size; i += sizeof(U32))
-	// {
-	//     *(U32*)((U32)src + offset + i) = *(U32*)((U32)src + i);
-	// }
-	//QueryPerformanceCounter(&t1);
-	//tg.QuadPart = t1.QuadPart-t0.QuadPart;
-
 	//dtm= (double)tm.QuadPart/(double)frq.QuadPart;
 	//dtf= (double)tf.QuadPart/(double)frq.QuadPart;
-	//dtg= (double)tg.QuadPart/(double)frq.QuadPart;
 
 	// MaxG 9-9-08 Added setting HPIA to flush write buffer
 	//    See HPI Guide sec 4.2.3
-	*(U32*)(Va + 4*Fac) = local_addr;
+	pHpi->WriteHPIA(card_ndx, local_addr);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 
 	return UPC2_NORMAL_RETURN;
 }
@@ -1383,10 +2819,11 @@ DllExport long __stdcall WriteToLocalAddressSpace(long card_ndx, void * src, U32
 //
 DllExport long __stdcall ReadFromLocalAddressSpace(long card_ndx, U32 local_addr, void * dest, U32 size)
 {
-	U32          Va = UPC2_Va[card_ndx];
-	U32          Fac = UPC2_Fac[card_ndx]; 
-	U32          i,j;
-	U32          rd_size = 32;
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+	U32          j;
+#if SOFTWARE_HRDY != 0
+	U32          i;
+#endif
 	char         str[100];
 
 	//LARGE_INTEGER t0, t1, frq, tm, tf, tg;
@@ -1399,8 +2836,6 @@ DllExport long __stdcall ReadFromLocalAddressSpace(long card_ndx, U32 local_addr
 	//tm.QuadPart = t1.QuadPart-t0.QuadPart;
 	//QueryPerformanceCounter(&t0);
 
-    Va = UPC2_Va[card_ndx];
-
 	// Setup HPIA
 	if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
 	{
@@ -1409,26 +2844,32 @@ DllExport long __stdcall ReadFromLocalAddressSpace(long card_ndx, U32 local_addr
 		return UPC2_COMM_ERR;
 	}
 
-	*(U32*)(Va + 4*Fac) = local_addr;
-	j = *(U32*)(Va + 4*Fac);		// check
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	pHpi->WriteHPIA(card_ndx, local_addr);
+	j = pHpi->ReadHPIA(card_ndx);		// check
 	// Read data from HPID (auto-increment)
+#if SOFTWARE_HRDY != 0
 	for (i = 0; i < size; i += 4)
 	{
-#if SOFTWARE_HRDY != 0
 		// Wait for HRDY bit to be one
 		for (j = 0; j < 100; j++)
 		{
-			if ((*(U32*)Va & 0x00000008) != 0)
+			if ((pHpi->ReadHPIC(card_ndx) & 0x00000008) != 0)
 				break;
 		}
 		if (j == 100)
+		{
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 			return UPC2_COMM_ERR;
-#endif
-		//*(U32*)((U32) dest + i) = *(U32*)(Va + 0xc);		// fixed-mode access
-		*(U32*)((U32) dest + i) = *(U32*)(Va + 0x8*Fac);				  // auto-increment mode
+		}
+		pHpi->ReadHPID(card_ndx, (U32*)((U32) dest + i), 1);
 	}
+#else
+	pHpi->ReadHPID(card_ndx, (U32*)dest, size / 4);
+#endif
 	//QueryPerformanceCounter(&t1);
     //tg.QuadPart = t1.QuadPart - t0.QuadPart - tm.QuadPart;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1448,61 +2889,516 @@ DllExport long __stdcall ReadFromLocalAddressSpace(long card_ndx, U32 local_addr
 //
 DllExport long __stdcall ReadWithCheckFromLocalAddressSpace(long card_ndx, U32 local_addr, void * dest, U32 size)
 {
-	U32          Va = UPC2_Va[card_ndx];
-	U32          Fac = UPC2_Fac[card_ndx]; 
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+#if SOFTWARE_HRDY != 0
 	U32          i,j;
+#endif
 	U32          ck_word, cw;
+	long         k;
 	char         str[100];
 
-	//for (k = 0; k < READ_DATA_MAX_TRIES; k++)
-	//{
-		// Setup HPIA
-		if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
-		{
-			sprintf(str, "Bad address request %x",local_addr);
-			OutputDebugString(str);
-			return UPC2_COMM_ERR;
-		}
+	if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
+	{
+		sprintf(str, "Bad address request %x",local_addr);
+		OutputDebugString(str);
+		return UPC2_COMM_ERR;
+	}
 
-		*(U32*)(Va + 4*Fac) = local_addr;
+	for (k = 0; k < READ_DATA_MAX_TRIES; k++)
+	{
+		// Setup HPIA
+		EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		pHpi->WriteHPIA(card_ndx, local_addr);
 
+#if SOFTWARE_HRDY != 0
 		// Read data from HPID (auto-increment)
 		for (i = 0; i < size -  4; i += 4)
 		{
-#if SOFTWARE_HRDY != 0
 			// Wait for HRDY bit to be one
 			for (j = 0; j < 100; j++)
 			{
-				if ((*(U32*)Va & 0x00000008) != 0)
+				if ((pHpi->ReadHPIC(card_ndx) & 0x00000008) != 0)
 					break;
 			}
 			if (j == 100)
+			{
+				LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 				return UPC2_COMM_ERR;
-#endif
-			//*(U32*)((U32) dest + i) = *(U32*)(Va + 0xc);		// fixed-mode access
-			*(U32*)((U32) dest + i) = *(U32*)(Va + 0x8*Fac);				  // auto-increment mode
+			}
+			pHpi->ReadHPID(card_ndx, (U32*)((U32) dest + i), 1);				  // auto-increment mode
 		}
-		// Read check word and compare to calculated value
-		ck_word = *(U32*)(Va + 0xc*Fac);		// fixed-mode access
 		cw = Calculate32BitChecksum((size - 4)/4, (U32 *) dest);
-        
-        // For Teledyne
+#else
+		// Read data from HPID (auto-increment) summing as it comes in
+		cw = pHpi->ReadHPID(card_ndx, (U32 *) dest, (size - 4)/4);
+#endif
+		// Read check word and compare to calculated value
+		ck_word = pHpi->ReadHPIDFixed(card_ndx);		// fixed-mode access
 		if (cw != ck_word)
-            return UPC2_CKSUM_ERR;
-        else
-          	return UPC2_NORMAL_RETURN;
+			UPC2_Card[card_ndx].Loss.retries++;
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 
-		//	break;
-		// for DEBUG
-		//retry_count++;
-	//}
-    // for DEBUG
-    //frame_count ++;
+		if (cw == ck_word)
+			return UPC2_NORMAL_RETURN;
+	}
+	return UPC2_CKSUM_ERR;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadFramesWithCheckFromLocalAddressSpace -- reads consecutive converted data frames in a single
+//                                             burst and verifies the check word of each frame
+//
+// parameters:
+//
+// card_ndx   -- long 0, 1, 2, .. representing the card's index
+// local_addr -- local address of the first frame
+// nFrames    -- number of frames to read (the frames must not wrap)
+// frm_size   -- size of one frame in bytes (including checksum) (must be a multiple of 4)
+// dest       -- pointer to destination buffer
+// frm_incr   -- spacing (in bytes) of the frames in the destination buffer
+//
+// See ReadFramesVerified.
+//
+// Returns -- negative if an error occurs
+//			  UPC2_COMM_ERR	if bad address or frame size
+//			  UPC2_CKSUM_ERR if a check word does not verify after READ_DATA_MAX_TRIES re-reads
+//
+DllExport long __stdcall ReadFramesWithCheckFromLocalAddressSpace(long card_ndx, U32 local_addr, long nFrames,
+																  U32 frm_size, void * dest, U32 frm_incr)
+{
+	long nGood;
+
+	return ReadFramesVerified(card_ndx, local_addr, nFrames, frm_size, dest, frm_incr, &nGood);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadFramesVerified -- ReadFramesWithCheckFromLocalAddressSpace, also giving the number of
+//                       frames verified before a failure
+//
+// HPIA is set up once for the whole burst instead of once per frame. The frames (less their
+// check words) are read straight into the destination buffer (auto-increment, last word
+// fixed-mode) with the checksum accumulated as the words come in (see HpidReadSum_Fac1).
+// A request larger than BURST_BUF_SIZE is read in as many bursts as needed so the HPI isn't
+// held for too long.
+//
+// Every frame of a burst is verified. Only the frames that fail are read again (one at a time,
+// up to READ_DATA_MAX_TRIES times, see ReadWithCheckFromLocalAddressSpace). If more than
+// REREAD_MAX frames of a burst fail the errors are clustered: the burst is read again from the
+// first failure at half the length. The card's burst limit shrinks when two or more frames of
+// a burst fail and doubles again after BURST_GROW_CLEAN clean bursts.
+//
+// pGood      -- set to the number of frames verified (all of them, or the frames before the
+//               one that failed every re-read)
+//
+// Returns -- negative if an error occurs
+//			  UPC2_COMM_ERR	if bad address or frame size
+//			  UPC2_CKSUM_ERR if a check word does not verify after READ_DATA_MAX_TRIES re-reads
+//
+long ReadFramesVerified(long card_ndx, U32 local_addr, long nFrames, U32 frm_size, void * dest,
+						U32 frm_incr, long * pGood)
+{
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+	UPC2_Card_t  * pCard = &UPC2_Card[card_ndx];
+	U32          fwords, cw, ck_word;
+	long         bad[REREAD_MAX];
+	long         k, n, nBad, nMax;
+	U8           * pDest = (U8 *) dest;
+	char         str[100];
+
+	*pGood = 0;
+	if (frm_size < 8 || frm_size > BURST_BUF_SIZE || (frm_size & 3) != 0)
+		return UPC2_COMM_ERR;
+
+	fwords = frm_size / 4;
+	nMax = BURST_BUF_SIZE / frm_size;
+	while (nFrames > 0)
+	{
+		n = (pCard->BurstLimit > 0 && pCard->BurstLimit < nMax) ? pCard->BurstLimit : nMax;
+		if (n > nFrames)
+			n = nFrames;
+
+		// Setup HPIA
+		if (local_addr >= 0x60000000 && local_addr <= 0x7fffffff)
+		{
+			sprintf(str, "Bad address request %x",local_addr);
+			OutputDebugString(str);
+			return UPC2_COMM_ERR;
+		}
+		EnterCriticalSection(&pCard->HpiLock);
+		pHpi->WriteHPIA(card_ndx, local_addr);
+
+		// Read the frames from HPID (auto-increment) ending with a fixed-mode access
+		nBad = 0;
+		for (k = 0; k < n; k++)
+		{
+			cw = pHpi->ReadHPID(card_ndx, (U32 *) (pDest + k * frm_incr), fwords - 1);
+			if (k < n - 1)
+				pHpi->ReadHPID(card_ndx, &ck_word, 1);
+			else
+				ck_word = pHpi->ReadHPIDFixed(card_ndx);
+			if (cw != ck_word)
+			{
+				if (nBad < REREAD_MAX)
+					bad[nBad] = k;
+				nBad++;
+			}
+		}
+
+		// Adapt the burst length to the error rate (still holding the HPI, which guards the
+		// counters as well)
+		if (nBad >= 2)
+		{
+			pCard->BurstLimit = (n > 1) ? n / 2 : 1;
+			pCard->BurstClean = 0;
+		}
+		else if (nBad == 0 && pCard->BurstLimit > 0 && ++pCard->BurstClean >= BURST_GROW_CLEAN)
+		{
+			pCard->BurstLimit = (pCard->BurstLimit * 2 < nMax) ? pCard->BurstLimit * 2 : 0;
+			pCard->BurstClean = 0;
+		}
+		pCard->Loss.cksum_errors += nBad;
+		LeaveCriticalSection(&pCard->HpiLock);
+
+		// Clustered errors -- keep the frames before the first failure, read the rest again
+		// in shorter bursts
+		if (nBad > REREAD_MAX)
+			n = bad[0];
+		else
+		{
+			// Re-read just the frames that failed
+			for (k = 0; k < nBad; k++)
+			{
+				if (ReadWithCheckFromLocalAddressSpace(card_ndx, local_addr + bad[k] * frm_size,
+													   pDest + bad[k] * frm_incr, frm_size) < 0)
+				{
+					InterlockedIncrement((LONG volatile *)&pCard->Loss.cksum_failed);
+					*pGood += bad[k];
+					return UPC2_CKSUM_ERR;
+				}
+			}
+		}
+		local_addr += n * frm_size;
+		pDest += n * frm_incr;
+		nFrames -= n;
+		*pGood += n;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SetHPIA -- sets the HPI address register and verifies it (caller holds HpiLock)
+//
+// Returns -- negative if an error occurs
+//			  UPC2_COMM_ERR	if HPIA can't be set
+//
+long SetHPIA(long card_ndx, U32 local_addr)
+{
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+	U32 i;
+
+	for (i = 0; i < 10000; i++)
+	{
+		pHpi->WriteHPIA(card_ndx, local_addr); 
+		if (pHpi->ReadHPIA(card_ndx) == local_addr)
+			return UPC2_NORMAL_RETURN;
+	}
+	return UPC2_COMM_ERR;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HpidWrite -- writes words to HPID (auto-increment) (caller holds HpiLock)
+//
+// last -- TRUE if this is the last access before HPIA is set again (SPRZ173M workaround)
+//
+void HpidWrite(long card_ndx, U32 * src, U32 nwords, BOOL last)
+{
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+
+#ifdef SPRZ173M
+	// SPRZ173M workaround: do a fixed-mode access on the last access
+	if (last && nwords > 0)
+	{
+		pHpi->WriteHPID(card_ndx, src, nwords - 1);
+		pHpi->WriteHPIDFixed(card_ndx, src[nwords - 1]);
+		return;
+	}
+#endif
+	pHpi->WriteHPID(card_ndx, src, nwords);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SortSegments -- validates the segments of a vectored transfer and sorts them by address
+//
+// The valid segments are returned in ppSeg (sorted by local_addr, then by position in the
+// caller's array). Invalid segments have their status set and are left out.
+//
+// Returns -- number of valid segments
+//
+int CompareSegAddr(const void * a, const void * b)
+{
+	UPC2_HpiSegment_t *pa = *(UPC2_HpiSegment_t**)a;
+	UPC2_HpiSegment_t *pb = *(UPC2_HpiSegment_t**)b;
+
+	if (pa->local_addr != pb->local_addr)
+		return (pa->local_addr < pb->local_addr) ? -1 : 1;
+	return (pa < pb) ? -1 : (pa > pb);
+}
+int CompareSegOrder(const void * a, const void * b)
+{
+	UPC2_HpiSegment_t *pa = *(UPC2_HpiSegment_t**)a;
+	UPC2_HpiSegment_t *pb = *(UPC2_HpiSegment_t**)b;
 
-	//if (k == READ_DATA_MAX_TRIES)
-	//	return UPC2_CKSUM_ERR;
-	//else
-	//	return UPC2_NORMAL_RETURN;
+	return (pa < pb) ? -1 : (pa > pb);
+}
+long SortSegments(UPC2_HpiSegment_t * pSeg, long nSegs, UPC2_HpiSegment_t ** ppSeg)
+{
+	long i,n;
+	U32  last;
+
+	for (i = 0, n = 0; i < nSegs; i++)
+	{
+		last = pSeg[i].local_addr + pSeg[i].size - 4;
+		if (pSeg[i].size == 0 || (pSeg[i].size & 3) != 0 || (pSeg[i].local_addr & 3) != 0 ||
+			 pSeg[i].buf == NULL || last < pSeg[i].local_addr)
+		{
+			pSeg[i].status = UPC2_INVALID_PARAM;
+			continue;
+		}
+		if ((pSeg[i].local_addr >= 0x60000000 && pSeg[i].local_addr <= 0x7fffffff) ||
+			 (last >= 0x60000000 && last <= 0x7fffffff) ||
+			 (pSeg[i].local_addr < 0x60000000 && last > 0x7fffffff))
+		{
+			pSeg[i].status = UPC2_COMM_ERR;
+			continue;
+		}
+		pSeg[i].status = UPC2_NORMAL_RETURN;
+		ppSeg[n++] = &pSeg[i];
+	}
+	if (n > 1)
+		qsort(ppSeg, n, sizeof(UPC2_HpiSegment_t*), CompareSegAddr);
+	return n;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// WriteToLocalAddressSpaceV -- writes several regions of SDRAM in one call
+//
+// The segments are sorted by address and segments that are adjacent or overlap are written
+// in one HPIA burst. Where segments overlap the later one in pSeg wins. HpiLock is held for
+// the whole call so the writes aren't interleaved with other threads' transfers.
+//
+// parameters:
+//
+// card_ndx   -- long 0, 1, 2, .. representing the card's index
+// pSeg       -- array of segments (local_addr, buf, size). size must be a multiple of 4.
+// nSegs      -- number of segments
+//
+// Returns -- negative if an error occurs (pSeg[i].status is set for every segment)
+//			  UPC2_COMM_ERR		  if HPIA can't be set
+//			  UPC2_INVALID_PARAM  if a segment is malformed
+//			  UPC2_OUT_OF_MEMORY  if no memory for the segment list
+//
+DllExport long __stdcall WriteToLocalAddressSpaceV(long card_ndx, UPC2_HpiSegment_t * pSeg, long nSegs)
+{
+	UPC2_HpiSegment_t  *SegList[HPI_SEG_LOCAL];
+	UPC2_HpiSegment_t  **ppSeg = SegList;
+	U8                 *pTmp;
+	U32                start,end,last_addr = 0;
+	long               i,s,e,n,k;
+	long               ret_val = UPC2_NORMAL_RETURN;
+	long               err;
+	BOOL               overlap;
+
+	if (nSegs <= 0 || pSeg == NULL)
+		return UPC2_INVALID_PARAM;
+
+#if SOFTWARE_HRDY != 0
+	// No burst path with software HRDY: one transfer per segment
+	for (i = 0; i < nSegs; i++)
+	{
+		pSeg[i].status = WriteToLocalAddressSpace(card_ndx, pSeg[i].buf, pSeg[i].local_addr, pSeg[i].size);
+		if (pSeg[i].status < 0 && ret_val == UPC2_NORMAL_RETURN)
+			ret_val = pSeg[i].status;
+	}
+	return ret_val;
+#endif
+
+	if (nSegs > HPI_SEG_LOCAL)
+	{
+		if ((ppSeg = (UPC2_HpiSegment_t**)malloc(nSegs * sizeof(UPC2_HpiSegment_t*))) == NULL)
+			return UPC2_OUT_OF_MEMORY;
+	}
+	n = SortSegments(pSeg, nSegs, ppSeg);
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	for (s = 0; s < n; s = e)
+	{
+		// Gather the segments that continue or overlap this one
+		start = ppSeg[s]->local_addr;
+		end = start + ppSeg[s]->size;
+		overlap = FALSE;
+		for (e = s + 1; e < n && ppSeg[e]->local_addr <= end; e++)
+		{
+			if (ppSeg[e]->local_addr < end)
+				overlap = TRUE;
+			if (ppSeg[e]->local_addr + ppSeg[e]->size > end)
+				end = ppSeg[e]->local_addr + ppSeg[e]->size;
+		}
+
+		err = UPC2_NORMAL_RETURN;
+		pTmp = NULL;
+		if (overlap)
+		{
+			// Build the image of the burst applying the segments in the caller's order
+			if ((pTmp = (U8*)malloc(end - start)) == NULL)
+				err = UPC2_OUT_OF_MEMORY;
+			else
+			{
+				qsort(&ppSeg[s], e - s, sizeof(UPC2_HpiSegment_t*), CompareSegOrder);
+				for (k = s; k < e; k++)
+					memcpy(pTmp + (ppSeg[k]->local_addr - start), ppSeg[k]->buf, ppSeg[k]->size);
+			}
+		}
+		if (err == UPC2_NORMAL_RETURN)
+			err = SetHPIA(card_ndx, start);
+		if (err == UPC2_NORMAL_RETURN)
+		{
+			if (pTmp != NULL)
+				HpidWrite(card_ndx, (U32*)pTmp, (end - start) / 4, TRUE);
+			else
+			{
+				for (k = s; k < e; k++)
+					HpidWrite(card_ndx, (U32*)ppSeg[k]->buf, ppSeg[k]->size / 4, k == e - 1);
+			}
+			last_addr = start;
+		}
+		free(pTmp);
+
+		for (k = s; k < e; k++)
+			ppSeg[k]->status = err;
+	}
+	// Setting HPIA flushes the write buffer (HPI Guide sec 4.2.3)
+	if (n > 0)
+		UPC2_Card[card_ndx].pHpi->WriteHPIA(card_ndx, last_addr);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	if (ppSeg != SegList)
+		free(ppSeg);
+
+	for (i = 0; i < nSegs; i++)
+	{
+		if (pSeg[i].status < 0)
+			return pSeg[i].status;
+	}
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadFromLocalAddressSpaceV -- reads several regions of SDRAM in one call
+//
+// The segments are sorted by address. Segments that are adjacent, overlap or are separated by
+// no more than HPI_SEG_GAP words are read in one HPIA burst (the gap words are read and
+// discarded, which is cheaper than setting HPIA again). HpiLock is held for the whole call.
+//
+// parameters:
+//
+// card_ndx   -- long 0, 1, 2, .. representing the card's index
+// pSeg       -- array of segments (local_addr, buf, size). size must be a multiple of 4.
+// nSegs      -- number of segments
+//
+// Returns -- negative if an error occurs (pSeg[i].status is set for every segment)
+//			  UPC2_COMM_ERR		  if HPIA can't be set
+//			  UPC2_INVALID_PARAM  if a segment is malformed
+//			  UPC2_OUT_OF_MEMORY  if no memory for the segment list
+//
+DllExport long __stdcall ReadFromLocalAddressSpaceV(long card_ndx, UPC2_HpiSegment_t * pSeg, long nSegs)
+{
+	const UPC2_HpiOps_t * pHpi = UPC2_Card[card_ndx].pHpi;
+	UPC2_HpiSegment_t  *SegList[HPI_SEG_LOCAL];
+	UPC2_HpiSegment_t  **ppSeg = SegList;
+	U32                Gap[HPI_SEG_GAP];
+	U8                 *pTmp;
+	U32                start,end,cur;
+	long               i,s,e,n,k;
+	long               err;
+	BOOL               overlap;
+
+	if (nSegs <= 0 || pSeg == NULL)
+		return UPC2_INVALID_PARAM;
+
+#if SOFTWARE_HRDY != 0
+	// No burst path with software HRDY: one transfer per segment
+	for (i = 0; i < nSegs; i++)
+		pSeg[i].status = ReadFromLocalAddressSpace(card_ndx, pSeg[i].local_addr, pSeg[i].buf, pSeg[i].size);
+	for (i = 0; i < nSegs; i++)
+	{
+		if (pSeg[i].status < 0)
+			return pSeg[i].status;
+	}
+	return UPC2_NORMAL_RETURN;
+#endif
+
+	if (nSegs > HPI_SEG_LOCAL)
+	{
+		if ((ppSeg = (UPC2_HpiSegment_t**)malloc(nSegs * sizeof(UPC2_HpiSegment_t*))) == NULL)
+			return UPC2_OUT_OF_MEMORY;
+	}
+	n = SortSegments(pSeg, nSegs, ppSeg);
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	for (s = 0; s < n; s = e)
+	{
+		// Gather the segments that continue, overlap or nearly continue this one
+		start = ppSeg[s]->local_addr;
+		end = start + ppSeg[s]->size;
+		overlap = FALSE;
+		for (e = s + 1; e < n && ppSeg[e]->local_addr <= end + 4*HPI_SEG_GAP; e++)
+		{
+			if (ppSeg[e]->local_addr < end)
+				overlap = TRUE;
+			if (ppSeg[e]->local_addr + ppSeg[e]->size > end)
+				end = ppSeg[e]->local_addr + ppSeg[e]->size;
+		}
+
+		err = SetHPIA(card_ndx, start);
+		if (err == UPC2_NORMAL_RETURN && overlap)
+		{
+			// Read the burst once and hand out the pieces
+			if ((pTmp = (U8*)malloc(end - start)) == NULL)
+				err = UPC2_OUT_OF_MEMORY;
+			else
+			{
+				pHpi->ReadHPID(card_ndx, (U32*)pTmp, (end - start) / 4);
+				for (k = s; k < e; k++)
+					memcpy(ppSeg[k]->buf, pTmp + (ppSeg[k]->local_addr - start), ppSeg[k]->size);
+				free(pTmp);
+			}
+		}
+		else if (err == UPC2_NORMAL_RETURN)
+		{
+			// Auto-increment straight into the callers' buffers
+			for (k = s, cur = start; k < e; k++)
+			{
+				if (ppSeg[k]->local_addr > cur)
+					pHpi->ReadHPID(card_ndx, Gap, (ppSeg[k]->local_addr - cur) / 4);
+				pHpi->ReadHPID(card_ndx, (U32*)ppSeg[k]->buf, ppSeg[k]->size / 4);
+				cur = ppSeg[k]->local_addr + ppSeg[k]->size;
+			}
+		}
+
+		for (k = s; k < e; k++)
+			ppSeg[k]->status = err;
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	if (ppSeg != SegList)
+		free(ppSeg);
+
+	for (i = 0; i < nSegs; i++)
+	{
+		if (pSeg[i].status < 0)
+			return pSeg[i].status;
+	}
+	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -1530,10 +3426,10 @@ long SendCommandEx(long card_ndx, U32 command, long retry_mult)
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
-	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
-		return ret_val;
-
-	ret_val = SendCommand(card_ndx, command, retry_mult);
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+	if ((ret_val = IsAwaitingCommand(card_ndx)) >= 0)
+		ret_val = SendCommand(card_ndx, command, retry_mult);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return ret_val;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1558,6 +3454,8 @@ long SendCommand(long card_ndx, U32 command, long retry_mult)
 	long i,j;
 	UPC2_CommandBuffer_t     CommandBuffer;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -1573,20 +3471,24 @@ long SendCommand(long card_ndx, U32 command, long retry_mult)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == retry_mult*BUSY_TEST_TRIES)
 			continue;
 
 		// Retry if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 			continue;
 
 		// Return if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
+		{
+			LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 			return UPC2_NORMAL_RETURN;
+		}
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return UPC2_EXCEEDED_CMD_RETRY_LIMIT;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1611,7 +3513,7 @@ DllExport long __stdcall UPC2_PCI_GetInventory(long * psn)
 	long    i;
 
 	// Get the number of cards in the system
-	if ((ret_val = SelectPCI(&UPC2_Device[0], 0)) < 0)
+	if ((ret_val = SelectPCI(&UPC2_Card[0].Device, 0)) < 0)
 		return UPC2_INVALID_INDEX;
 
 	nPCI_cards = ret_val;
@@ -1628,10 +3530,10 @@ DllExport long __stdcall UPC2_PCI_GetInventory(long * psn)
             return ret_val;
 
 		// Get i-th serial number
-		if ((ret_val = UPC2_PCI_ReadSystemSerialNumber(i, &UPC2_SysSerNum[i])) < 0)
+		if ((ret_val = UPC2_PCI_ReadSystemSerialNumber(i, &UPC2_Card[i].SysSerNum)) < 0)
 			return ret_val;
 
-		*psn++ = UPC2_SysSerNum[i];
+		*psn++ = UPC2_Card[i].SysSerNum;
 	}
 	return nPCI_cards;
 }
@@ -1706,7 +3608,7 @@ DllExport long __stdcall UPC2_PCI_Connect(long card_ndx)
 
 
 	// Select n-th PLX PCI device
-	if (SelectPCI(&UPC2_Device[card_ndx], card_ndx) < 0)
+	if (SelectPCI(&UPC2_Card[card_ndx].Device, card_ndx) < 0)
 	{
 #ifdef LOG_ERROR
 		sprintf(str,"SelectPCI unsuccessful");
@@ -1723,7 +3625,7 @@ DllExport long __stdcall UPC2_PCI_Connect(long card_ndx)
 
 
 	// Open n-th PLX PCI device
-	if (OpenPCI(&UPC2_Device[card_ndx], &UPC2_hDevice[card_ndx]) < 0)
+	if (OpenPCI(&UPC2_Card[card_ndx].Device, &UPC2_Card[card_ndx].hDevice) < 0)
 		return UPC2_INVALID_INDEX;
 
 #ifdef LOG_ERROR
@@ -1745,7 +3647,18 @@ DllExport long __stdcall UPC2_PCI_Connect(long card_ndx)
 
 
 	// Set state to connected
-	UPC2_PCI_State[card_ndx] |= UPC2_CONNECTED;
+	UPC2_Card[card_ndx].PCI_State |= UPC2_CONNECTED;
+
+	// Frame-ready interrupt (UPC2_HINT_INTERRUPT builds only)
+	StartHintNotify(card_ndx);
+
+	// Load the shadow cache (config and calibration data only if present)
+	InvalidateShadow(card_ndx, SHADOW_ALL);
+	if (GetShadowMemoryMap(card_ndx) >= 0)
+	{
+		GetShadowConfig(card_ndx);
+		GetShadowCalib(card_ndx);
+	}
 
 #ifdef LOG_ERROR
 	// Log Connect success
@@ -1757,43 +3670,155 @@ DllExport long __stdcall UPC2_PCI_Connect(long card_ndx)
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// UPC2_PCI_Disconnect -- attempts to disconnect ot the n-th (zero-based_ UPC card
+// UPC2_PCI_ConnectSimulated -- connects card_ndx to an in-memory simulated card instead of a
+//                              PLX device, so the DLL can be exercised without a UPC2100
+//
+//  The emulator models the HPI registers (see HpiSim_ReadHPID), IRAM and SDRAM as laid out in
+//  upc2_def.h, and the DSP: start/stop data collection commands and a converted data frame
+//  ring of SIM_MAX_FRAMES frames filled at frames_per_sec. UPC2_PCI_Disconnect removes it.
 // 
 // parameters:
 //
-//  card_ndx -- long 0, 1, 2, .. representing the card's index
+//  card_ndx       -- long 0, 1, 2, .. representing the card's index
+//
+//  frames_per_sec -- long frame rate while collecting (0 => from the config, as the DSP)
 //
 // Returns -- negative if an error occurs.
-//			  UPC2_NO_CONNECTION 	if specified index is not connected
-//			  UPC2_INVALID_INDEX 	if no UPC card with the specified index
+//			  UPC2_INVALID_INDEX 	if card_ndx out of range
+//			  UPC2_INVALID_PARAM	if frames_per_sec < 0
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the simulated memory
+//			  UPC2_COMM_ERR		    if unable to start the DSP thread
+//			  UPC2_CONNECTED	    if already connected
 //
-DllExport long __stdcall UPC2_PCI_Disconnect(long card_ndx)
+DllExport long __stdcall UPC2_PCI_ConnectSimulated(long card_ndx, long frames_per_sec)
 {
-	long ret_val;
+	UPC2_Sim_t *             pSim;
+	UPC2_SDRAM_MemoryMap_t * pMap;
+	unsigned                 thread_id;
+	long                     ret_val;
 
-	// Check for connected 
-	if ((ret_val = IsConnected(card_ndx)) < 0)
+	if ((ret_val = IsConnected(card_ndx)) != UPC2_NO_CONNECTION)
 		return ret_val;
 
-	// Unmap BAR
-	UnMap_BAR(card_ndx);
+	if (frames_per_sec < 0)
+		return UPC2_INVALID_PARAM;
 
+	QueryPerformanceFrequency(&frq);
 
-	// Close n-th PLX PCI device
-	if (ClosePCI(UPC2_hDevice[card_ndx]) < 0)
-		return UPC2_INVALID_INDEX;
+	if ((pSim = (UPC2_Sim_t *) calloc(1, sizeof(UPC2_Sim_t))) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+	pSim->pIram = (U8 *) calloc(SIM_IRAM_SIZE, 1);
+	pSim->pSdram = (U8 *) calloc(SDRAM_END - SDRAM_BASE, 1);
+	pSim->hDoorbell = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pSim->pIram == NULL || pSim->pSdram == NULL || pSim->hDoorbell == NULL)
+	{
+		SimFree(pSim);
+		return UPC2_OUT_OF_MEMORY;
+	}
+	pSim->frames_per_sec = frames_per_sec;
+	pSim->run = 1;
+
+	// Memory map as the DSP leaves it after boot (no config or calibration data)
+	pMap = (UPC2_SDRAM_MemoryMap_t *) SimWord(pSim, SDRAM_MEMORY_MAP_ADDR);
+	pMap->pCommandBuffer = (UPC2_CommandBuffer_t *) COMMAND_BUFFER_ADDR;
+	pMap->pConvertedDataFrameHdr = (UPC2_ConvertedDataFramePoolHdr_t *) CONVERTED_DATA_FRAMES_POOL_HDR_ADDR;
+	pMap->pMovingAverageBufferHdr = (UPC2_MovingAverageBufferHdr_t *) MOVING_AVERAGE_HDR_ADDR;
+	pMap->pConvertedDataFrames = (UPC2_ConvertedDataFrame_t *) CONVERTED_DATA_FRAMES_ADDR;
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	UPC2_Card[card_ndx].pSim = pSim;
+	UPC2_Card[card_ndx].pHpi = &HpiSimOps;
+	UPC2_Card[card_ndx].Va = 0;
+	UPC2_Card[card_ndx].Fac = 1;
+	UPC2_Card[card_ndx].hDevice = NULL;
+	UPC2_Card[card_ndx].DSP_State = 0;
 
-	// Set state to not connected
-	UPC2_PCI_State[card_ndx] &=  ~UPC2_CONNECTED;
-	return UPC2_NORMAL_RETURN;
-}
-/////////////////////////////////////////////////////////////////////////////////////////////////
-//
-// UPC2_PCI_Reset -- performs a reset of the PLX chip
-// 
-// parameters:
-//
-//  card_ndx -- long 0, 1, 2, .. representing the card's index
+	// Setup HPIC
+	UPC2_Card[card_ndx].pHpi->WriteHPIC(card_ndx, 0x00010001);	  // = HWOB = 1
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	// The simulated DSP sets FrameEvent as frames are made (as the HINT thread would)
+	InterlockedIncrement(&UPC2_Card[card_ndx].FrameNotify);
+	pSim->hThread = (HANDLE) _beginthreadex(NULL, 0, SimDspThread, (void *) card_ndx, 0, &thread_id);
+	if (pSim->hThread == 0)
+	{
+		InterlockedDecrement(&UPC2_Card[card_ndx].FrameNotify);
+		UPC2_Card[card_ndx].pHpi = &HpiHwOps;
+		UPC2_Card[card_ndx].pSim = NULL;
+		SimFree(pSim);
+		return UPC2_COMM_ERR;
+	}
+
+	// Set state to connected
+	UPC2_Card[card_ndx].PCI_State |= UPC2_CONNECTED;
+
+	// Load the shadow cache (config and calibration data only if present)
+	InvalidateShadow(card_ndx, SHADOW_ALL);
+	if (GetShadowMemoryMap(card_ndx) >= 0)
+	{
+		GetShadowConfig(card_ndx);
+		GetShadowCalib(card_ndx);
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_Disconnect -- attempts to disconnect ot the n-th (zero-based_ UPC card
+// 
+// parameters:
+//
+//  card_ndx -- long 0, 1, 2, .. representing the card's index
+//
+// Returns -- negative if an error occurs.
+//			  UPC2_NO_CONNECTION 	if specified index is not connected
+//			  UPC2_INVALID_INDEX 	if no UPC card with the specified index
+//			  UPC2_STREAMING_ACTIVE if the acquisition thread hasn't stopped (still connected)
+//
+DllExport long __stdcall UPC2_PCI_Disconnect(long card_ndx)
+{
+	long ret_val;
+
+	// Check for connected 
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	// Stop the acquisition thread before the BAR goes away (and keep it if it won't stop)
+	if ((ret_val = UPC2_PCI_StopStreaming(card_ndx)) < 0 && ret_val != UPC2_STREAMING_NOT_ACTIVE)
+		return ret_val;
+	StopHintNotify(card_ndx);
+
+	// Keep the clock sync thread off the card while it goes away
+	EnterCriticalSection(&UPC2_ClockLock);
+	memset(&UPC2_Card[card_ndx].Clock, 0, sizeof(UPC2_Clock_t));
+
+	if (UPC2_Card[card_ndx].pSim != NULL)
+		StopSimulation(card_ndx);
+	else
+	{
+		// Unmap BAR
+		UnMap_BAR(card_ndx);
+
+
+		// Close n-th PLX PCI device
+		if (ClosePCI(UPC2_Card[card_ndx].hDevice) < 0)
+			ret_val = UPC2_INVALID_INDEX;
+	}
+
+	// Set state to not connected (the cursors go with the connection)
+	UPC2_Card[card_ndx].PCI_State &=  ~UPC2_CONNECTED;
+	memset(UPC2_Card[card_ndx].Cursor, 0, sizeof(UPC2_Card[card_ndx].Cursor));
+	UPC2_Card[card_ndx].nCursors = 0;
+	LeaveCriticalSection(&UPC2_ClockLock);
+	InvalidateShadow(card_ndx, SHADOW_ALL);
+	return (ret_val < 0) ? ret_val : UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_Reset -- performs a reset of the PLX chip
+// 
+// parameters:
+//
+//  card_ndx -- long 0, 1, 2, .. representing the card's index
 //
 // Returns -- negative if an error occurs.
 //			  UPC2_NO_CONNECTION 	if specified index is not connected
@@ -1802,22 +3827,26 @@ DllExport long __stdcall UPC2_PCI_Disconnect(long card_ndx)
 DllExport long __stdcall UPC2_PCI_Reset(long card_ndx)
 {
 	long    ret_val;
-    U32     Va = UPC2_Va[card_ndx]; 
 
 	// Check for connected 
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
 	// Reset n-th PLX PCI device
-	PlxPciBoardReset(UPC2_hDevice[card_ndx]);
-
-	// Delay ~ one second
-	Sleep(1000);
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	if (UPC2_Card[card_ndx].pSim == NULL)
+	{
+		PlxPciBoardReset(UPC2_Card[card_ndx].hDevice);
 
+		// Delay ~ one second
+		Sleep(1000);
+	}
 
 	// Setup HPIC
-	*(U32*)(Va) = 0x00010001;	  // = HWOB = 1 => first halfword is least significant
+	UPC2_Card[card_ndx].pHpi->WriteHPIC(card_ndx, 0x00010001);	  // = HWOB = 1 => first halfword is least significant
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
 
+	InvalidateShadow(card_ndx, SHADOW_ALL);
 
 	return UPC2_NORMAL_RETURN;
 }
@@ -1869,9 +3898,11 @@ DllExport long __stdcall UPC2_PCI_SetTimestamp(long timestamp)
 		QueryPerformanceCounter(&t0);
 
 		// Check for connected 
-		if (UPC2_PCI_State[i] & UPC2_CONNECTED)
+		if (UPC2_Card[i].PCI_State & UPC2_CONNECTED)
 		{
 			WriteToLocalAddressSpace(i, ts, TIMESTAMP_ADDR, sizeof(ts));
+			ResetClock(i);
+			UPC2_Card[i].Unwrap.timestamp_valid = FALSE;
 			ret_val = UPC2_NORMAL_RETURN;
 
 			QueryPerformanceCounter(&t1);
@@ -1888,6 +3919,71 @@ DllExport long __stdcall UPC2_PCI_SetTimestamp(long timestamp)
 	return ret_val;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// WriteConfigDelta -- writes only the words of a UPC2_Config that differ from the shadow copy
+//
+// The changed words are coalesced into runs. Runs separated by DELTA_HPIA_COST words or less
+// are merged since rewriting the gap is no dearer than setting HPIA again. The runs are written
+// with WriteToLocalAddressSpaceV. If they would cost more than DELTA_FULL_PERCENT of a full
+// write the whole struct is written.
+//
+// The caller must hold a valid shadow copy (SHADOW_CONFIG) of the config in IRAM.
+//
+// Returns -- negative if an error occurs
+//			-- positive number of 32-bit words written
+//
+long WriteConfigDelta(long card_ndx, UPC2_Config_t * pUPC2_Config)
+{
+	U32  *pNew = (U32*)pUPC2_Config;
+	U32  *pOld = (U32*)&UPC2_Card[card_ndx].Config;
+	U32  nwords = sizeof(UPC2_Config_t) / 4;
+	UPC2_HpiSegment_t Seg[sizeof(UPC2_Config_t) / 8 + 1];
+	long nSegs = 0;
+	U32  cost = 0;
+	U32  i,end;
+	long ret_val;
+
+	// Find the runs of changed words
+	for (i = 0; i < nwords; i++)
+	{
+		if (pNew[i] == pOld[i])
+			continue;
+
+		end = (nSegs > 0) ? (Seg[nSegs - 1].local_addr + Seg[nSegs - 1].size - UPC2_CONFIG_STRUCT_ADDR) / 4 : 0;
+		if (nSegs > 0 && i - end <= DELTA_HPIA_COST)
+		{
+			// Close enough to the last run to extend it
+			cost += i - end + 1;
+			Seg[nSegs - 1].size = 4*(i + 1) - (Seg[nSegs - 1].local_addr - UPC2_CONFIG_STRUCT_ADDR);
+		}
+		else
+		{
+			Seg[nSegs].local_addr = UPC2_CONFIG_STRUCT_ADDR + 4*i;
+			Seg[nSegs].buf = &pNew[i];
+			Seg[nSegs].size = 4;
+			nSegs++;
+			cost += DELTA_HPIA_COST + 1;
+		}
+	}
+
+	if (nSegs == 0)
+		return 0;
+
+	if (cost * 100 > (nwords + DELTA_HPIA_COST) * DELTA_FULL_PERCENT)
+	{
+		ret_val = WriteToLocalAddressSpace(card_ndx, pUPC2_Config, 
+									 UPC2_CONFIG_STRUCT_ADDR, sizeof(UPC2_Config_t));
+		return (ret_val < 0) ? ret_val : (long)nwords;
+	}
+
+	if ((ret_val = WriteToLocalAddressSpaceV(card_ndx, Seg, nSegs)) < 0)
+		return ret_val;
+
+	for (i = 0, cost = 0; i < (U32)nSegs; i++)
+		cost += Seg[i].size / 4;
+	return (long)cost;
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
 // UPC2_PCI_UploadConfig -- writes the UPC2_Config structure to SDRAM
@@ -1911,15 +4007,16 @@ DllExport long __stdcall UPC2_PCI_UploadConfig(long card_ndx, UPC2_Config_t * pU
 
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 	{
-		// Not connected. Set demo_config
-		demo_config[card_ndx].nItems = pUPC2_Config->nItems;
-		demo_config[card_ndx].nSbits = pUPC2_Config->nSbits;
-		demo_config[card_ndx].frame_no = 0;
-		demo_config[card_ndx].scan_interval = pUPC2_Config->scan_interval;
+		// Not connected. Set Demo config
+		UPC2_Card[card_ndx].Demo.nItems = pUPC2_Config->nItems;
+		UPC2_Card[card_ndx].Demo.nSbits = pUPC2_Config->nSbits;
+		UPC2_Card[card_ndx].Demo.frame_no = 0;
+		UPC2_Card[card_ndx].Demo.scan_interval = pUPC2_Config->scan_interval;
+		SetFramePeriod(card_ndx, pUPC2_Config);
 		for (i = 0; i < pUPC2_Config->nItems; i++)
 		{
-			demo_config[card_ndx].scale[i] = pUPC2_Config->item[i].scale_factor; 
-			demo_config[card_ndx].offset[i] = pUPC2_Config->item[i].offset; 
+			UPC2_Card[card_ndx].Demo.scale[i] = pUPC2_Config->item[i].scale_factor; 
+			UPC2_Card[card_ndx].Demo.offset[i] = pUPC2_Config->item[i].offset; 
 		}
 		return ret_val;
 	}
@@ -1933,12 +4030,30 @@ DllExport long __stdcall UPC2_PCI_UploadConfig(long card_ndx, UPC2_Config_t * pU
 		if ((pUPC2_Config->nSbits & 1) == 1)
 			return UPC2_ODD_NUMBER_OF_SBITS;
 	}
-	// Copy UPC2_Config to SDRAM
-	WriteToLocalAddressSpace(card_ndx, pUPC2_Config, 
+	// Copy UPC2_Config to SDRAM. Only the changed words if IRAM holds a known config.
+	if ((UPC2_Card[card_ndx].ShadowValid & SHADOW_CONFIG) &&
+		 UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config != 0)
+		ret_val = WriteConfigDelta(card_ndx, pUPC2_Config);
+	else
+		ret_val = WriteToLocalAddressSpace(card_ndx, pUPC2_Config, 
 									 UPC2_CONFIG_STRUCT_ADDR, sizeof(UPC2_Config_t));
+	if (ret_val < 0)
+	{
+		// IRAM contents unknown
+		InvalidateShadow(card_ndx, SHADOW_CONFIG);
+		return ret_val;
+	}
+	SetFramePeriod(card_ndx, pUPC2_Config);
 	// Set SDRAM Memory map entry 
-	WriteToLocalAddressSpace(card_ndx, &addr, 
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config != (UPC2_Config_t*)addr)
+		WriteToLocalAddressSpace(card_ndx, &addr, 
 									 UPC2_CONFIG_STRUCT_MM_ADDR, sizeof(U32));
+
+	// Keep the shadow copy in step with IRAM
+	if (pUPC2_Config != &UPC2_Card[card_ndx].Config)
+		memcpy(&UPC2_Card[card_ndx].Config, pUPC2_Config, sizeof(UPC2_Config_t));
+	UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config = (UPC2_Config_t*)addr;
+	UPC2_Card[card_ndx].ShadowValid |= SHADOW_CONFIG;
 	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1961,61 +4076,25 @@ DllExport long __stdcall UPC2_PCI_UploadConfig(long card_ndx, UPC2_Config_t * pU
 //
 DllExport long __stdcall UPC2_PCI_UploadConfigFromPath(long card_ndx, char * pFilePath)
 {
-	FILE     *handle;
-	size_t   numread;
-	long     ret_val = 0;
-	long     i;
-	U32      addr = UPC2_CONFIG_STRUCT_ADDR;
+	FILE          *handle;
+	size_t        numread;
+	UPC2_Config_t Config;
 
 	// Open file
 
 	if ((handle = fopen(pFilePath, "rb")) == NULL)
 	{
 		OutputDebugString("Unable to open file");
-		ret_val = UPC2_FILE_OPEN_ERR;
-		return ret_val;
+		return UPC2_FILE_OPEN_ERR;
 	}
 
-	numread = fread((void *)&UPC2_Config, sizeof(UPC2_Config_t), 1, handle);
+	// Read into a local so the card's shadow copy is only replaced once the upload succeeds
+	numread = fread((void *)&Config, sizeof(UPC2_Config_t), 1, handle);
+	fclose(handle);
 	if (numread != 1)
-	{
-		ret_val = UPC2_CONFIG_NOT_FOUND;
-		return ret_val;
-	}
-
-	if ((ret_val = IsConnected(card_ndx)) < 0)
-	{
-		// Not connected. Set demo_config
-		demo_config[card_ndx].nItems = UPC2_Config.nItems;
-		demo_config[card_ndx].nSbits = UPC2_Config.nSbits;
-		demo_config[card_ndx].frame_no = 0;
-		demo_config[card_ndx].scan_interval = UPC2_Config.scan_interval;
-		for (i = 0; i < UPC2_Config.nItems; i++)
-		{
-			demo_config[card_ndx].scale[i] = UPC2_Config.item[i].scale_factor; 
-			demo_config[card_ndx].offset[i] = UPC2_Config.item[i].offset; 
-		}
-		return ret_val;
-	}
-
-	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
-		return ret_val;
-
-	// If returning raw data verify even number of sbits
-	if ((UPC2_Config.op_flags & 0x000000ff) == 0x00000052)
-	{
-		if ((UPC2_Config.nSbits & 1) == 1)
-			return UPC2_ODD_NUMBER_OF_SBITS;
-	}
-
+		return UPC2_CONFIG_NOT_FOUND;
 
-	// Copy UPC2_Config to SDRAM
-	WriteToLocalAddressSpace(card_ndx, &UPC2_Config, 
-									 UPC2_CONFIG_STRUCT_ADDR, sizeof(UPC2_Config_t));
-	// Set SDRAM Memory map entry 
-	WriteToLocalAddressSpace(card_ndx, &addr, 
-									 UPC2_CONFIG_STRUCT_MM_ADDR, sizeof(U32));
-	return UPC2_NORMAL_RETURN;
+	return UPC2_PCI_UploadConfig(card_ndx, &Config);
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -2044,12 +4123,22 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 
 	QueryPerformanceCounter(&t0);
 
+	// The DSP numbers the frames of a collection from the start
+	if (card_ndx < MAX_PCI_CARDS && card_ndx >= 0)
+	{
+		UPC2_Card[card_ndx].Unwrap.frame_no_valid = FALSE;
+		UPC2_PCI_ResetLossStats(card_ndx);
+		SchedReset(card_ndx);
+		for (i = 0; i < UPC2_MAX_CURSORS; i++)
+			UPC2_Card[card_ndx].Cursor[i].placed = FALSE;
+	}
+
 	tk0 = GetTickCount();
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 	{
 		// Not connected -- go to DEMO mode
-		demo_config[card_ndx].time_in_ms = GetTickCount();
-		UPC2_DSP_State[card_ndx] |= DSP_DATA_COLLECTION_STARTED;
+		UPC2_Card[card_ndx].Demo.time_in_ms = GetTickCount();
+		UPC2_Card[card_ndx].DSP_State |= DSP_DATA_COLLECTION_STARTED;
 		return ret_val;
 	}
 
@@ -2057,7 +4146,7 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 	{
 		if (ret_val == UPC2_BUSY)
 		{
-			UPC2_DSP_State[card_ndx] |= DSP_DATA_COLLECTION_STARTED;
+			UPC2_Card[card_ndx].DSP_State |= DSP_DATA_COLLECTION_STARTED;
 			return UPC2_NORMAL_RETURN;
 		}
 		else
@@ -2066,9 +4155,11 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 
 
 	// Verify UPC2_Config loaded
-	if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config == 0)
 		return UPC2_NO_CONFIG;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -2086,14 +4177,14 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_NEW_COMMAND) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_NEW_COMMAND) == 0)
 				break;
 		}
 		if (j == 1000*BUSY_TEST_TRIES)
 			continue;
 
 		// Retry if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 			continue;
 
 		// Wait for collecting data
@@ -2103,7 +4194,7 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 				continue;
 
 			// Return if DSP collecting data
-			if (cmd_status & UPC2_DSP_COLLECTING_DATA)
+			if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COLLECTING_DATA)
 			{
 
 
@@ -2113,7 +4204,8 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 				tm.QuadPart = t1.QuadPart-t0.QuadPart;
 				dtm= (double)tm.QuadPart/(double)frq.QuadPart;
 
-				UPC2_DSP_State[card_ndx] |= DSP_DATA_COLLECTION_STARTED;
+				UPC2_Card[card_ndx].DSP_State |= DSP_DATA_COLLECTION_STARTED;
+				LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 				return UPC2_NORMAL_RETURN;
 			}
 		}
@@ -2122,6 +4214,7 @@ DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx)
 			continue;
 
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return UPC2_EXCEEDED_CMD_RETRY_LIMIT;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -2148,41 +4241,44 @@ DllExport long __stdcall UPC2_PCI_SetSFandOffset(long card_ndx, float scale_fact
    long  ret_val;
    Uint32 sf_offset;
    Uint32 offset_offset;
+   UPC2_HpiSegment_t Seg[2];
    
 
    if ((ret_val = IsConnected(card_ndx)) < 0)
       return ret_val;
 
-   // Verify UPC2_Config loaded
-   if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
-      return UPC2_NO_CONFIG;
-
-   // Copy UPC2_Config to DLL's buffer
-   ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CONFIG_STRUCT_ADDR,
-                                            &UPC2_Config, sizeof(UPC2_Config_t));
-   if (ret_val < 0)
+   // Verify UPC2_Config loaded (shadow copy)
+   if ((ret_val = GetShadowConfig(card_ndx)) < 0)
       return ret_val;
 
    // Get number of items
-   ret_val = UPC2_Config.nItems;
+   ret_val = UPC2_Card[card_ndx].Config.nItems;
    if ((item >= ret_val) || (item < 0))
       return UPC2_INVALID_ITEM;
     
     
    // Get offset to scale factor
-   sf_offset = (Uint32)&UPC2_Config.item[item].scale_factor - (Uint32)&UPC2_Config;
+   sf_offset = (Uint32)&UPC2_Card[card_ndx].Config.item[item].scale_factor - (Uint32)&UPC2_Card[card_ndx].Config;
 
    // Get offset to offset
-   offset_offset = (Uint32)&UPC2_Config.item[item].offset - (Uint32)&UPC2_Config;
-
-   // write new offset
-   WriteToLocalAddressSpace(card_ndx, &offset, 
-                                UPC2_CONFIG_STRUCT_ADDR + offset_offset, sizeof(offset));
-
-   // write new scale factor
-   WriteToLocalAddressSpace(card_ndx, &scale_factor, 
-                                UPC2_CONFIG_STRUCT_ADDR + sf_offset, sizeof(scale_factor));
+   offset_offset = (Uint32)&UPC2_Card[card_ndx].Config.item[item].offset - (Uint32)&UPC2_Card[card_ndx].Config;
+
+   // write new offset and scale factor (adjacent, so one burst)
+   Seg[0].local_addr = UPC2_CONFIG_STRUCT_ADDR + offset_offset;
+   Seg[0].buf = &offset;
+   Seg[0].size = sizeof(offset);
+   Seg[1].local_addr = UPC2_CONFIG_STRUCT_ADDR + sf_offset;
+   Seg[1].buf = &scale_factor;
+   Seg[1].size = sizeof(scale_factor);
+   if ((ret_val = WriteToLocalAddressSpaceV(card_ndx, Seg, 2)) < 0)
+   {
+      InvalidateShadow(card_ndx, SHADOW_CONFIG);
+      return ret_val;
+   }
 
+   // patch the shadow copy
+   UPC2_Card[card_ndx].Config.item[item].scale_factor = scale_factor;
+   UPC2_Card[card_ndx].Config.item[item].offset = offset;
 
    ret_val = UPC2_NORMAL_RETURN;
    return ret_val;
@@ -2207,6 +4303,13 @@ DllExport long __stdcall UPC2_PCI_SetStartFrame(long card_ndx)
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
+	if (UPC2_Card[card_ndx].nCursors > 0)
+		return UPC2_CURSORS_OPEN;
+
+	// Hold off the acquisition thread so the host ring buffer can be flushed as well
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
 	// Read the pool header
 	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
 									  &FrameHdrImage, sizeof(FrameHdrImage));
@@ -2215,50 +4318,204 @@ DllExport long __stdcall UPC2_PCI_SetStartFrame(long card_ndx)
 	WriteToLocalAddressSpace(card_ndx, &FrameHdrImage.pNew,
 									 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
 
+	if (UPC2_Card[card_ndx].pStream != NULL)
+		InterlockedExchange(&UPC2_Card[card_ndx].pStream->rd_seq, UPC2_Card[card_ndx].pStream->wr_seq);
+
+	// The frames skipped aren't lost
+	UPC2_Card[card_ndx].LastFrameValid = FALSE;
+
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+
 	ret_val = UPC2_NORMAL_RETURN;
 	return ret_val;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
-void CheckFrameNo(void * pframe, long nFrames, U32 frm_size)
+//
+// Frame loss accounting (see UPC2_PCI_GetLossStats)
+//
+// Every batch read from the StartFrame pointer (directly or from the host ring buffer) has its
+// frame_no sequence checked against the frame before it, including the last frame of the batch
+// before. A break forward is a gap (frames_lost = frames missing), a break back a repeat. The
+// last batch's breaks are kept as UPC2_FrameGap_t descriptors.
+//
+// FindBreak_Scalar, _SSE2 -- index of the first v[k] != v[k-1] + 1 for k < n (v[-1] = prev),
+//                            or n if none
+//
+//  The SSE2 engine compares 4 steps at a time with 1, so an unbroken batch costs about a
+//  compare per 4 frames.
+//
+long FindBreak_Scalar(const U32 * v, long n, U32 prev)
+{
+	long k;
+
+	for (k = 0; k < n; prev = v[k++])
+	{
+		if (v[k] != prev + 1)
+			break;
+	}
+	return k;
+}
+#if RAW_USE_SSE2
+long FindBreak_SSE2(const U32 * v, long n, U32 prev)
 {
-	long    i, j;
-	//long    frame_no;
-	void *  cframe = pframe;
+	const __m128i  one = _mm_set1_epi32(1);
+	__m128i        cur, before;
+	long           k;
 
-	//frame_no = ((UPC2_ConvertedDataFrame_t *) cframe)->frame_no;
-	for (i = 0; i < nFrames; i++)
+	for (k = 0; k + 4 <= n; k += 4)
 	{
-		if (((UPC2_ConvertedDataFrame_t *) cframe)->frame_no != frame_no++)
-			j = 0;
-		(Uint32)cframe += frm_size;
+		cur = _mm_loadu_si128((const __m128i *)(v + k));
+		before = _mm_or_si128(_mm_slli_si128(cur, 4), _mm_cvtsi32_si128((int)prev));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_sub_epi32(cur, before), one)) != 0xFFFF)
+			break;
+		prev = v[k + 3];
 	}
+	return k + FindBreak_Scalar(v + k, n - k, prev);
 }
+#endif
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// CheckFrame -- Returns the difference between the computed checkword and the stored checkword
+// CheckFrameNo -- checks the frame_no sequence of a batch of nFrames frames at frm_incr bytes
+//                 and updates the card's loss counters
 //
+// Returns -- number of breaks in the batch
 //
-U32 CheckFrame(U32 frm_size, void * pFrame)
+long CheckFrameNo(long card_ndx, void * pFrame, long nFrames, U32 frm_incr)
 {
-	U32   cw;
-	U32   ret_val = 0;
-#if 0
-	//cw = Calculate32BitChecksum((frm_size - 4)/4, (U32 *) pFrame);
-	cw = Calculate32BitCRC(frm_size - 4, (U8 *) pFrame);
-	ret_val = *(U32 *)((U32)pFrame + frm_size - 4) - cw;
-	if (ret_val)
+	U32                 v[COLUMN_CHUNK_FRAMES];
+	UPC2_LossStats_t *  pLoss = &UPC2_Card[card_ndx].Loss;
+	const U8 *          pF = (const U8 *) pFrame;
+	UPC2_FrameGap_t *   pGap;
+	U32                 last;
+	Int32               step;
+	long                nDone, n, k, pos;
+
+	pLoss->batch_frames = nFrames;
+	pLoss->nGaps = 0;
+	if (nFrames <= 0)
+		return 0;
+
+	// The first frame after a reset starts the sequence
+	if (!UPC2_Card[card_ndx].LastFrameValid)
+	{
+		UPC2_Card[card_ndx].LastFrameNo = ((UPC2_ConvertedDataFrame_t *) pF)->frame_no - 1;
+		UPC2_Card[card_ndx].LastFrameValid = TRUE;
+	}
+	last = UPC2_Card[card_ndx].LastFrameNo;
+
+	for (nDone = 0; nDone < nFrames; nDone += n)
 	{
-		if (((UPC2_ConvertedDataFrame_t *) pFrame)->frame_no == frame_no)
-			cw = 2;
+		n = nFrames - nDone;
+		if (n > COLUMN_CHUNK_FRAMES)
+			n = COLUMN_CHUNK_FRAMES;
+		for (k = 0; k < n; k++, pF += frm_incr)
+			v[k] = ((const UPC2_ConvertedDataFrame_t *) pF)->frame_no;
+
+		pos = 0;
+		while ((pos += FindBreak(v + pos, n - pos, last)) < n)
+		{
+			if (pos > 0)
+				last = v[pos - 1];
+			step = (Int32)(v[pos] - last - 1);
+			if (step > 0)
+			{
+				pLoss->gaps++;
+				pLoss->frames_lost += step;
+			}
+			else
+				pLoss->repeats++;
+
+			if (pLoss->nGaps < UPC2_MAX_GAPS)
+			{
+				pGap = &pLoss->gap[pLoss->nGaps];
+				pGap->index = nDone + pos;
+				pGap->expected = (Int32)(last + 1);
+				pGap->frame_no = (Int32)v[pos];
+			}
+			pLoss->nGaps++;
+			last = v[pos++];
+		}
+		last = v[n - 1];
 	}
+	UPC2_Card[card_ndx].LastFrameNo = (Int32) last;
+	pLoss->frames_checked += nFrames;
+	return pLoss->nGaps;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CheckOverrun -- counts an overrun if the DSP ring buffer is full (the DSP is about to
+//                 overwrite frames that haven't been read)
+//
+void CheckOverrun(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr)
+{
+	U32   frm_size = pFrameHdr->FrameSize;
+	long  nFramesUnread;
+
+	if (frm_size == 0 || pFrameHdr->MaxFrames <= 1)
+		return;
+
+	if (pFrameHdr->pNew < pFrameHdr->pStart)
+		nFramesUnread = pFrameHdr->MaxFrames - ((U32)pFrameHdr->pStart - (U32)pFrameHdr->pNew) / frm_size;
 	else
-		frame_no++;
-#endif
-    if (((UPC2_ConvertedDataFrame_t *) pFrame)->frame_no == frame_no)
-		frame_no++;
-    else
-        cw = 2;
-	return ret_val;
+		nFramesUnread = ((U32)pFrameHdr->pNew - (U32)pFrameHdr->pStart) / frm_size;
+
+	if (nFramesUnread >= pFrameHdr->MaxFrames - 1)
+	{
+		InterlockedIncrement((LONG volatile *)&UPC2_Card[card_ndx].Loss.overruns);
+		InterlockedExchange((LONG volatile *)&UPC2_Card[card_ndx].Loss.status, UPC2_DSP_DATA_OVERRUN);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetLossStats -- gets the card's frame loss and DSP overrun counters
+//
+//  The counters cover the frames read with UPC2_NO_GAPS or UPC2_FROM_START_FRAME (directly or
+//  while streaming) since UPC2_PCI_StartDataCollection or UPC2_PCI_ResetLossStats. gap[] holds
+//  the breaks in the last batch read. Frames dropped by a streaming policy show up as gaps.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pStats      -- pointer to a UPC2_LossStats_t struct
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pStats is NULL
+//		   -- UPC2_NORMAL_RETURN
+//
+DllExport long __stdcall UPC2_PCI_GetLossStats(long card_ndx, UPC2_LossStats_t * pStats)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (pStats == NULL)
+		return UPC2_NULL_PARAM;
+
+	memcpy(pStats, &UPC2_Card[card_ndx].Loss, sizeof(UPC2_LossStats_t));
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ResetLossStats -- clears the card's loss counters (the next frame starts the
+//                            frame_no sequence)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//		   -- UPC2_NORMAL_RETURN
+//
+DllExport long __stdcall UPC2_PCI_ResetLossStats(long card_ndx)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	memset(&UPC2_Card[card_ndx].Loss, 0, sizeof(UPC2_LossStats_t));
+	UPC2_Card[card_ndx].LastFrameValid = FALSE;
+	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -2270,6 +4527,20 @@ DllExport long __stdcall UPC2_PCI_GetUnreadFrameCount(long card_ndx)
 	U32				FrameAddr;		// local address of converted frame
 	U32				frm_size;
 	long			   nFramesUnread;
+	UPC2_Stream_t *    pStream;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	// Streaming -- the frames not yet taken are in the host ring buffer
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	if ((pStream = UPC2_Card[card_ndx].pStream) != NULL)
+	{
+		nFramesUnread = (long)(U32)(pStream->wr_seq - pStream->rd_seq);
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return nFramesUnread;
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
 
     // Read the pool header
 	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
@@ -2278,240 +4549,4384 @@ DllExport long __stdcall UPC2_PCI_GetUnreadFrameCount(long card_ndx)
 	frm_size = FrameHdrImage.FrameSize;   // includes check word
 	FrameAddr = (U32)FrameHdrImage.pStart;
 
-	// Determine nFramesUnread
-	if (FrameHdrImage.pNew < FrameHdrImage.pStart)
-		nFramesUnread = FrameHdrImage.MaxFrames - ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pNew) / frm_size;
-	else
-		nFramesUnread = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pStart) / frm_size;
-    
-	return nFramesUnread;
+	// Determine nFramesUnread
+	if (FrameHdrImage.pNew < FrameHdrImage.pStart)
+		nFramesUnread = FrameHdrImage.MaxFrames - ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pNew) / frm_size;
+	else
+		nFramesUnread = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pStart) / frm_size;
+    
+	return nFramesUnread;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadFromStartFrame -- reads frames starting at the StartFrame pointer (in at most two bursts)
+//                       and advances the StartFrame pointer past the frames read
+//
+// parameters:
+//
+//  card_ndx      -- long 0, 1, 2, .. representing the card's index
+//  pFrameHdr     -- pointer to a copy of the converted data frame pool header
+//  nFrames       -- long specifying the number of frames to read
+//  pFrame        -- pointer to a destination buffer for the converted data frames
+//  frm_incr      -- spacing (in bytes) of the frames in the destination buffer
+//
+// Returns 		-- negative if an error occurs
+//         		-- number of frames read if no error
+//
+long ReadFromStartFrame(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr,
+						long nFrames, void * pFrame, U32 frm_incr)
+{
+	long			ret_val;
+	U32				FrameAddr;		// local address of converted frame
+	U32				newFrameAddr;
+	long			nFramesToEnd, pFrames, n1, nGood;
+	long			nFramesUnread;
+	U32				frm_size;
+
+	frm_size = pFrameHdr->FrameSize;   // includes check word
+	if (frm_size == 0)
+		return 0;
+
+	FrameAddr = (U32)pFrameHdr->pStart;
+
+	// Determine nFramesUnread
+	if (pFrameHdr->pNew < pFrameHdr->pStart)
+		nFramesUnread = pFrameHdr->MaxFrames - ((U32)pFrameHdr->pStart - (U32)pFrameHdr->pNew) / frm_size;
+	else
+		nFramesUnread = ((U32)pFrameHdr->pNew - (U32)pFrameHdr->pStart) / frm_size;
+
+	if (nFramesUnread == 0)
+		return 0;
+
+	// Reset nFrames if request too large (counted, see UPC2_PCI_GetLossStats)
+	if (nFrames > nFramesUnread)
+	{
+		nFrames = nFramesUnread -1;
+		InterlockedIncrement((LONG volatile *)&UPC2_Card[card_ndx].Loss.clipped);
+	}
+
+	// Determine nFramesToEnd
+	nFramesToEnd = ((U32)pFrameHdr->pLast - (U32)pFrameHdr->pStart)/frm_size + 1;
+
+	// Read the data frame(s) -- a burst up to the end, then the balance from the start
+	n1 = (nFrames < nFramesToEnd) ? nFrames : nFramesToEnd;
+	ret_val = ReadFramesVerified(card_ndx, FrameAddr, n1, frm_size, pFrame, frm_incr, &nGood);
+	if (ret_val >= 0 && nFrames > n1)
+	{
+		FrameAddr = (U32)pFrameHdr->pFrame1;
+		pFrames = nFrames - n1;
+		ret_val = ReadFramesVerified(card_ndx, FrameAddr, pFrames, frm_size,
+									 (U8 *)pFrame + n1 * frm_incr, frm_incr, &nGood);
+		nGood += n1;
+	}
+	if (ret_val < 0)
+	{
+		// Keep the frames verified before a frame that failed every re-read (it's read
+		// again next time)
+		if (ret_val != UPC2_CKSUM_ERR || nGood == 0)
+			return ret_val;
+		nFrames = nGood;
+	}
+	if (nFrames < nFramesToEnd)
+		newFrameAddr = (U32)pFrameHdr->pStart + (U32)frm_size * nFrames;
+	else
+		newFrameAddr = (U32)pFrameHdr->pFrame1 + (U32)frm_size * (nFrames - nFramesToEnd);
+
+	// Update pointer in the header
+	WriteToLocalAddressSpace(card_ndx, &newFrameAddr,
+							 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
+	pFrameHdr->pStart = (UPC2_ConvertedDataFrame_t *) newFrameAddr;
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadNewestFrames -- reads the last nFrames frames up to the newest (pNew) in order, in at
+//                     most two bursts, without touching the StartFrame pointer
+//
+//  At most MaxFrames - 2 frames are read (the DSP may be writing the one at pLoad). If
+//  frame_no breaks, the frames before the last break (left in the ring buffer from before
+//  data collection started) are dropped and the rest moved to the start of pFrame.
+//
+// parameters:
+//
+//  card_ndx      -- long 0, 1, 2, .. representing the card's index
+//  pFrameHdr     -- pointer to a copy of the converted data frame pool header
+//  nFrames       -- long specifying the number of frames to read
+//  pFrame        -- pointer to a destination buffer for the converted data frames
+//  frm_incr      -- spacing (in bytes) of the frames in the destination buffer
+//
+// Returns 		-- negative if an error occurs
+//         		-- number of frames read if no error
+//
+long ReadNewestFrames(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr,
+					  long nFrames, void * pFrame, U32 frm_incr)
+{
+	U32				frm_size = pFrameHdr->FrameSize;   // includes check word
+	U32				nMax = pFrameHdr->MaxFrames;
+	U32				newest, first;
+	long			ret_val, n1, k;
+	U8 *			pF;
+
+	if (frm_size == 0 || nMax < 3 || nFrames <= 0)
+		return 0;
+	if ((U32)nFrames > nMax - 2)
+		nFrames = nMax - 2;
+
+	// Walk back from the newest frame (across the wrap at pFrame1)
+	newest = ((U32)pFrameHdr->pNew - (U32)pFrameHdr->pFrame1) / frm_size;
+	first = (newest + nMax + 1 - nFrames) % nMax;
+
+	// A burst up to pLast, then the balance from pFrame1
+	n1 = (nFrames < (long)(nMax - first)) ? nFrames : (long)(nMax - first);
+	ret_val = ReadFramesWithCheckFromLocalAddressSpace(card_ndx, (U32)pFrameHdr->pFrame1 + first * frm_size,
+													   n1, frm_size, pFrame, frm_incr);
+	if (ret_val >= 0 && nFrames > n1)
+		ret_val = ReadFramesWithCheckFromLocalAddressSpace(card_ndx, (U32)pFrameHdr->pFrame1, nFrames - n1,
+														   frm_size, (U8 *)pFrame + n1 * frm_incr, frm_incr);
+	if (ret_val < 0)
+		return ret_val;
+
+	// Keep the frames after the last break in frame_no
+	pF = (U8 *)pFrame + (nFrames - 1) * frm_incr;
+	for (k = nFrames - 1; k > 0; k--, pF -= frm_incr)
+	{
+		if (((UPC2_ConvertedDataFrame_t *)pF)->frame_no != ((UPC2_ConvertedDataFrame_t *)(pF - frm_incr))->frame_no + 1)
+			break;
+	}
+	if (k > 0)
+	{
+		memmove(pFrame, (U8 *)pFrame + k * frm_incr, (nFrames - k - 1) * frm_incr + frm_size - 4);
+		nFrames -= k;
+	}
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// GetDataRows -- UPC2_PCI_GetData with the spacing of the frames in the destination buffer
+//                chosen by the caller
+//
+// parameters:
+//
+//  card_ndx, access_type, nFrames, pFrame -- as UPC2_PCI_GetData
+//
+//  frm_incr    -- spacing (in bytes) of the frames in pFrame (0 => as UPC2_PCI_GetData).
+//                 Frames are copied less their check words so it may be as small as
+//                 8 + 4*nItems. UPC2_NEWEST_DATA verifies the check word when it is
+//                 given; UPC2_FROM_LOAD_PTR reads the frame the DSP is writing, unverified.
+//
+// Returns 		-- as UPC2_PCI_GetData
+//			         UPC2_INVALID_PARAM 		 		if frm_incr is smaller than a frame
+//
+long GetDataRows(long card_ndx, long access_type, long nFrames, void * pFrame, U32 frm_incr)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	UPC2_ConvertedDataFrame_t * pF = (UPC2_ConvertedDataFrame_t *)pFrame;
+	long			ret_val;
+	U32				FrameAddr;		// local address of converted frame
+	long			i, j, nItems, fcnt, fread;
+	U32			    t0, t1, t; 
+	float			val;
+	U32			    pFrame0 = (U32) pFrame;
+	long			jmax = 3;
+	static  long    retry_count = 0;
+	U32				frm_size;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+	{
+		return UPC2_DATA_COLLECTION_NOT_STARTED;
+	}
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+	{
+		////////////////////////////////////////////////////////////////////////////////   
+		//    	D E M O    M O D E
+		////////////////////////////////////////////////////////////////////////////////   
+
+		// Not connected. Send data based on Demo config
+		nItems = UPC2_Card[card_ndx].Demo.nItems;
+		if (frm_incr == 0)
+			frm_incr = 104;
+		else if (frm_incr < (U32)(8 + 4 * nItems))
+			return UPC2_INVALID_PARAM;
+		if (access_type == UPC2_FROM_START_FRAME)
+		{
+			t0 = UPC2_Card[card_ndx].Demo.time_in_ms;
+			t1 = GetTickCount();
+			UPC2_Card[card_ndx].Demo.time_in_ms = t1;
+
+			if (t1 > t0)
+				t = t1 - t0;
+			else
+				t = 0xffffffff - t1 + t0;
+
+			// frames read = time in usec / (number of frames * frame scan time in usecs)
+			//             = (time in mscec * 1000) / (number of frames * nSbits * 10)   
+			//             = (time in mscec * 100) / (number of frames * nSbits)   
+
+			fread = (100 * t) / (UPC2_Card[card_ndx].Demo.scan_interval * UPC2_Card[card_ndx].Demo.nSbits); 
+			fcnt = (nFrames > fread) ? fread : nFrames;
+		}
+		else if (access_type == UPC2_NEWEST_N_FRAMES)
+		{
+			// The last frames again (up to the newest)
+			fcnt = (nFrames < UPC2_Card[card_ndx].Demo.frame_no) ? nFrames : UPC2_Card[card_ndx].Demo.frame_no;
+			UPC2_Card[card_ndx].Demo.frame_no -= fcnt;
+		}
+		else
+			fcnt = 1;
+
+		for (j = 0; j < fcnt; j++)
+		{
+			pF->frame_no = UPC2_Card[card_ndx].Demo.frame_no++;
+			val = (pF->frame_no % 10) * 0.1f;  // sawtooth that goes 0 to 1 in 10 steps
+			pF->timestamp = pF->frame_no * UPC2_Card[card_ndx].Demo.scan_interval * UPC2_Card[card_ndx].Demo.nSbits;
+			for (i = 0; i < nItems; i++)
+			{
+				//  Random number returned by the following
+				//   pF->data[i] = (i + 1 + rand()) * UPC2_Card[card_ndx].Demo.scale[i] + UPC2_Card[card_ndx].Demo.offset[i];
+				// Sawtooth function returned by the following
+				pF->data[i] = (i + 1 + val) * UPC2_Card[card_ndx].Demo.scale[i] + UPC2_Card[card_ndx].Demo.offset[i];
+			}
+			// Bump to next frame
+			//pF = (UPC2_ConvertedDataFrame_t *)((Uint32)(pF) + UPC2_Card[card_ndx].Demo.nItems * 4 + 8);
+			// 4-21-05 for the time being always assume data aray has room for 24 items ( = 4*24 + 8 = 104)
+			pF = (UPC2_ConvertedDataFrame_t *)((Uint32)(pF) + frm_incr);
+		}
+		return fcnt;
+	}
+	// Test for Data started
+
+	////////////////////////////////////////////////////////////////////////////////   
+	//    	R E A L   D A T A   M O D E
+	////////////////////////////////////////////////////////////////////////////////   
+
+	// Streaming -- the acquisition thread owns the StartFrame pointer
+	if (access_type == UPC2_FROM_START_FRAME || access_type == UPC2_NO_GAPS)
+	{
+		EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		if (UPC2_Card[card_ndx].pStream != NULL)
+		{
+			ret_val = GetStreamData(card_ndx, nFrames, pFrame,
+									(frm_incr == 0 && access_type == UPC2_FROM_START_FRAME) ? EZ_SENSE_FRAME_SIZE : frm_incr);
+			LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+			return ret_val;
+		}
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	}
+
+	// Read the pool header
+	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+									  &FrameHdrImage, sizeof(FrameHdrImage));
+
+	frm_size = FrameHdrImage.FrameSize;   // includes check word
+	
+	if (frm_incr != 0)
+	{
+		if (frm_incr < frm_size - 4)
+			return UPC2_INVALID_PARAM;
+		if (access_type == UPC2_NEWEST_DATA)
+		{
+			// Single completed frame without its check word (verified)
+			ret_val = ReadFramesWithCheckFromLocalAddressSpace(card_ndx, (U32)FrameHdrImage.pNew, 1, frm_size, pFrame, frm_incr);
+			return (ret_val < 0) ? ret_val : 1;
+		}
+		if (access_type == UPC2_FROM_LOAD_PTR)
+		{
+			// The DSP is still writing the frame at pLoad -- read it as it stands
+			ret_val = ReadFromLocalAddressSpace(card_ndx, (U32)FrameHdrImage.pLoad, pFrame, frm_size - 4);
+			return (ret_val < 0) ? ret_val : 1;
+		}
+	}
+	else if (access_type == UPC2_NO_GAPS)
+		frm_incr =  frm_size - 4;
+	else
+		// EaesySense array has room for 24 items ( = 4*24 + 8 = 104)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+
+
+	if (access_type == UPC2_NEWEST_N_FRAMES)
+		nFrames = ReadNewestFrames(card_ndx, &FrameHdrImage, nFrames, pFrame, frm_incr);
+	else if (access_type == UPC2_FROM_LOAD_PTR)
+    {
+		//////////////////////////////////////////////////////
+		// Process Read from Load Pointer request
+		//////////////////////////////////////////////////////
+		FrameAddr = (U32)FrameHdrImage.pLoad;
+
+		// Read the data frame(s)
+		ret_val = ReadFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, FrameHdrImage.FrameSize);
+        if (ret_val < 0)
+            return ret_val;
+        nFrames = 1;
+    }
+    else if (access_type == UPC2_NEWEST_DATA)
+    {
+		//////////////////////////////////////////////////////
+		// Process NEWEST request
+		//////////////////////////////////////////////////////
+		FrameAddr = (U32)FrameHdrImage.pNew;
+
+		// Read the data frame(s)
+		ret_val = ReadFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, FrameHdrImage.FrameSize);
+        if (ret_val < 0)
+            return ret_val;
+		nFrames = 1;
+    }
+    else
+    {
+		//////////////////////////////////////////////////////
+		// Process START_FROM_FRAME request
+		//////////////////////////////////////////////////////
+		if (UPC2_Card[card_ndx].nCursors > 0)
+			return UPC2_CURSORS_OPEN;
+		CheckOverrun(card_ndx, &FrameHdrImage);
+		if (frm_size == 0)
+			fcnt = 0;
+		else if (FrameHdrImage.pNew < FrameHdrImage.pStart)
+			fcnt = FrameHdrImage.MaxFrames - ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pNew) / frm_size;
+		else
+			fcnt = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pStart) / frm_size;
+		nFrames = ReadFromStartFrame(card_ndx, &FrameHdrImage, nFrames, pFrame, frm_incr);
+		SchedObserve(card_ndx, fcnt, FrameHdrImage.MaxFrames, nFrames);
+		if (nFrames > 0)
+			CheckFrameNo(card_ndx, pFrame, nFrames, frm_incr);
+	}
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetData -- reads converted data from the ring buffer and updates the converted data
+//					   frame header and the frame status word.
+//
+//					  If access method is UPC2_NEWEST_DATA a single frame is read
+//
+//					  If access method is UPC2_NEWEST_N_FRAMES the last nFrames frames up
+//                       to the newest are read in order (at most MaxFrames - 2, in at most
+//                       two bursts) without touching the StartFrame pointer. Frames older
+//                       than a break in frame_no (left from before data collection started)
+//                       are left out.
+//
+//					  If access method is UPC2_NO_GAPS or UPC2_START_FROM_FRAME N, frames are 
+//                       read where  N = min(nFrames , number of frames unread) and the number
+//                       read is returned to the caller
+//
+//					  If UPC2_NO_GAPS is specified the frames are transferred directly
+//                       from DSP memory to the caller. Otherwise the frames are spaced
+//                       assuming the caller has specified 24 items/frame
+//
+//					  The frames are read in at most two bursts (up to pLast and
+//                       from pFrame1) and the check word of every frame is verified
+//
+//					   	 Additionally, the StartFrame pointer is advanced to the next
+//                   	   available frame.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+//  access_type -- UPC2_NO_GAPS, UPC2_FROM_START_FRAME, UPC2_NEWEST_DATA, UPC2_NEWEST_N_FRAMES
+//                 or UPC2_FROM_LOAD_PTR
+//
+//	 nFrames 	-- long specifying the number of frames to read (not used if NEWEST)
+//
+//  pFrame 		-- pointer to a destination buffer for the converted data frame(s)
+//
+// Returns 		-- negative if an error occurs. 
+//			         UPC2_INVALID_INDEX   		 		if no UPC card with the specified index
+//			         UPC2_NO_CONNECTION	  	     		if not connected
+//                   UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
+//
+//         		-- number of frames read if no error
+//
+DllExport long __stdcall UPC2_PCI_GetData(long card_ndx, long access_type, long nFrames, void * pFrame)
+{
+	return GetDataRows(card_ndx, access_type, nFrames, pFrame, 0);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Host cursors (see UPC2_PCI_OpenCursor)
+//
+// A cursor is a reader's own position in the DSP ring buffer, kept on the host as a frame index
+// from pFrame1. Reading at a cursor doesn't write the StartFrame pointer back. pStart only
+// protects the unread frames from the DSP, so it is moved up to the slowest cursor, and only
+// once that is MaxFrames / CURSOR_COMMIT_PART frames ahead of it (or a cursor closes).
+//
+// CursorCommit -- moves the StartFrame pointer up to the slowest cursor (caller holds HpiLock)
+//
+//  force       -- write pStart even if the slowest cursor moved less than the commit step
+//
+void CursorCommit(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr, BOOL force)
+{
+	UPC2_Cursor_t * pCursor = UPC2_Card[card_ndx].Cursor;
+	U32             frm_size = pFrameHdr->FrameSize;
+	U32             nMax = pFrameHdr->MaxFrames;
+	U32             start, d, dmin, newFrameAddr;
+	long            c;
+
+	if (frm_size == 0 || nMax == 0)
+		return;
+
+	start = ((U32)pFrameHdr->pStart - (U32)pFrameHdr->pFrame1) / frm_size;
+	dmin = nMax;
+	for (c = 0; c < UPC2_MAX_CURSORS; c++)
+	{
+		if (pCursor[c].from == 0)
+			continue;
+		// A cursor that hasn't read yet holds pStart where it is
+		d = pCursor[c].placed ? (pCursor[c].pos + nMax - start) % nMax : 0;
+		if (d < dmin)
+			dmin = d;
+	}
+	if (dmin == nMax || dmin == 0 || (!force && dmin < nMax / CURSOR_COMMIT_PART))
+		return;
+
+	newFrameAddr = (U32)pFrameHdr->pFrame1 + frm_size * ((start + dmin) % nMax);
+	WriteToLocalAddressSpace(card_ndx, &newFrameAddr,
+							 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
+	pFrameHdr->pStart = (UPC2_ConvertedDataFrame_t *) newFrameAddr;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CursorRead -- UPC2_PCI_ReadCursor (caller holds HpiLock)
+//
+long CursorRead(long card_ndx, UPC2_Cursor_t * pCursor, long nFrames, void * pFrame, U32 frm_incr)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	long            ret_val, n1, nGood;
+	U32             frm_size, nMax, newest, avail;
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+										&FrameHdrImage, sizeof(FrameHdrImage));
+	if (ret_val < 0)
+		return ret_val;
+	frm_size = FrameHdrImage.FrameSize;   // includes check word
+	nMax = FrameHdrImage.MaxFrames;
+	if (frm_size == 0 || nMax == 0 || nFrames <= 0)
+		return 0;
+	if (frm_incr < frm_size - 4)
+		return UPC2_INVALID_PARAM;
+	CheckOverrun(card_ndx, &FrameHdrImage);
+
+	newest = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pFrame1) / frm_size;
+	if (!pCursor->placed)
+	{
+		pCursor->pos = (pCursor->from == UPC2_CURSOR_FROM_NEWEST) ? newest
+					 : ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pFrame1) / frm_size;
+		pCursor->placed = TRUE;
+	}
+
+	// Frames from the cursor up to (not including) the newest, as UPC2_PCI_GetUnreadFrameCount
+	avail = (newest + nMax - pCursor->pos) % nMax;
+	if ((U32)nFrames > avail)
+		nFrames = avail;
+	if (nFrames == 0)
+		return 0;
+
+	// A burst up to the end of the ring buffer, then the balance from the start
+	n1 = (nFrames < (long)(nMax - pCursor->pos)) ? nFrames : (long)(nMax - pCursor->pos);
+	ret_val = ReadFramesVerified(card_ndx, (U32)FrameHdrImage.pFrame1 + pCursor->pos * frm_size, n1,
+								 frm_size, pFrame, frm_incr, &nGood);
+	if (ret_val >= 0 && nFrames > n1)
+	{
+		ret_val = ReadFramesVerified(card_ndx, (U32)FrameHdrImage.pFrame1, nFrames - n1, frm_size,
+									 (U8 *)pFrame + n1 * frm_incr, frm_incr, &nGood);
+		nGood += n1;
+	}
+	if (ret_val < 0)
+	{
+		// Keep the frames verified before a frame that failed every re-read
+		if (ret_val != UPC2_CKSUM_ERR || nGood == 0)
+			return ret_val;
+		nFrames = nGood;
+	}
+	pCursor->pos = (pCursor->pos + nFrames) % nMax;
+	CursorCommit(card_ndx, &FrameHdrImage, FALSE);
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_OpenCursor -- opens a cursor: a reader of the card's converted data frames with its
+//                        own position in the DSP ring buffer
+//
+//  Each cursor sees every frame from its first read on, independently of the others (e.g. an
+//  archiver and a live display). The DSP keeps the frames the slowest cursor hasn't read. While
+//  cursors are open, UPC2_PCI_GetData with UPC2_NO_GAPS or UPC2_FROM_START_FRAME,
+//  UPC2_PCI_SetStartFrame and UPC2_PCI_StartStreaming are not allowed (UPC2_NEWEST_DATA and
+//  UPC2_FROM_LOAD_PTR are). The position is taken at the first read, and again after
+//  UPC2_PCI_StartDataCollection.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  from        -- UPC2_CURSOR_FROM_START (the oldest unread frame) or UPC2_CURSOR_FROM_NEWEST
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_INVALID_PARAM	if from is unknown
+//			  UPC2_NO_CONNECTION	if not connected
+//			  UPC2_STREAMING_ACTIVE	if streaming
+//			  UPC2_OUT_OF_MEMORY	if UPC2_MAX_CURSORS are open
+//		   -- the cursor (0, 1, ..) if no error
+//
+DllExport long __stdcall UPC2_PCI_OpenCursor(long card_ndx, long from)
+{
+	long ret_val, c;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if (from != UPC2_CURSOR_FROM_START && from != UPC2_CURSOR_FROM_NEWEST)
+		return UPC2_INVALID_PARAM;
+
+	// StreamLock keeps UPC2_PCI_StartStreaming out until the cursor is counted
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	if (UPC2_Card[card_ndx].pStream != NULL)
+		ret_val = UPC2_STREAMING_ACTIVE;
+	else
+	{
+		ret_val = UPC2_OUT_OF_MEMORY;
+		for (c = 0; c < UPC2_MAX_CURSORS; c++)
+		{
+			if (UPC2_Card[card_ndx].Cursor[c].from == 0)
+			{
+				UPC2_Card[card_ndx].Cursor[c].from = from;
+				UPC2_Card[card_ndx].Cursor[c].placed = FALSE;
+				UPC2_Card[card_ndx].nCursors++;
+				ret_val = c;
+				break;
+			}
+		}
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ReadCursor -- reads converted data frames at a cursor (as UPC2_PCI_GetData with
+//                        UPC2_FROM_START_FRAME) and moves the cursor past them
+//
+//  The frames are read in at most two bursts and the check word of every frame is verified
+//  (see ReadFramesVerified). Up to all of the frames the cursor hasn't read are returned.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  cursor      -- from UPC2_PCI_OpenCursor
+//  nFrames     -- maximum number of frames to read
+//  pFrame      -- pointer to a destination buffer for the converted data frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX				if no UPC card with the specified index
+//			  UPC2_NULL_PARAM					if pFrame is NULL
+//			  UPC2_INVALID_PARAM				if frm_incr is too small
+//			  UPC2_INVALID_CURSOR				if the cursor isn't open
+//			  UPC2_NO_CONNECTION				if not connected
+//			  UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
+//			  UPC2_CKSUM_ERR					if the first frame fails every re-read
+//		   -- number of frames read if no error
+//
+DllExport long __stdcall UPC2_PCI_ReadCursor(long card_ndx, long cursor, long nFrames, void * pFrame, long frm_incr)
+{
+	long ret_val;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+		return UPC2_DATA_COLLECTION_NOT_STARTED;
+
+	if (cursor < 0 || cursor >= UPC2_MAX_CURSORS || UPC2_Card[card_ndx].Cursor[cursor].from == 0)
+		return UPC2_INVALID_CURSOR;
+
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+
+	// Hold the HPI so the header, the frames and pStart stay consistent with the other cursors
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	ret_val = CursorRead(card_ndx, &UPC2_Card[card_ndx].Cursor[cursor], nFrames, pFrame, frm_incr);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_CloseCursor -- closes a cursor (pStart moves up to the slowest cursor left)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  cursor      -- from UPC2_PCI_OpenCursor
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_INVALID_CURSOR	if the cursor isn't open
+//		   -- UPC2_NORMAL_RETURN
+//
+DllExport long __stdcall UPC2_PCI_CloseCursor(long card_ndx, long cursor)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (cursor < 0 || cursor >= UPC2_MAX_CURSORS || UPC2_Card[card_ndx].Cursor[cursor].from == 0)
+		return UPC2_INVALID_CURSOR;
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	UPC2_Card[card_ndx].Cursor[cursor].from = 0;
+	UPC2_Card[card_ndx].nCursors--;
+	if (UPC2_Card[card_ndx].nCursors > 0 && IsConnected(card_ndx) >= 0 &&
+		ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+								  &FrameHdrImage, sizeof(FrameHdrImage)) >= 0)
+		CursorCommit(card_ndx, &FrameHdrImage, TRUE);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// FindFrameSince -- finds the first frame of the DSP ring buffer with a timestamp at or after
+//                   timestamp (caller holds HpiLock)
+//
+//  The frames searched are the last MaxFrames - 2 - SEEK_GUARD_FRAMES up to the newest (pNew),
+//  oldest first. Their timestamps increase (compared as the signed difference, so they may
+//  wrap), except that frames left from before data collection started come first. Those are
+//  told by frame_no not counting down from the newest. So "frame_no counts down to it and
+//  its timestamp is at or after" is false then true across the range, and a binary search
+//  finds the first frame where it holds. Each probe reads frame_no and timestamp (8 bytes).
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pFrameHdr   -- pointer to a copy of the converted data frame pool header
+//  timestamp   -- usecs x 10 (within 6 hours of the frames)
+//  pIndex      -- set to the frame index (from pFrame1) of the frame found
+//
+// Returns -- negative if an error occurs
+//		   -- number of frames from the frame found up to the newest (0 if none, *pIndex is
+//			  then the frame after the newest)
+//
+long FindFrameSince(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr, Int32 timestamp, U32 * pIndex)
+{
+	U32     frm_size = pFrameHdr->FrameSize;   // includes check word
+	U32     nMax = pFrameHdr->MaxFrames;
+	U32     newest, first, nRange, lo, hi, mid;
+	Int32   probe[2];						// frame_no, timestamp
+	Int32   newest_no;
+	long    ret_val;
+
+	*pIndex = 0;
+	if (frm_size == 0 || nMax <= 2 + SEEK_GUARD_FRAMES)
+		return 0;
+
+	nRange = nMax - 2 - SEEK_GUARD_FRAMES;
+	newest = ((U32)pFrameHdr->pNew - (U32)pFrameHdr->pFrame1) / frm_size;
+	first = (newest + nMax + 1 - nRange) % nMax;
+	*pIndex = (newest + 1) % nMax;
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, (U32)pFrameHdr->pNew, probe, sizeof(probe));
+	if (ret_val < 0)
+		return ret_val;
+	if (probe[1] - timestamp < 0)
+		return 0;
+	newest_no = probe[0];
+
+	// Binary search for the first of the range where the condition holds (it does at the newest)
+	lo = 0;
+	hi = nRange - 1;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		ret_val = ReadFromLocalAddressSpace(card_ndx, (U32)pFrameHdr->pFrame1 + ((first + mid) % nMax) * frm_size,
+											probe, sizeof(probe));
+		if (ret_val < 0)
+			return ret_val;
+		if ((U32)(newest_no - probe[0]) == nRange - 1 - mid && probe[1] - timestamp >= 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*pIndex = (first + lo) % nMax;
+	return nRange - lo;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetDataSince -- reads converted data from the first frame in the DSP ring buffer at
+//                          or after a timestamp, without touching the StartFrame pointer
+//
+//  The frame is found with a binary search of the ring buffer (see FindFrameSince), so
+//  the frames before an event can be read from the card after it happens. Up to nFrames
+//  frames from there up to the newest are read in order (in at most two bursts, every check
+//  word verified). To carry on reading from there use UPC2_PCI_SeekCursor.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  timestamp   -- usecs x 10 (as the frames' timestamps)
+//  nFrames     -- maximum number of frames to read
+//  pFrame      -- pointer to a destination buffer for the converted data frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX				if no UPC card with the specified index
+//			  UPC2_NULL_PARAM					if pFrame is NULL
+//			  UPC2_INVALID_PARAM				if frm_incr is too small
+//			  UPC2_NO_CONNECTION				if not connected
+//			  UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
+//		   -- number of frames read if no error (0 if all of the frames are older)
+//
+DllExport long __stdcall UPC2_PCI_GetDataSince(long card_ndx, long timestamp, long nFrames, void * pFrame, long frm_incr)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	U32     index, frm_size, nMax;
+	long    ret_val, nFound, n1;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+		return UPC2_DATA_COLLECTION_NOT_STARTED;
+
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+
+	// Hold the HPI so the search and the read see the same ring buffer
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+										&FrameHdrImage, sizeof(FrameHdrImage));
+	frm_size = FrameHdrImage.FrameSize;
+	nMax = FrameHdrImage.MaxFrames;
+	if (ret_val >= 0 && (U32)frm_incr < frm_size - 4)
+		ret_val = UPC2_INVALID_PARAM;
+	if (ret_val >= 0)
+		ret_val = nFound = FindFrameSince(card_ndx, &FrameHdrImage, (Int32)timestamp, &index);
+	if (ret_val > 0 && nFrames > 0)
+	{
+		if (nFrames > nFound)
+			nFrames = nFound;
+
+		// A burst up to pLast, then the balance from pFrame1
+		n1 = (nFrames < (long)(nMax - index)) ? nFrames : (long)(nMax - index);
+		ret_val = ReadFramesWithCheckFromLocalAddressSpace(card_ndx, (U32)FrameHdrImage.pFrame1 + index * frm_size,
+														   n1, frm_size, pFrame, frm_incr);
+		if (ret_val >= 0 && nFrames > n1)
+			ret_val = ReadFramesWithCheckFromLocalAddressSpace(card_ndx, (U32)FrameHdrImage.pFrame1, nFrames - n1,
+															   frm_size, (U8 *)pFrame + n1 * frm_incr, frm_incr);
+		if (ret_val >= 0)
+			ret_val = nFrames;
+	}
+	else if (ret_val > 0)
+		ret_val = 0;
+
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_SeekCursor -- moves a cursor to the first frame in the DSP ring buffer at or after a
+//                        timestamp (see FindFrameSince), so UPC2_PCI_ReadCursor reads on from
+//                        there
+//
+//  If the frame is older than the StartFrame pointer, pStart is moved back to it so the DSP
+//  keeps the frames. If every frame is older the cursor is placed at the newest (as
+//  UPC2_CURSOR_FROM_NEWEST), so the next read starts with the frames after it.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  cursor      -- from UPC2_PCI_OpenCursor
+//  timestamp   -- usecs x 10 (as the frames' timestamps)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX				if no UPC card with the specified index
+//			  UPC2_INVALID_CURSOR				if the cursor isn't open
+//			  UPC2_NO_CONNECTION				if not connected
+//			  UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
+//		   -- number of frames from the cursor up to the newest if no error
+//
+DllExport long __stdcall UPC2_PCI_SeekCursor(long card_ndx, long cursor, long timestamp)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	UPC2_Cursor_t * pCursor;
+	U32     index, start, newest, frm_size, nMax, newFrameAddr;
+	long    ret_val;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+		return UPC2_DATA_COLLECTION_NOT_STARTED;
+
+	if (cursor < 0 || cursor >= UPC2_MAX_CURSORS || UPC2_Card[card_ndx].Cursor[cursor].from == 0)
+		return UPC2_INVALID_CURSOR;
+	pCursor = &UPC2_Card[card_ndx].Cursor[cursor];
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	ret_val = ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+										&FrameHdrImage, sizeof(FrameHdrImage));
+	if (ret_val >= 0)
+		ret_val = FindFrameSince(card_ndx, &FrameHdrImage, (Int32)timestamp, &index);
+	if (ret_val >= 0 && (frm_size = FrameHdrImage.FrameSize) != 0)
+	{
+		nMax = FrameHdrImage.MaxFrames;
+		start = ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pFrame1) / frm_size;
+		newest = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pFrame1) / frm_size;
+
+		// None at or after the timestamp -- the frame after the newest is the one being loaded
+		if (ret_val == 0)
+			index = newest;
+		pCursor->pos = index;
+		pCursor->placed = TRUE;
+
+		// Frames from the cursor up to the newest are newer than pStart unless it was moved back
+		if ((newest + nMax - index) % nMax > (newest + nMax - start) % nMax && ret_val > 0)
+		{
+			newFrameAddr = (U32)FrameHdrImage.pFrame1 + index * frm_size;
+			WriteToLocalAddressSpace(card_ndx, &newFrameAddr,
+									 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
+		}
+		else
+			CursorCommit(card_ndx, &FrameHdrImage, FALSE);
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetDataEx -- reads converted data (as UPC2_PCI_GetData) into the caller's layout
+//
+//					  UPC2_LAYOUT_ROWS -- frame_no, timestamp and data[nItems] of each frame
+//                       at pLayout->stride bytes (0 => packed, 8 + 4*nItems bytes)
+//
+//					  UPC2_LAYOUT_COLUMNS -- item-major: frame k's frame_no, timestamp and
+//                       item i go to pFrameNo[k], pTimestamp[k] and pItem[i][k] (each array
+//                       holds nFrames values, NULL arrays are skipped). The frames are read
+//                       in chunks of COLUMN_CHUNK_FRAMES and transposed. pFrameNo64[k] and
+//                       pTimestamp64[k] get the 64-bit values (as UPC2_PCI_UnwrapFrames).
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+//  access_type -- UPC2_NO_GAPS, UPC2_FROM_START_FRAME, UPC2_NEWEST_DATA, UPC2_NEWEST_N_FRAMES
+//                 or UPC2_FROM_LOAD_PTR (UPC2_NO_GAPS and UPC2_FROM_START_FRAME are the same here)
+//
+//	 nFrames 	-- long specifying the maximum number of frames to read (not used if NEWEST)
+//
+//  pLayout 	-- pointer to a UPC2_DataLayout_t describing the destination.
+//                 pLayout->nItems is set to the number of items per frame.
+//
+// Returns 		-- negative if an error occurs. 
+//			         UPC2_NULL_PARAM  		 			if pLayout or pRows is NULL
+//			         UPC2_INVALID_PARAM  		 		if layout unknown or stride too small
+//			         UPC2_INVALID_INDEX   		 		if no UPC card with the specified index
+//			         UPC2_NO_CONNECTION	  	     		if not connected
+//                   UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
+//
+//         		-- number of frames read if no error
+//
+DllExport long __stdcall UPC2_PCI_GetDataEx(long card_ndx, long access_type, long nFrames, UPC2_DataLayout_t * pLayout)
+{
+	U8				chunk[COLUMN_CHUNK_FRAMES * EZ_SENSE_FRAME_SIZE];
+	U8 *			pChunk = chunk;
+	long			nChunk = COLUMN_CHUNK_FRAMES;
+	UPC2_ConvertedDataFrame_t * pF;
+	U32				row_size;
+	long			nItems, ret_val, nRead, n, i, k;
+	float *			pDst;
+
+	if (pLayout == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+		return UPC2_DATA_COLLECTION_NOT_STARTED;
+
+	// Items per frame (from the frame size where the DSP is running)
+	if (IsConnected(card_ndx) < 0)
+		nItems = UPC2_Card[card_ndx].Demo.nItems;
+	else
+	{
+		nItems = 0;
+		EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		if (UPC2_Card[card_ndx].pStream != NULL && UPC2_Card[card_ndx].pStream->frm_size != 0)
+			nItems = (UPC2_Card[card_ndx].pStream->frm_size - 12) / 4;
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		if (nItems == 0 && (nItems = UPC2_PCI_GetNumberOfItems(card_ndx)) < 0)
+			return nItems;
+	}
+	if (nItems < 1 || nItems > MAX_ITEMS)
+		return UPC2_COMM_ERR;
+	pLayout->nItems = nItems;
+	row_size = 8 + 4 * nItems;
+
+	if (access_type == UPC2_NO_GAPS)
+		access_type = UPC2_FROM_START_FRAME;
+	else if (access_type == UPC2_NEWEST_DATA || access_type == UPC2_FROM_LOAD_PTR)
+		nFrames = 1;
+
+	if (pLayout->layout == UPC2_LAYOUT_ROWS)
+	{
+		if (pLayout->pRows == NULL)
+			return UPC2_NULL_PARAM;
+		if (pLayout->stride != 0 && (U32)pLayout->stride < row_size)
+			return UPC2_INVALID_PARAM;
+		return GetDataRows(card_ndx, access_type, nFrames, pLayout->pRows,
+						   (pLayout->stride != 0) ? pLayout->stride : row_size);
+	}
+	if (pLayout->layout != UPC2_LAYOUT_COLUMNS)
+		return UPC2_INVALID_PARAM;
+
+	// The last N frames are one window -- read them at once
+	if (access_type == UPC2_NEWEST_N_FRAMES && nFrames > nChunk)
+	{
+		if ((pChunk = (U8 *) malloc(nFrames * row_size)) == NULL)
+			return UPC2_OUT_OF_MEMORY;
+		nChunk = nFrames;
+	}
+
+	// Read packed rows a chunk at a time and scatter them into the columns
+	for (nRead = 0; nRead < nFrames; nRead += ret_val)
+	{
+		n = nFrames - nRead;
+		if (n > nChunk)
+			n = nChunk;
+		ret_val = GetDataRows(card_ndx, access_type, n, pChunk, row_size);
+		if (ret_val < 0)
+		{
+			if (nRead == 0)
+				nRead = ret_val;
+			break;
+		}
+
+		if (pLayout->pFrameNo != NULL)
+		{
+			for (k = 0, pF = (UPC2_ConvertedDataFrame_t *)pChunk; k < ret_val; k++, pF = (UPC2_ConvertedDataFrame_t *)((U8 *)pF + row_size))
+				pLayout->pFrameNo[nRead + k] = pF->frame_no;
+		}
+		if (pLayout->pTimestamp != NULL)
+		{
+			for (k = 0, pF = (UPC2_ConvertedDataFrame_t *)pChunk; k < ret_val; k++, pF = (UPC2_ConvertedDataFrame_t *)((U8 *)pF + row_size))
+				pLayout->pTimestamp[nRead + k] = pF->timestamp;
+		}
+		if (pLayout->pFrameNo64 != NULL)
+			UnwrapColumn(card_ndx, ret_val, pChunk, row_size, 0, pLayout->pFrameNo64 + nRead);
+		if (pLayout->pTimestamp64 != NULL)
+			UnwrapColumn(card_ndx, ret_val, pChunk, row_size, 4, pLayout->pTimestamp64 + nRead);
+		for (i = 0; i < nItems; i++)
+		{
+			if ((pDst = pLayout->pItem[i]) == NULL)
+				continue;
+			pDst += nRead;
+			for (k = 0, pF = (UPC2_ConvertedDataFrame_t *)pChunk; k < ret_val; k++, pF = (UPC2_ConvertedDataFrame_t *)((U8 *)pF + row_size))
+				pDst[k] = pF->data[i];
+		}
+
+		// Short read -- no more frames (NEWEST and LOAD read one, NEWEST_N one window)
+		if (ret_val < n || access_type == UPC2_NEWEST_DATA || access_type == UPC2_FROM_LOAD_PTR ||
+			access_type == UPC2_NEWEST_N_FRAMES)
+		{
+			nRead += ret_val;
+			break;
+		}
+	}
+	if (pChunk != chunk)
+		free(pChunk);
+	return nRead;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// 64-bit frame numbers and timestamps (see UPC2_PCI_UnwrapFrames)
+//
+// frame_no and timestamp are 32-bit counts. The timestamp (10 usec units) wraps every 11.9
+// hours and frame_no every 2^32 frames, so multi-day runs need the high words kept on the
+// host. Each count is extended to the 64-bit value nearest the card's last one, i.e. the
+// signed 32-bit step from the last value is added. That covers wraps, re-reads of older frames
+// and small steps back, as long as consecutive calls are within 2^31 counts of each other.
+//
+// UnwrapWords_Scalar, _SSE2 -- out[k] = out[k-1] + (Int32)(v[k] - (U32)out[k-1]) for k < n,
+//                              out[-1] = *pLast, which is set to out[n-1]
+//
+//  The SSE2 engine checks 4 counts at a time for a wrap or a step back (unsigned compare with
+//  the previous count and the sign of the step). Almost every block has neither and its high
+//  word is the last one's, so the 4 counts are just widened; the rest go through the scalar
+//  step.
+//
+void UnwrapWords_Scalar(const U32 * v, long n, LONGLONG * pLast, LONGLONG * out)
+{
+	LONGLONG  last = *pLast;
+	long      k;
+
+	for (k = 0; k < n; k++)
+		out[k] = last = last + (Int32)(v[k] - (U32)last);
+	*pLast = last;
+}
+#if RAW_USE_SSE2
+void UnwrapWords_SSE2(const U32 * v, long n, LONGLONG * pLast, LONGLONG * out)
+{
+	const __m128i  sign = _mm_set1_epi32(0x80000000);
+	__m128i        cur, prev, step;
+	LONGLONG       last = *pLast;
+	long           k = 0, j;
+
+	while (k + 4 <= n)
+	{
+		cur = _mm_loadu_si128((const __m128i *)(v + k));
+		prev = _mm_or_si128(_mm_slli_si128(cur, 4), _mm_cvtsi32_si128((int)(U32)last));
+		step = _mm_sub_epi32(cur, prev);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi32(_mm_xor_si128(prev, sign), _mm_xor_si128(cur, sign)),
+										   _mm_cmplt_epi32(step, _mm_setzero_si128()))) == 0)
+		{
+			// Same high word throughout
+			step = _mm_set1_epi32((int)(last >> 32));
+			_mm_storeu_si128((__m128i *)(out + k), _mm_unpacklo_epi32(cur, step));
+			_mm_storeu_si128((__m128i *)(out + k + 2), _mm_unpackhi_epi32(cur, step));
+			last = out[k + 3];
+			k += 4;
+		}
+		else
+		{
+			for (j = 0; j < 4; j++, k++)
+				out[k] = last = last + (Int32)(v[k] - (U32)last);
+		}
+	}
+	for ( ; k < n; k++)
+		out[k] = last = last + (Int32)(v[k] - (U32)last);
+	*pLast = last;
+}
+#endif
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UnwrapColumn -- extends frame_no (offset 0) or timestamp (offset 4) of nFrames frames at
+//                 frm_incr bytes to 64 bits, carrying on from the card's last frame
+//
+void UnwrapColumn(long card_ndx, long nFrames, const void * pFrame, U32 frm_incr, U32 offset, LONGLONG * pOut)
+{
+	U32              v[COLUMN_CHUNK_FRAMES];
+	const U8 *       pF = (const U8 *) pFrame + offset;
+	UPC2_Unwrap_t *  pUnwrap = &UPC2_Card[card_ndx].Unwrap;
+	LONGLONG *       pLast;
+	BOOL *           pValid;
+	long             n, k;
+
+	pLast = (offset == 0) ? &pUnwrap->frame_no : &pUnwrap->timestamp;
+	pValid = (offset == 0) ? &pUnwrap->frame_no_valid : &pUnwrap->timestamp_valid;
+
+	while (nFrames > 0)
+	{
+		n = (nFrames > COLUMN_CHUNK_FRAMES) ? COLUMN_CHUNK_FRAMES : nFrames;
+		for (k = 0; k < n; k++, pF += frm_incr)
+			v[k] = *(const U32 *) pF;
+
+		// A new run starts at the count itself (high word 0)
+		if (!*pValid)
+		{
+			*pLast = v[0];
+			*pValid = TRUE;
+		}
+		UnwrapWords(v, n, pLast, pOut);
+		pOut += n;
+		nFrames -= n;
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_UnwrapFrames -- gets the 64-bit frame numbers and timestamps of converted data frames
+//
+//  The frames are as returned by UPC2_PCI_GetData (or UPC2_PCI_GetDataEx/UPC2_PCI_GetRawData
+//  in rows), passed in the order read. The card keeps the last values, so each call carries on
+//  from the one before. A new run of frame numbers starts with UPC2_PCI_StartDataCollection
+//  and of timestamps with UPC2_PCI_SetTimestamp (or UPC2_PCI_ResetUnwrap). Not thread safe --
+//  use one thread per card.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nFrames     -- number of frames
+//  pFrame      -- pointer to the frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//  pFrameNo    -- pointer to nFrames LONGLONGs for the frame numbers, or NULL
+//  pTimestamp  -- pointer to nFrames LONGLONGs for the timestamps (usecs x 10), or NULL
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pFrame is NULL
+//			  UPC2_INVALID_PARAM	if nFrames < 0 or frm_incr is too small
+//		   -- number of frames if no error
+//
+DllExport long __stdcall UPC2_PCI_UnwrapFrames(long card_ndx, long nFrames, void * pFrame, long frm_incr,
+											   LONGLONG * pFrameNo, LONGLONG * pTimestamp)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+	if (nFrames < 0 || frm_incr < 8)
+		return UPC2_INVALID_PARAM;
+
+	if (pFrameNo != NULL)
+		UnwrapColumn(card_ndx, nFrames, pFrame, frm_incr, 0, pFrameNo);
+	if (pTimestamp != NULL)
+		UnwrapColumn(card_ndx, nFrames, pFrame, frm_incr, 4, pTimestamp);
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ResetUnwrap -- starts a new run of the card's 64-bit frame numbers and timestamps
+//                         (the next frame's values are taken as they are)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//		   -- UPC2_NORMAL_RETURN
+//
+DllExport long __stdcall UPC2_PCI_ResetUnwrap(long card_ndx)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	UPC2_Card[card_ndx].Unwrap.frame_no_valid = FALSE;
+	UPC2_Card[card_ndx].Unwrap.timestamp_valid = FALSE;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Raw data conversion (raw mode -- UPC2_Config_t.op_flags = 'R')
+//
+// In raw mode each frame carries one short per sbit (frame_no, timestamp, data[nSbits], check
+// word). An item's value is
+//
+//     scale_factor * mean over its conversions k of ((raw[c_k] - conversion_offset[g_k]) * conversion_factor[g_k])
+//                  + offset
+//
+// where c_k = index_of_conversion_used[k] (sbit) and g_k = index_of_gain_used[k] (gain) from
+// the config and conversion_factor/conversion_offset come from the calibration data. The sbits
+// are converted to volts in one pass (RawToFloat_xxx, per sbit factor A and term B) and the
+// items are then summed from the volts. An sbit used by more than one item is converted at the
+// gain of the last of them.
+//
+// RawToFloat_Scalar, _SSE2, _AVX2 -- dst[j] = src[j] * A[j] + B[j] for j < n (no FMA so every
+//                                    engine gives the same results)
+//
+void RawToFloat_Scalar(const short * src, const float * A, const float * B, float * dst, long n)
+{
+	long j;
+
+	for (j = 0; j < n; j++)
+		dst[j] = (float)src[j] * A[j] + B[j];
+}
+#if RAW_USE_SSE2
+void RawToFloat_SSE2(const short * src, const float * A, const float * B, float * dst, long n)
+{
+	__m128i  r, lo, hi;
+	long     j;
+
+	for (j = 0; j + 8 <= n; j += 8)
+	{
+		r = _mm_loadu_si128((const __m128i *)(src + j));
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(r, r), 16);		// sign extend
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(r, r), 16);
+		_mm_storeu_ps(dst + j,     _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), _mm_loadu_ps(A + j)), _mm_loadu_ps(B + j)));
+		_mm_storeu_ps(dst + j + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), _mm_loadu_ps(A + j + 4)), _mm_loadu_ps(B + j + 4)));
+	}
+	for ( ; j < n; j++)
+		dst[j] = (float)src[j] * A[j] + B[j];
+}
+#endif
+#if RAW_USE_AVX2
+void RawToFloat_AVX2(const short * src, const float * A, const float * B, float * dst, long n)
+{
+	__m256   v;
+	long     j;
+
+	for (j = 0; j + 8 <= n; j += 8)
+	{
+		v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + j))));
+		_mm256_storeu_ps(dst + j, _mm256_add_ps(_mm256_mul_ps(v, _mm256_loadu_ps(A + j)), _mm256_loadu_ps(B + j)));
+	}
+	_mm256_zeroupper();
+	for ( ; j < n; j++)
+		dst[j] = (float)src[j] * A[j] + B[j];
+}
+#endif
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// BuildRawPlan -- works out the per sbit factors and the item sums from the card's config and
+//                 calibration data (shadow copies)
+//
+// Returns -- negative if an error occurs
+//			  UPC2_NO_CONFIG, UPC2_NO_CALIB_DATA	if not loaded
+//			  UPC2_NOT_RAW_MODE		if the config doesn't return raw data
+//			  UPC2_INVALID_ITEM		if an item refers to an sbit or gain out of range
+//
+long BuildRawPlan(long card_ndx, UPC2_RawPlan_t * pPlan)
+{
+	UPC2_Config_t *     pCfg = &UPC2_Card[card_ndx].Config;
+	UPC2_Calib_data_t * pCal = &UPC2_Card[card_ndx].Calib;
+	long                i, k, c, g, ret_val;
+
+	if ((ret_val = GetShadowConfig(card_ndx)) < 0 || (ret_val = GetShadowCalib(card_ndx)) < 0)
+		return ret_val;
+
+	if ((pCfg->op_flags & 0x000000ff) != 0x00000052)
+		return UPC2_NOT_RAW_MODE;
+	if (pCfg->nItems < 1 || pCfg->nItems > MAX_ITEMS || pCfg->nSbits < 1 || pCfg->nSbits > MAX_SBITS)
+		return UPC2_INVALID_PARAM;
+
+	pPlan->nItems = pCfg->nItems;
+	pPlan->nSbits = pCfg->nSbits;
+	memset(pPlan->A, 0, pPlan->nSbits * sizeof(float));
+	memset(pPlan->B, 0, pPlan->nSbits * sizeof(float));
+
+	for (i = 0; i < pPlan->nItems; i++)
+	{
+		pPlan->nTerms[i] = pCfg->item[i].number_of_conversions_used;
+		if (pPlan->nTerms[i] < 1 || pPlan->nTerms[i] > 4)
+			pPlan->nTerms[i] = 1;
+		for (k = 0; k < pPlan->nTerms[i]; k++)
+		{
+			c = pCfg->item[i].index_of_conversion_used[k];
+			g = pCfg->item[i].index_of_gain_used[k];
+			if (c < 0 || c >= pPlan->nSbits || g < 0 || g >= 10)
+				return UPC2_INVALID_ITEM;
+			pPlan->term[i][k] = c;
+			pPlan->A[c] = pCal->conversion_factor[g];
+			pPlan->B[c] = -(float)pCal->conversion_offset[g] * pCal->conversion_factor[g];
+		}
+		pPlan->scale[i] = pCfg->item[i].scale_factor / pPlan->nTerms[i];
+		pPlan->offset[i] = pCfg->item[i].offset;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ConvertRaw -- converts raw frames with a plan (see BuildRawPlan)
+//
+// src, raw_incr  -- raw frames and their spacing in bytes
+// dest, frm_incr -- converted frames and their spacing in bytes
+//
+void ConvertRaw(const UPC2_RawPlan_t * pPlan, long nFrames, const U8 * src, U32 raw_incr,
+				U8 * dest, U32 frm_incr)
+{
+	float                       volts[MAX_SBITS];
+	const UPC2_RawDataFrame_t * pR;
+	UPC2_ConvertedDataFrame_t * pF;
+	long                        n, i, k;
+	float                       sum;
+
+	for (n = 0; n < nFrames; n++)
+	{
+		pR = (const UPC2_RawDataFrame_t *)(src + n * raw_incr);
+		pF = (UPC2_ConvertedDataFrame_t *)(dest + n * frm_incr);
+
+		RawToFloat(pR->data, pPlan->A, pPlan->B, volts, pPlan->nSbits);
+		pF->frame_no = pR->frame_no;
+		pF->timestamp = pR->timestamp;
+		for (i = 0; i < pPlan->nItems; i++)
+		{
+			sum = volts[pPlan->term[i][0]];
+			for (k = 1; k < pPlan->nTerms[i]; k++)
+				sum += volts[pPlan->term[i][k]];
+			pF->data[i] = sum * pPlan->scale[i] + pPlan->offset[i];
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ConvertRawFrames -- converts raw frames (e.g. read with UPC2_PCI_GetData UPC2_NO_GAPS
+//                              in raw mode) into converted data frames
+//
+// parameters:
+//
+// card_ndx  -- long 0, 1, 2, .. representing the card's index (its config and calibration data
+//              are used)
+// nFrames   -- number of frames
+// pRaw      -- pointer to the raw frames (frame_no, timestamp, short data[nSbits])
+// raw_incr  -- spacing of the raw frames in bytes (0 => as read from the card, 8 + 2*nSbits
+//              rounded up to 4 bytes)
+// pFrame    -- pointer to a destination buffer for the converted frames (must not overlap pRaw)
+// frm_incr  -- spacing of the converted frames in bytes (0 => packed, 8 + 4*nItems)
+//
+// Returns -- negative if an error occurs
+//			  UPC2_NULL_PARAM		if pRaw or pFrame is NULL
+//			  UPC2_INVALID_PARAM	if a spacing is too small
+//			  UPC2_NO_CONFIG		if no config loaded
+//			  UPC2_NO_CALIB_DATA	if no calibration data loaded
+//			  UPC2_NOT_RAW_MODE		if the config doesn't return raw data
+//			  UPC2_INVALID_ITEM		if an item refers to an sbit or gain out of range
+//			  UPC2_NO_CONNECTION	if not connected
+//		   -- number of frames converted if no error
+//
+DllExport long __stdcall UPC2_PCI_ConvertRawFrames(long card_ndx, long nFrames, void * pRaw, long raw_incr,
+												   void * pFrame, long frm_incr)
+{
+	UPC2_RawPlan_t  Plan;
+	long            ret_val;
+
+	if (pRaw == NULL || pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if ((ret_val = BuildRawPlan(card_ndx, &Plan)) < 0)
+		return ret_val;
+
+	if (raw_incr == 0)
+		raw_incr = (8 + 2 * Plan.nSbits + 3) & ~3;
+	if (frm_incr == 0)
+		frm_incr = 8 + 4 * Plan.nItems;
+	if (nFrames < 0 || raw_incr < 8 + 2 * Plan.nSbits || frm_incr < 8 + 4 * Plan.nItems)
+		return UPC2_INVALID_PARAM;
+
+	ConvertRaw(&Plan, nFrames, (const U8 *) pRaw, raw_incr, (U8 *) pFrame, frm_incr);
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetRawData -- reads raw frames from the ring buffer and returns them converted
+//                        (raw mode counterpart of UPC2_PCI_GetData)
+//
+//  The frames are read packed (2 bytes per sbit instead of 4 per item) RAW_CHUNK_FRAMES at a
+//  time and converted on the host. The destination is laid out as by UPC2_PCI_GetData.
+//  In Demo mode (not connected) this is UPC2_PCI_GetData.
+//
+// parameters:
+//
+//  card_ndx, access_type, nFrames, pFrame -- as UPC2_PCI_GetData
+//
+// Returns 		-- as UPC2_PCI_GetData and UPC2_PCI_ConvertRawFrames
+//
+DllExport long __stdcall UPC2_PCI_GetRawData(long card_ndx, long access_type, long nFrames, void * pFrame)
+{
+	U8              chunk[RAW_CHUNK_FRAMES * RAW_FRAME_MAX];
+	U8 *            pChunk = chunk;
+	long            nChunk = RAW_CHUNK_FRAMES;
+	UPC2_RawPlan_t  Plan;
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	U32             raw_size, frm_incr;
+	long            ret_val, nRead, n;
+
+	if (IsConnected(card_ndx) < 0)
+		return UPC2_PCI_GetData(card_ndx, access_type, nFrames, pFrame);
+
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	if ((ret_val = BuildRawPlan(card_ndx, &Plan)) < 0)
+		return ret_val;
+
+	// Frame size in the pool (padded to 32 bits by the DSP) less the check word
+	if ((ret_val = ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+											 &FrameHdrImage, sizeof(FrameHdrImage))) < 0)
+		return ret_val;
+	raw_size = FrameHdrImage.FrameSize - 4;
+	if (FrameHdrImage.FrameSize < 4 || raw_size < (U32)(8 + 2 * Plan.nSbits) || raw_size > RAW_FRAME_MAX)
+		return UPC2_NO_CONFIG;
+	frm_incr = (access_type == UPC2_NO_GAPS) ? 8 + 4 * Plan.nItems : EZ_SENSE_FRAME_SIZE;
+	if (access_type == UPC2_NEWEST_DATA || access_type == UPC2_FROM_LOAD_PTR)
+		nFrames = 1;
+
+	// The last N frames are one window -- read them at once
+	if (access_type == UPC2_NEWEST_N_FRAMES && nFrames > nChunk)
+	{
+		if ((pChunk = (U8 *) malloc(nFrames * raw_size)) == NULL)
+			return UPC2_OUT_OF_MEMORY;
+		nChunk = nFrames;
+	}
+
+	for (nRead = 0; nRead < nFrames; nRead += ret_val)
+	{
+		n = nFrames - nRead;
+		if (n > nChunk)
+			n = nChunk;
+		ret_val = GetDataRows(card_ndx, access_type, n, pChunk, raw_size);
+		if (ret_val < 0)
+		{
+			if (nRead == 0)
+				nRead = ret_val;
+			break;
+		}
+
+		ConvertRaw(&Plan, ret_val, pChunk, raw_size, (U8 *) pFrame + nRead * frm_incr, frm_incr);
+
+		// Short read -- no more frames (NEWEST and LOAD read one, NEWEST_N one window)
+		if (ret_val < n || access_type == UPC2_NEWEST_DATA || access_type == UPC2_FROM_LOAD_PTR ||
+			access_type == UPC2_NEWEST_N_FRAMES)
+		{
+			nRead += ret_val;
+			break;
+		}
+	}
+	if (pChunk != chunk)
+		free(pChunk);
+	return nRead;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Host moving average (see UPC2_PCI_StartHostAverage)
+//
+// Every window keeps a running sum per item in double. Adding a frame adds its values and
+// subtracts the values leaving each window (read from a ring of the last cap frames), so the
+// cost per frame doesn't depend on the window lengths. Windows whose items all have the same
+// length go through AvgUpdate (all items at once in SIMD lanes), the others item by item.
+// The sums are recomputed from the ring each time it wraps so rounding can't build up.
+//
+// AvgUpdate_Scalar, _SSE2 -- sum[i] += (double)add[i] - (double)sub[i] for i < n
+//
+void AvgUpdate_Scalar(double * sum, const float * add, const float * sub, long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sum[i] += (double)add[i] - (double)sub[i];
+}
+#if RAW_USE_SSE2
+void AvgUpdate_SSE2(double * sum, const float * add, const float * sub, long n)
+{
+	__m128   a, s;
+	long     i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+	{
+		a = _mm_loadu_ps(add + i);
+		s = _mm_loadu_ps(sub + i);
+		_mm_storeu_pd(sum + i, _mm_add_pd(_mm_loadu_pd(sum + i),
+					  _mm_sub_pd(_mm_cvtps_pd(a), _mm_cvtps_pd(s))));
+		_mm_storeu_pd(sum + i + 2, _mm_add_pd(_mm_loadu_pd(sum + i + 2),
+					  _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), _mm_cvtps_pd(_mm_movehl_ps(s, s)))));
+	}
+	for ( ; i < n; i++)
+		sum[i] += (double)add[i] - (double)sub[i];
+}
+#endif
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HostAvgResum -- recomputes the running sums from the ring (pos is the next row)
+//
+void HostAvgResum(UPC2_HostAvg_t * pAvg)
+{
+	long    w, i, k, n, row;
+	double  sum;
+
+	for (w = 0; w < pAvg->nWindows; w++)
+	{
+		for (i = 0; i < pAvg->nItems; i++)
+		{
+			n = (pAvg->nAdded < (U32)pAvg->len[w][i]) ? (long)pAvg->nAdded : pAvg->len[w][i];
+			sum = 0;
+			for (k = 1; k <= n; k++)
+			{
+				row = pAvg->pos - k;
+				if (row < 0)
+					row += pAvg->cap;
+				sum += pAvg->pHist[row * pAvg->nItems + i];
+			}
+			pAvg->sum[w][i] = sum;
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HostAvgAdd -- adds one frame (nItems values) to every window
+//
+void HostAvgAdd(UPC2_HostAvg_t * pAvg, const float * pData)
+{
+	const float * pOld;
+	long          w, i, row, len;
+
+	for (w = 0; w < pAvg->nWindows; w++)
+	{
+		if (pAvg->uniform[w])
+		{
+			len = pAvg->len[w][0];
+			if (pAvg->nAdded < (U32)len)
+				pOld = pAvg->zero;
+			else
+			{
+				row = pAvg->pos - len;
+				if (row < 0)
+					row += pAvg->cap;
+				pOld = pAvg->pHist + row * pAvg->nItems;
+			}
+			AvgUpdate(pAvg->sum[w], pData, pOld, pAvg->nItems);
+		}
+		else
+		{
+			for (i = 0; i < pAvg->nItems; i++)
+			{
+				len = pAvg->len[w][i];
+				pAvg->sum[w][i] += pData[i];
+				if (pAvg->nAdded >= (U32)len)
+				{
+					row = pAvg->pos - len;
+					if (row < 0)
+						row += pAvg->cap;
+					pAvg->sum[w][i] -= pAvg->pHist[row * pAvg->nItems + i];
+				}
+			}
+		}
+	}
+
+	// Then store it (the row may be the one that just left the longest window)
+	memcpy(pAvg->pHist + pAvg->pos * pAvg->nItems, pData, pAvg->nItems * sizeof(float));
+	if (pAvg->nAdded < (U32)pAvg->cap)
+		pAvg->nAdded++;
+	if (++pAvg->pos == pAvg->cap)
+	{
+		pAvg->pos = 0;
+		HostAvgResum(pAvg);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// HostAvgGet -- gets the averages (nWindows x nItems, window-major)
+//
+void HostAvgGet(UPC2_HostAvg_t * pAvg, float * pAverage)
+{
+	long    w, i, n;
+
+	for (w = 0; w < pAvg->nWindows; w++)
+	{
+		for (i = 0; i < pAvg->nItems; i++)
+		{
+			n = (pAvg->nAdded < (U32)pAvg->len[w][i]) ? (long)pAvg->nAdded : pAvg->len[w][i];
+			*pAverage++ = (n > 0) ? (float)(pAvg->sum[w][i] / n) : 0.0f;
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartHostAverage -- sets up moving averages of the card's items on the host
+//
+//  Frames are added with UPC2_PCI_AddFramesToAverage. Each window gives one average per item
+//  over the last len frames (or as many as have been added). Unlike the DSP's averaging
+//  (avg_count up to MAX_AVG_COUNT) the windows may be up to UPC2_MAX_HOST_AVG frames.
+//  The frames come from the DSP already averaged over avg_count, so a window of L frames
+//  spans L * avg_count samples. A started average is replaced.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nWindows    -- number of windows (1 to UPC2_MAX_AVG_WINDOWS)
+//  pWindowLen  -- pointer to nWindows window lengths in frames
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pWindowLen is NULL
+//			  UPC2_INVALID_PARAM	if nWindows or a length is out of range
+//			  UPC2_NO_CONFIG		if no config (nItems unknown)
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the frame history
+//
+DllExport long __stdcall UPC2_PCI_StartHostAverage(long card_ndx, long nWindows, long * pWindowLen)
+{
+	UPC2_HostAvg_t *  pAvg;
+	long              w, i, len, nItems;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (pWindowLen == NULL)
+		return UPC2_NULL_PARAM;
+	if (nWindows < 1 || nWindows > UPC2_MAX_AVG_WINDOWS)
+		return UPC2_INVALID_PARAM;
+
+	// Items from the config
+	if (IsConnected(card_ndx) < 0)
+		nItems = UPC2_Card[card_ndx].Demo.nItems;
+	else if (GetShadowConfig(card_ndx) >= 0)
+		nItems = UPC2_Card[card_ndx].Config.nItems;
+	else
+		nItems = 0;
+	if (nItems < 1 || nItems > MAX_ITEMS)
+		return UPC2_NO_CONFIG;
+
+	if ((pAvg = (UPC2_HostAvg_t *) calloc(1, sizeof(UPC2_HostAvg_t))) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+	pAvg->nItems = nItems;
+	pAvg->nWindows = nWindows;
+	pAvg->cap = 1;
+	for (w = 0; w < nWindows; w++)
+	{
+		pAvg->uniform[w] = TRUE;
+		for (i = 0; i < nItems; i++)
+		{
+			len = pWindowLen[w];
+			if (len < 1 || len > UPC2_MAX_HOST_AVG)
+			{
+				free(pAvg);
+				return UPC2_INVALID_PARAM;
+			}
+			pAvg->len[w][i] = len;
+			if (len != pAvg->len[w][0])
+				pAvg->uniform[w] = FALSE;
+			if (len > pAvg->cap)
+				pAvg->cap = len;
+		}
+	}
+	pAvg->pHist = (float *) malloc(pAvg->cap * nItems * sizeof(float));
+	if (pAvg->pHist == NULL)
+	{
+		free(pAvg);
+		return UPC2_OUT_OF_MEMORY;
+	}
+
+	UPC2_PCI_StopHostAverage(card_ndx);
+	UPC2_Card[card_ndx].pHostAvg = pAvg;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_AddFramesToAverage -- adds converted data frames to the card's host moving averages
+//
+//  The frames are as returned by UPC2_PCI_GetData (or UPC2_PCI_GetDataEx/UPC2_PCI_GetRawData
+//  in rows). The averages are not thread safe -- use one thread per card.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nFrames     -- number of frames
+//  pFrame      -- pointer to the frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//  pAverage    -- pointer to nWindows x nItems floats for the averages after the last frame
+//                 (window-major) or NULL
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pFrame is NULL
+//			  UPC2_INVALID_PARAM	if nFrames < 0 or frm_incr is too small
+//			  UPC2_NOT_AVERAGING	if UPC2_PCI_StartHostAverage hasn't been called
+//		   -- number of frames added if no error
+//
+DllExport long __stdcall UPC2_PCI_AddFramesToAverage(long card_ndx, long nFrames, void * pFrame, long frm_incr,
+													 float * pAverage)
+{
+	UPC2_HostAvg_t *  pAvg;
+	U8 *              pF = (U8 *) pFrame;
+	long              n;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if ((pAvg = UPC2_Card[card_ndx].pHostAvg) == NULL)
+		return UPC2_NOT_AVERAGING;
+
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+	if (nFrames < 0 || frm_incr < 8 + 4 * pAvg->nItems)
+		return UPC2_INVALID_PARAM;
+
+	for (n = 0; n < nFrames; n++, pF += frm_incr)
+		HostAvgAdd(pAvg, ((UPC2_ConvertedDataFrame_t *) pF)->data);
+
+	if (pAverage != NULL)
+		HostAvgGet(pAvg, pAverage);
+	return nFrames;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetHostAverage -- gets the card's host moving averages
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pAverage    -- pointer to nWindows x nItems floats (window-major)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pAverage is NULL
+//			  UPC2_NOT_AVERAGING	if UPC2_PCI_StartHostAverage hasn't been called
+//		   -- number of frames averaged (in the longest window)
+//
+DllExport long __stdcall UPC2_PCI_GetHostAverage(long card_ndx, float * pAverage)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (UPC2_Card[card_ndx].pHostAvg == NULL)
+		return UPC2_NOT_AVERAGING;
+
+	if (pAverage == NULL)
+		return UPC2_NULL_PARAM;
+
+	HostAvgGet(UPC2_Card[card_ndx].pHostAvg, pAverage);
+	return UPC2_Card[card_ndx].pHostAvg->nAdded;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopHostAverage -- frees the card's host moving averages
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//
+DllExport long __stdcall UPC2_PCI_StopHostAverage(long card_ndx)
+{
+	UPC2_HostAvg_t *  pAvg;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if ((pAvg = UPC2_Card[card_ndx].pHostAvg) != NULL)
+	{
+		UPC2_Card[card_ndx].pHostAvg = NULL;
+		free(pAvg->pHist);
+		free(pAvg);
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Shared frame batches (see UPC2_PCI_StartBatchPool)
+//
+// UPC2_PCI_GetData copies the frames into each caller's buffer. A batch is read once into a
+// block of the card's pool and handed out by reference, so several consumers can use the same
+// frames without copying them. The pool is allocated when it is set up, none on the data path.
+//
+// PoolRelease -- drops a reference to a batch pool (the last frees it)
+//
+void PoolRelease(UPC2_BatchPool_t * pPool)
+{
+	if (InterlockedDecrement(&pPool->refs) == 0)
+	{
+		DeleteCriticalSection(&pPool->Lock);
+		free(pPool->pSlab);
+		free(pPool);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// BatchFree -- returns a batch's block to its pool and drops the pool reference it held
+//
+void BatchFree(UPC2_Batch_t * pBatch)
+{
+	UPC2_BatchPool_t *  pPool = (UPC2_BatchPool_t *) pBatch->pPool;
+
+	EnterCriticalSection(&pPool->Lock);
+	pBatch->next = pPool->free;
+	pPool->free = ((U8 *)pBatch - pPool->pSlab) / pPool->block_size;
+	LeaveCriticalSection(&pPool->Lock);
+	PoolRelease(pPool);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartBatchPool -- sets up the card's pool of frame batches (see UPC2_PCI_GetBatch)
+//
+//  The batches are sized from the DSP's frame size (FrameSize less the check word), or from
+//  the number of items in demo mode. A started pool is replaced.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nBatches    -- batches in the pool (1 to UPC2_MAX_BATCHES)
+//  nFrames     -- frames per batch (1 to UPC2_MAX_STREAM_FRAMES)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_INVALID_PARAM	if nBatches or nFrames is out of range
+//			  UPC2_NO_CONFIG		if the frame size isn't known (no config or data collection)
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the pool
+//
+DllExport long __stdcall UPC2_PCI_StartBatchPool(long card_ndx, long nBatches, long nFrames)
+{
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	UPC2_BatchPool_t *  pPool;
+	UPC2_Batch_t *      pBatch;
+	long                frm_incr, b;
+	U32                 block_size;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (nBatches < 1 || nBatches > UPC2_MAX_BATCHES || nFrames < 1 || nFrames > UPC2_MAX_STREAM_FRAMES)
+		return UPC2_INVALID_PARAM;
+
+	// Frame size (as UPC2_PCI_GetData with UPC2_NO_GAPS)
+	if (IsConnected(card_ndx) < 0)
+		frm_incr = 8 + 4 * UPC2_Card[card_ndx].Demo.nItems;
+	else if (ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+									   &FrameHdrImage, sizeof(FrameHdrImage)) >= 0)
+		frm_incr = FrameHdrImage.FrameSize - 4;
+	else
+		frm_incr = 0;
+	if (frm_incr <= 8 || frm_incr > EZ_SENSE_FRAME_SIZE)
+		return UPC2_NO_CONFIG;
+
+	block_size = (sizeof(UPC2_Batch_t) + nFrames * frm_incr + 63) & ~63;
+	if ((double)block_size * nBatches > 0x40000000)
+		return UPC2_OUT_OF_MEMORY;
+
+	if ((pPool = (UPC2_BatchPool_t *) calloc(1, sizeof(UPC2_BatchPool_t))) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+	if ((pPool->pSlab = (U8 *) malloc(block_size * nBatches)) == NULL)
+	{
+		free(pPool);
+		return UPC2_OUT_OF_MEMORY;
+	}
+	pPool->block_size = block_size;
+	pPool->nBlocks = nBatches;
+	pPool->nCap = nFrames;
+	pPool->frm_incr = frm_incr;
+	pPool->refs = 1;
+	InitializeCriticalSection(&pPool->Lock);
+
+	// Every block free, in order
+	for (b = 0; b < nBatches; b++)
+	{
+		pBatch = (UPC2_Batch_t *)(pPool->pSlab + b * block_size);
+		pBatch->card_ndx = card_ndx;
+		pBatch->frm_incr = frm_incr;
+		pBatch->pFrame = (U8 *)pBatch + sizeof(UPC2_Batch_t);
+		pBatch->pPool = pPool;
+		pBatch->next = (b + 1 < nBatches) ? b + 1 : -1;
+	}
+	pPool->free = 0;
+
+	UPC2_PCI_StopBatchPool(card_ndx);
+	UPC2_Card[card_ndx].pBatchPool = pPool;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetBatch -- reads converted data frames into a batch from the card's pool
+//
+//  The frames are read as UPC2_PCI_GetData would (from the host ring buffer when streaming)
+//  and packed at the frame size. The batch is returned with one reference; pass it to other
+//  consumers with UPC2_PCI_HoldBatch and return it with UPC2_PCI_ReleaseBatch. Not to be
+//  called while the pool is being started or stopped (as UPC2_PCI_AddFramesToAverage).
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  access_type -- as UPC2_PCI_GetData
+//  nFrames     -- maximum number of frames (up to the frames per batch of the pool)
+//  ppBatch     -- set to the batch (NULL if no frames)
+//
+// Returns -- negative if an error occurs (as UPC2_PCI_GetData or)
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if ppBatch is NULL
+//			  UPC2_NO_BATCH_POOL	if UPC2_PCI_StartBatchPool hasn't been called
+//			  UPC2_NO_FREE_BATCH	if every batch of the pool is held
+//		   -- number of frames in the batch if no error
+//
+DllExport long __stdcall UPC2_PCI_GetBatch(long card_ndx, long access_type, long nFrames, UPC2_Batch_t ** ppBatch)
+{
+	UPC2_BatchPool_t *  pPool;
+	UPC2_Batch_t *      pBatch;
+	long                ret_val;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (ppBatch == NULL)
+		return UPC2_NULL_PARAM;
+	*ppBatch = NULL;
+
+	if ((pPool = UPC2_Card[card_ndx].pBatchPool) == NULL)
+		return UPC2_NO_BATCH_POOL;
+
+	// Take a free block
+	EnterCriticalSection(&pPool->Lock);
+	if (pPool->free < 0)
+	{
+		LeaveCriticalSection(&pPool->Lock);
+		return UPC2_NO_FREE_BATCH;
+	}
+	pBatch = (UPC2_Batch_t *)(pPool->pSlab + pPool->free * pPool->block_size);
+	pPool->free = pBatch->next;
+	LeaveCriticalSection(&pPool->Lock);
+	InterlockedIncrement(&pPool->refs);
+
+	if (nFrames > pPool->nCap)
+		nFrames = pPool->nCap;
+	ret_val = GetDataRows(card_ndx, access_type, nFrames, (void *) pBatch->pFrame, pPool->frm_incr);
+	if (ret_val <= 0)
+	{
+		BatchFree(pBatch);
+		return ret_val;
+	}
+
+	pBatch->nFrames = ret_val;
+	pBatch->refs = 1;
+	*ppBatch = pBatch;
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_HoldBatch -- adds a reference to a batch (for another consumer)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_NULL_PARAM		if pBatch is NULL
+//			  UPC2_INVALID_PARAM	if the batch has been released
+//		   -- references held
+//
+DllExport long __stdcall UPC2_PCI_HoldBatch(UPC2_Batch_t * pBatch)
+{
+	if (pBatch == NULL)
+		return UPC2_NULL_PARAM;
+
+	if (pBatch->refs <= 0)
+		return UPC2_INVALID_PARAM;
+
+	return InterlockedIncrement(&pBatch->refs);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ReleaseBatch -- drops a reference to a batch. The last returns it to its pool
+//                          (the batch mustn't be used after that).
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_NULL_PARAM		if pBatch is NULL
+//			  UPC2_INVALID_PARAM	if the batch has been released
+//		   -- references still held
+//
+DllExport long __stdcall UPC2_PCI_ReleaseBatch(UPC2_Batch_t * pBatch)
+{
+	LONG    refs;
+
+	if (pBatch == NULL)
+		return UPC2_NULL_PARAM;
+
+	if ((refs = InterlockedDecrement(&pBatch->refs)) < 0)
+	{
+		InterlockedIncrement(&pBatch->refs);
+		return UPC2_INVALID_PARAM;
+	}
+	if (refs == 0)
+		BatchFree(pBatch);
+	return refs;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopBatchPool -- frees the card's pool of frame batches. Batches still held stay
+//                           valid; the pool is freed when the last is released.
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//
+DllExport long __stdcall UPC2_PCI_StopBatchPool(long card_ndx)
+{
+	UPC2_BatchPool_t *  pPool;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if ((pPool = UPC2_Card[card_ndx].pBatchPool) != NULL)
+	{
+		UPC2_Card[card_ndx].pBatchPool = NULL;
+		PoolRelease(pPool);
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Clock sync (see UPC2_PCI_StartClockSync)
+//
+// A sample reads the card's timestamp (TIMESTAMP_ADDR) CLOCK_BURST times between two
+// QueryPerformanceCounter reads and keeps the read with the shortest round trip, taking the
+// middle of the round trip as the host time. The last CLOCK_SAMPLES samples are fitted
+// with a Theil-Sen line (the median of the pairwise slopes, then the median intercept), which
+// a few delayed reads (interrupts, preemption) can't pull off.
+//
+// Card timestamps (10 usec units) wrap every 11.9 hours. Samples are unwrapped against the
+// previous sample, and a frame's timestamp against the latest sample (so within 6 hours).
+//
+// ClockUnwrap   -- unwraps a card timestamp against an unwrapped reference
+// ClockFit      -- fits the card's samples (caller holds UPC2_ClockLock)
+// ClockSample   -- takes a sample and refits (caller holds UPC2_ClockLock)
+// ClockHostTime -- maps a card timestamp to host seconds (caller holds UPC2_ClockLock)
+// ResetClock    -- discards a card's samples (its timestamps jumped or it is going away)
+// ClockThread   -- samples every connected card every period
+//
+LONGLONG ClockUnwrap(LONGLONG ref, Int32 ts)
+{
+	return ref + (Int32)((U32)ts - (U32)ref);
+}
+void ClockFit(UPC2_Clock_t * pClock)
+{
+	static double  slope[CLOCK_SAMPLES * (CLOCK_SAMPLES - 1) / 2];
+	double         icpt[CLOCK_SAMPLES];
+	double         dh, rate;
+	long           i, j, n = pClock->nSamples, ns = 0;
+
+	pClock->valid = FALSE;
+	for (i = 0; i < n; i++)
+	{
+		for (j = i + 1; j < n; j++)
+		{
+			dh = pClock->host[j] - pClock->host[i];
+			if (dh > CLOCK_MIN_SPAN || dh < -CLOCK_MIN_SPAN)
+				slope[ns++] = (double)(pClock->card[j] - pClock->card[i]) / dh;
+		}
+	}
+	if (ns == 0)
+		return;
+	qsort(slope, ns, sizeof(double), CompareDouble);
+	rate = slope[ns / 2];
+	if (rate <= 0)
+		return;
+
+	// Intercept at the latest sample
+	pClock->h_ref = pClock->host[(pClock->next + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES];
+	pClock->c_ref = pClock->card[(pClock->next + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES];
+	for (i = 0; i < n; i++)
+		icpt[i] = (double)(pClock->card[i] - pClock->c_ref) - rate * (pClock->host[i] - pClock->h_ref);
+	qsort(icpt, n, sizeof(double), CompareDouble);
+	pClock->offset = icpt[n / 2];
+	for (i = 0; i < n; i++)
+	{
+		icpt[i] = (double)(pClock->card[i] - pClock->c_ref) - rate * (pClock->host[i] - pClock->h_ref) - pClock->offset;
+		if (icpt[i] < 0)
+			icpt[i] = -icpt[i];
+	}
+	qsort(icpt, n, sizeof(double), CompareDouble);
+	pClock->resid = icpt[n / 2];
+	pClock->rate = rate;
+	pClock->valid = TRUE;
+}
+long ClockSample(long card_ndx)
+{
+	UPC2_Clock_t *  pClock = &UPC2_Card[card_ndx].Clock;
+	LARGE_INTEGER   t0, t1;
+	double          rtt, best_rtt = 0, host = 0;
+	Int32           ts, best_ts = 0;
+	long            k, ret_val;
+
+	// Hold the HPI so the reads aren't held up by other threads
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	for (k = 0; k < CLOCK_BURST; k++)
+	{
+		QueryPerformanceCounter(&t0);
+		ret_val = ReadFromLocalAddressSpace(card_ndx, TIMESTAMP_ADDR, &ts, sizeof(ts));
+		QueryPerformanceCounter(&t1);
+		if (ret_val < 0)
+		{
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+			return ret_val;
+		}
+		rtt = (double)(t1.QuadPart - t0.QuadPart) / (double)frq.QuadPart;
+		if (k == 0 || rtt < best_rtt)
+		{
+			best_rtt = rtt;
+			best_ts = ts;
+			host = ((double)t0.QuadPart + (double)(t1.QuadPart - t0.QuadPart) / 2) / (double)frq.QuadPart;
+		}
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	if (pClock->nSamples == 0)
+		pClock->last = best_ts;
+	pClock->last = ClockUnwrap(pClock->last, best_ts);
+	pClock->host[pClock->next] = host;
+	pClock->card[pClock->next] = pClock->last;
+	pClock->rtt[pClock->next] = best_rtt;
+	pClock->next = (pClock->next + 1) % CLOCK_SAMPLES;
+	if (pClock->nSamples < CLOCK_SAMPLES)
+		pClock->nSamples++;
+	ClockFit(pClock);
+	return UPC2_NORMAL_RETURN;
+}
+double ClockHostTime(UPC2_Clock_t * pClock, Int32 timestamp)
+{
+	return pClock->h_ref +
+		   ((double)(ClockUnwrap(pClock->c_ref, timestamp) - pClock->c_ref) - pClock->offset) / pClock->rate;
+}
+void ResetClock(long card_ndx)
+{
+	EnterCriticalSection(&UPC2_ClockLock);
+	memset(&UPC2_Card[card_ndx].Clock, 0, sizeof(UPC2_Clock_t));
+	LeaveCriticalSection(&UPC2_ClockLock);
+}
+unsigned __stdcall ClockThread(void * pArg)
+{
+	long  i;
+
+	while (ClockRun)
+	{
+		for (i = 0; i < MAX_PCI_CARDS && ClockRun; i++)
+		{
+			EnterCriticalSection(&UPC2_ClockLock);
+			if (IsConnected(i) > 0)
+				ClockSample(i);
+			LeaveCriticalSection(&UPC2_ClockLock);
+		}
+		WaitForSingleObject(hClockWake, ClockPeriod);
+	}
+	return 0;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartClockSync -- starts a thread that samples the clock of every connected card
+//                            (see UPC2_PCI_GetClockFit and UPC2_PCI_HostTimeFor)
+//
+//  Replaces UPC2_PCI_SetTimestamp for aligning the cards: rather than setting the cards' clocks
+//  the offset and drift of each against the host clock are measured continuously. A merge
+//  (UPC2_PCI_StartMerge) started once every card has a fit orders frames by host time.
+//
+// parameters:
+//
+//  period_ms   -- time between samples of a card (msecs) (0 => UPC2_CLOCK_PERIOD)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if period_ms < 0
+//			  UPC2_COMM_ERR			if unable to start the thread
+//
+DllExport long __stdcall UPC2_PCI_StartClockSync(long period_ms)
+{
+	unsigned  thread_id;
+
+	if (period_ms < 0)
+		return UPC2_INVALID_PARAM;
+
+	ClockPeriod = (period_ms != 0) ? period_ms : UPC2_CLOCK_PERIOD;
+	if (hClockThread != NULL)
+		return UPC2_NORMAL_RETURN;
+
+	QueryPerformanceFrequency(&frq);
+	ClockRun = 1;
+	hClockThread = (HANDLE) _beginthreadex(NULL, 0, ClockThread, NULL, 0, &thread_id);
+	if (hClockThread == NULL)
+	{
+		ClockRun = 0;
+		return UPC2_COMM_ERR;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopClockSync -- stops sampling the cards' clocks (the fits are kept)
+//
+//                           Call it before unloading the DLL with FreeLibrary: DllMain can't
+//                           wait for the clock thread to finish (see UPC2_Detaching).
+//
+DllExport long __stdcall UPC2_PCI_StopClockSync(void)
+{
+	if (hClockThread != NULL)
+	{
+		ClockRun = 0;
+		SetEvent(hClockWake);
+		if (!UPC2_Detaching)
+			WaitForSingleObject(hClockThread, INFINITE);
+		CloseHandle(hClockThread);
+		hClockThread = NULL;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_SampleClock -- samples a card's clock now (as the clock sync thread does)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NO_CONNECTION	if not connected
+//
+DllExport long __stdcall UPC2_PCI_SampleClock(long card_ndx)
+{
+	long  ret_val;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	QueryPerformanceFrequency(&frq);
+	EnterCriticalSection(&UPC2_ClockLock);
+	ret_val = ClockSample(card_ndx);
+	LeaveCriticalSection(&UPC2_ClockLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetClockFit -- gets the fit of a card's clock against the host clock
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pFit        -- pointer to a UPC2_ClockFit_t
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pFit is NULL
+//			  UPC2_NO_CLOCK_FIT		if too few samples (pFit->nSamples is set)
+//
+DllExport long __stdcall UPC2_PCI_GetClockFit(long card_ndx, UPC2_ClockFit_t * pFit)
+{
+	UPC2_Clock_t *  pClock;
+	double          rtt[CLOCK_SAMPLES];
+	long            i, ret_val = UPC2_NORMAL_RETURN;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+	if (pFit == NULL)
+		return UPC2_NULL_PARAM;
+
+	pClock = &UPC2_Card[card_ndx].Clock;
+	memset(pFit, 0, sizeof(UPC2_ClockFit_t));
+	EnterCriticalSection(&UPC2_ClockLock);
+	pFit->nSamples = pClock->nSamples;
+	if (!pClock->valid)
+		ret_val = UPC2_NO_CLOCK_FIT;
+	else
+	{
+		pFit->rate = pClock->rate;
+		pFit->drift_ppm = (pClock->rate / UPC2_TIMESTAMP_RATE - 1) * 1e6;
+		pFit->host_at_zero = ClockHostTime(pClock, 0);
+		pFit->resid_usecs = pClock->resid * 1e6 / UPC2_TIMESTAMP_RATE;
+		for (i = 0; i < pClock->nSamples; i++)
+			rtt[i] = pClock->rtt[i];
+		qsort(rtt, pClock->nSamples, sizeof(double), CompareDouble);
+		pFit->rtt_min_usecs = rtt[0] * 1e6;
+		pFit->rtt_median_usecs = rtt[pClock->nSamples / 2] * 1e6;
+	}
+	LeaveCriticalSection(&UPC2_ClockLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_HostTimeFor -- maps a card timestamp (e.g. a frame's) to host time
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  timestamp   -- card timestamp (usecs x 10) within 6 hours of the latest clock sample
+//  pHostTime   -- pointer to a double for the host time: seconds of QueryPerformanceCounter
+//                 (counts / QueryPerformanceFrequency)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pHostTime is NULL
+//			  UPC2_NO_CLOCK_FIT		if the card's clock hasn't been fitted
+//
+DllExport long __stdcall UPC2_PCI_HostTimeFor(long card_ndx, long timestamp, double * pHostTime)
+{
+	long  ret_val = UPC2_NORMAL_RETURN;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+	if (pHostTime == NULL)
+		return UPC2_NULL_PARAM;
+
+	EnterCriticalSection(&UPC2_ClockLock);
+	if (UPC2_Card[card_ndx].Clock.valid)
+		*pHostTime = ClockHostTime(&UPC2_Card[card_ndx].Clock, timestamp);
+	else
+		ret_val = UPC2_NO_CLOCK_FIT;
+	LeaveCriticalSection(&UPC2_ClockLock);
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Merged stream (see UPC2_PCI_StartMerge)
+//
+// Each card's frames are read a batch at a time into the card's slot and given a key: the
+// timestamp mapped to host time (usecs x 10) if the cards' clocks were fitted when the merge
+// started (see UPC2_PCI_StartClockSync), otherwise the card's timestamp, plus the card's
+// TimeOffset. A binary heap holds the slots that have frames, ordered by the key of the next
+// frame (ties by slot).
+// The earliest frame is only taken when every card has a frame in hand (otherwise a card
+// that ran dry could still produce an earlier one), so a card that runs dry is refilled
+// before the next frame is taken.
+//
+// MergeKey    -- key of the slot's next frame
+// MergeBefore -- TRUE if slot a's next frame goes before slot b's (timestamps compared modulo
+//                2^32 so they may wrap)
+// MergeSift   -- restores the heap from position i down
+// MergeRefill -- reads the next batch of the slot's card
+// FreeMerge   -- frees a merged stream
+//
+Int32 MergeKey(UPC2_Merge_t * pMerge, long s)
+{
+	return pMerge->pKey[s][pMerge->next[s]];
+}
+BOOL MergeBefore(UPC2_Merge_t * pMerge, long a, long b)
+{
+	Int32 d = MergeKey(pMerge, a) - MergeKey(pMerge, b);
+
+	return (d < 0) || (d == 0 && a < b);
+}
+void MergeSift(UPC2_Merge_t * pMerge, long i)
+{
+	long  c, s;
+
+	for (;;)
+	{
+		c = 2 * i + 1;
+		if (c >= pMerge->nHeap)
+			break;
+		if (c + 1 < pMerge->nHeap && MergeBefore(pMerge, pMerge->heap[c + 1], pMerge->heap[c]))
+			c++;
+		if (!MergeBefore(pMerge, pMerge->heap[c], pMerge->heap[i]))
+			break;
+		s = pMerge->heap[i];
+		pMerge->heap[i] = pMerge->heap[c];
+		pMerge->heap[c] = s;
+		i = c;
+	}
+}
+void MergePush(UPC2_Merge_t * pMerge, long s)
+{
+	long  i, p;
+
+	i = pMerge->nHeap++;
+	while (i > 0)
+	{
+		p = (i - 1) / 2;
+		if (!MergeBefore(pMerge, s, pMerge->heap[p]))
+			break;
+		pMerge->heap[i] = pMerge->heap[p];
+		i = p;
+	}
+	pMerge->heap[i] = s;
+}
+long MergeRefill(UPC2_Merge_t * pMerge, long s)
+{
+	UPC2_ConvertedDataFrame_t * pF;
+	long                        card_ndx = pMerge->card[s];
+	long                        k, ret_val;
+
+	ret_val = GetDataRows(card_ndx, UPC2_FROM_START_FRAME, pMerge->nBatch,
+						  pMerge->pBatch[s], EZ_SENSE_FRAME_SIZE);
+	pMerge->next[s] = 0;
+	pMerge->count[s] = (ret_val > 0) ? ret_val : 0;
+
+	if (pMerge->host_time)
+		EnterCriticalSection(&UPC2_ClockLock);
+	for (k = 0; k < pMerge->count[s]; k++)
+	{
+		pF = (UPC2_ConvertedDataFrame_t *)(pMerge->pBatch[s] + k * EZ_SENSE_FRAME_SIZE);
+		if (pMerge->host_time && UPC2_Card[card_ndx].Clock.valid)
+			pMerge->pKey[s][k] = (Int32)(LONGLONG)(ClockHostTime(&UPC2_Card[card_ndx].Clock, pF->timestamp) * UPC2_TIMESTAMP_RATE);
+		else
+			pMerge->pKey[s][k] = pF->timestamp;
+		pMerge->pKey[s][k] += UPC2_Card[card_ndx].TimeOffset;
+	}
+	if (pMerge->host_time)
+		LeaveCriticalSection(&UPC2_ClockLock);
+	return ret_val;
+}
+void FreeMerge(UPC2_Merge_t * pMerge)
+{
+	long i;
+
+	for (i = 0; i < pMerge->nCards; i++)
+	{
+		free(pMerge->pBatch[i]);
+		free(pMerge->pKey[i]);
+	}
+	free(pMerge);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartMerge -- sets up a stream of the frames of several cards merged in time order
+//
+//  The cards must be collecting data. UPC2_PCI_GetMergedData then takes frames from the cards
+//  with UPC2_FROM_START_FRAME reads, so the cards shouldn't be read otherwise. If the cards
+//  are streaming (UPC2_PCI_StartStreaming) the bus reads carry on in the background while the
+//  frames are merged. If every card's clock has been fitted (UPC2_PCI_StartClockSync) the
+//  frames are ordered by host time, otherwise by card timestamp. Either is corrected by each
+//  card's UPC2_PCI_SetTimeOffset.
+//  A started merge is replaced.
+//
+// parameters:
+//
+//  nCards      -- number of cards (0 => every connected card)
+//  pCards      -- pointer to nCards card indexes (not used if nCards is 0)
+//  nBatch      -- frames read from a card at a time (0 => UPC2_MERGE_BATCH)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if nCards or nBatch out of range or a card repeated
+//			  UPC2_NULL_PARAM		if pCards is NULL
+//			  UPC2_INVALID_INDEX	if no UPC card with a specified index
+//			  UPC2_NO_CONNECTION	if a card is not connected (or none connected)
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the batches
+//		   -- number of cards merged if no error
+//
+DllExport long __stdcall UPC2_PCI_StartMerge(long nCards, long * pCards, long nBatch)
+{
+	UPC2_Merge_t *  pMerge;
+	long            i, k, ret_val;
+
+	if (nCards < 0 || nCards > MAX_PCI_CARDS)
+		return UPC2_INVALID_PARAM;
+	if (nBatch == 0)
+		nBatch = UPC2_MERGE_BATCH;
+	if (nBatch < 1 || nBatch > UPC2_MAX_STREAM_FRAMES)
+		return UPC2_INVALID_PARAM;
+	if (nCards > 0 && pCards == NULL)
+		return UPC2_NULL_PARAM;
+
+	if ((pMerge = (UPC2_Merge_t *) calloc(1, sizeof(UPC2_Merge_t))) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+	pMerge->nBatch = nBatch;
+
+	if (nCards == 0)
+	{
+		for (i = 0; i < MAX_PCI_CARDS; i++)
+		{
+			if (IsConnected(i) > 0)
+				pMerge->card[pMerge->nCards++] = i;
+		}
+		ret_val = (pMerge->nCards == 0) ? UPC2_NO_CONNECTION : UPC2_NORMAL_RETURN;
+	}
+	else
+	{
+		ret_val = UPC2_NORMAL_RETURN;
+		for (i = 0; i < nCards && ret_val >= 0; i++)
+		{
+			if ((ret_val = IsConnected(pCards[i])) < 0)
+				break;
+			for (k = 0; k < i; k++)
+			{
+				if (pCards[k] == pCards[i])
+					ret_val = UPC2_INVALID_PARAM;
+			}
+			pMerge->card[pMerge->nCards++] = pCards[i];
+		}
+	}
+
+	// Every slot starts empty (pending)
+	pMerge->host_time = TRUE;
+	for (i = 0; i < pMerge->nCards && ret_val >= 0; i++)
+	{
+		pMerge->pBatch[i] = (U8 *) malloc(nBatch * EZ_SENSE_FRAME_SIZE);
+		pMerge->pKey[i] = (Int32 *) malloc(nBatch * sizeof(Int32));
+		if (pMerge->pBatch[i] == NULL || pMerge->pKey[i] == NULL)
+			ret_val = UPC2_OUT_OF_MEMORY;
+		pMerge->pending[pMerge->nPending++] = i;
+		if (!UPC2_Card[pMerge->card[i]].Clock.valid)
+			pMerge->host_time = FALSE;
+	}
+	if (ret_val < 0)
+	{
+		FreeMerge(pMerge);
+		return ret_val;
+	}
+
+	UPC2_PCI_StopMerge();
+	pMergeStream = pMerge;
+	return pMerge->nCards;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetMergedData -- takes frames from the merged stream in time order
+//
+//  Returns as many frames as can be ordered: it stops early when a card has no unread frames
+//  (the merge is only as far along as the slowest card). Not thread safe -- call from one
+//  thread.
+//
+// parameters:
+//
+//  nFrames     -- maximum number of frames
+//  pFrame      -- pointer to nFrames UPC2_MergedFrame_t
+//
+// Returns -- negative if an error occurs (and no frames were taken)
+//			  UPC2_NULL_PARAM		if pFrame is NULL
+//			  UPC2_NOT_MERGING		if UPC2_PCI_StartMerge hasn't been called
+//			  (or as UPC2_PCI_GetData for a card)
+//		   -- number of frames if no error
+//
+DllExport long __stdcall UPC2_PCI_GetMergedData(long nFrames, UPC2_MergedFrame_t * pFrame)
+{
+	UPC2_Merge_t *              pMerge = pMergeStream;
+	UPC2_ConvertedDataFrame_t * pF;
+	long                        n, s, ret_val;
+
+	if (pMerge == NULL)
+		return UPC2_NOT_MERGING;
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	for (n = 0; n < nFrames; n++)
+	{
+		// Refill the cards that ran dry (every card needs a frame in hand)
+		while (pMerge->nPending > 0)
+		{
+			s = pMerge->pending[pMerge->nPending - 1];
+			if ((ret_val = MergeRefill(pMerge, s)) <= 0)
+				return (ret_val < 0 && n == 0) ? ret_val : n;
+			pMerge->nPending--;
+			MergePush(pMerge, s);
+		}
+
+		// Take the earliest
+		s = pMerge->heap[0];
+		pF = (UPC2_ConvertedDataFrame_t *)(pMerge->pBatch[s] + pMerge->next[s] * EZ_SENSE_FRAME_SIZE);
+		pFrame[n].card_ndx = pMerge->card[s];
+		pFrame[n].timestamp = MergeKey(pMerge, s);
+		memcpy(&pFrame[n].frame_no, pF, EZ_SENSE_FRAME_SIZE);
+
+		if (++pMerge->next[s] == pMerge->count[s])
+		{
+			// Batch used up -- out of the heap until refilled
+			pMerge->heap[0] = pMerge->heap[--pMerge->nHeap];
+			pMerge->pending[pMerge->nPending++] = s;
+		}
+		MergeSift(pMerge, 0);
+	}
+	return n;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_SetTimeOffset -- sets the correction added to a card's timestamps where the
+//                           frames of several cards are put in time order
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  offset      -- usecs x 10 (as the timestamps)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//
+DllExport long __stdcall UPC2_PCI_SetTimeOffset(long card_ndx, long offset)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	UPC2_Card[card_ndx].TimeOffset = offset;
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopMerge -- stops the merged stream (frames not yet taken are lost)
+//
+DllExport long __stdcall UPC2_PCI_StopMerge(void)
+{
+	if (pMergeStream != NULL)
+	{
+		FreeMerge(pMergeStream);
+		pMergeStream = NULL;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// DrainToStream -- moves the unread frames in the DSP ring buffer into the host ring buffer.
+//                  Called repeatedly by the card's acquisition thread (StreamThread).
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+// Returns 		-- negative if an error occurs
+//         		-- number of frames moved to (or dropped from) the host ring buffer
+//
+long DrainToStream(long card_ndx)
+{
+	UPC2_Stream_t * pStream = UPC2_Card[card_ndx].pStream;
+	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
+	long			ret_val;
+	long			nFramesUnread, nFrames, nFree, nDrop;
+	U32				frm_size, slot, newFrameAddr;
+	LONG			rd, wr;
+
+	// Hold the HPI for the whole pass so header, frames and StartFrame stay consistent
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+	// Read the pool header
+	ret_val = ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
+										&FrameHdrImage, sizeof(FrameHdrImage));
+	pStream->stats.polls++;
+	frm_size = FrameHdrImage.FrameSize;   // includes check word
+	if (ret_val < 0 || frm_size == 0)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		return ret_val < 0 ? ret_val : 0;
+	}
+	if (frm_size - 4 > EZ_SENSE_FRAME_SIZE)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		return UPC2_COMM_ERR;
+	}
+	InterlockedExchange(&pStream->frm_size, frm_size);
+	CheckOverrun(card_ndx, &FrameHdrImage);
+
+	// Determine nFramesUnread
+	if (FrameHdrImage.pNew < FrameHdrImage.pStart)
+		nFramesUnread = FrameHdrImage.MaxFrames - ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pNew) / frm_size;
+	else
+		nFramesUnread = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pStart) / frm_size;
+
+	if (nFramesUnread <= 0)
+	{
+		SchedObserve(card_ndx, 0, FrameHdrImage.MaxFrames, 0);
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		return 0;
+	}
+
+	// Apply the backpressure policy if the host ring buffer can't take all of the frames
+	wr = pStream->wr_seq;
+	nFree = pStream->nSlots - (U32)(wr - pStream->rd_seq);
+	nFrames = nFramesUnread;
+	if (nFrames > nFree)
+	{
+		if (pStream->policy == UPC2_STREAM_DROP_OLDEST)
+		{
+			if (nFrames > (long)pStream->nSlots)
+				nFrames = pStream->nSlots;
+
+			// Advance the consumer past the oldest frames (the consumer may be advancing too)
+			do
+			{
+				rd = pStream->rd_seq;
+				nDrop = nFrames - (pStream->nSlots - (U32)(wr - rd));
+				if (nDrop <= 0)
+					break;
+			}
+			while (InterlockedCompareExchange(&pStream->rd_seq, rd + nDrop, rd) != rd);
+
+			if (nDrop > 0)
+				pStream->stats.frames_dropped += nDrop;
+		}
+		else if (pStream->policy == UPC2_STREAM_DROP_NEWEST && nFree == 0)
+		{
+			// Skip the unread frames by advancing the StartFrame pointer past them
+			newFrameAddr = (U32)FrameHdrImage.pStart + frm_size * nFramesUnread;
+			if (newFrameAddr > (U32)FrameHdrImage.pLast)
+				newFrameAddr -= frm_size * FrameHdrImage.MaxFrames;
+			WriteToLocalAddressSpace(card_ndx, &newFrameAddr,
+									 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
+			SchedObserve(card_ndx, nFramesUnread, FrameHdrImage.MaxFrames, nFramesUnread);
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+			pStream->stats.frames_dropped += nFramesUnread;
+			return nFramesUnread;
+		}
+		else
+			nFrames = nFree;
+	}
+
+	if (nFrames <= 0)
+	{
+		// UPC2_STREAM_BLOCK -- leave the frames in the DSP ring buffer
+		SchedObserve(card_ndx, nFramesUnread, FrameHdrImage.MaxFrames, 0);
+		LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+		return 0;
+	}
+
+	// Read no further than the end of the host ring buffer (the rest goes next pass)
+	slot = (U32)wr & (pStream->nSlots - 1);
+	if (nFrames > (long)(pStream->nSlots - slot))
+		nFrames = pStream->nSlots - slot;
+
+	ret_val = ReadFromStartFrame(card_ndx, &FrameHdrImage, nFrames,
+								 pStream->pRing + slot * EZ_SENSE_FRAME_SIZE, EZ_SENSE_FRAME_SIZE);
+	SchedObserve(card_ndx, nFramesUnread, FrameHdrImage.MaxFrames, (ret_val > 0) ? ret_val : 0);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	if (ret_val <= 0)
+		return ret_val;
+
+	// Publish the frames to the consumer (and the other processes)
+	InterlockedExchange(&pStream->wr_seq, wr + ret_val);
+	SetEvent(UPC2_Card[card_ndx].FrameEvent);
+	if (pBus != NULL)
+		BusPublish(card_ndx, pStream->pRing + slot * EZ_SENSE_FRAME_SIZE, ret_val, frm_size - 4);
+	pStream->stats.frames_drained += ret_val;
+	if ((long)(U32)(wr + ret_val - pStream->rd_seq) > pStream->stats.high_water)
+		pStream->stats.high_water = (U32)(wr + ret_val - pStream->rd_seq);
+
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// StreamThread -- acquisition thread (one per streaming card)
+//
+//                 Each pass waits the interval the poll scheduler chose (see SchedObserve)
+//
+unsigned __stdcall StreamThread(void * pArg)
+{
+	long            card_ndx = (long) pArg;
+	UPC2_Stream_t * pStream = UPC2_Card[card_ndx].pStream;
+	long            ret_val, wait;
+
+	while (pStream->run)
+	{
+		ret_val = DrainToStream(card_ndx);
+		wait = UPC2_Card[card_ndx].Sched.stats.interval_us / 1000;
+		if (ret_val < 0)
+		{
+			pStream->stats.errors++;
+			Sleep(10);
+		}
+		else if (wait > 0)
+			Sleep(wait);
+		else if (ret_val == 0)
+			Sleep(1);
+	}
+	return 0;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// GetStreamData -- takes frames from the host ring buffer (UPC2_PCI_GetData while streaming,
+//                  caller holds StreamLock)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nFrames     -- long specifying the maximum number of frames to read
+//  pFrame      -- pointer to a destination buffer for the converted data frame(s)
+//  frm_incr    -- spacing (in bytes) of the frames in the destination buffer
+//                 (0 => frame size less check word)
+//
+// Returns 		-- number of frames read
+//
+long GetStreamData(long card_ndx, long nFrames, void * pFrame, U32 frm_incr)
+{
+	UPC2_Stream_t * pStream = UPC2_Card[card_ndx].pStream;
+	U32             mask = pStream->nSlots - 1;
+	U32             frm_size, slot, n1;
+	U8 *            pDest;
+	LONG            rd, wr;
+	long            k, n;
+
+	frm_size = pStream->frm_size;
+	if (frm_size == 0 || nFrames <= 0)
+		return 0;
+
+	if (frm_incr == 0)
+		frm_incr = frm_size - 4;
+	else if (frm_incr < frm_size - 4)
+		return UPC2_INVALID_PARAM;
+
+	// Copy, then claim the frames. If the acquisition thread dropped any of them
+	// while they were being copied (UPC2_STREAM_DROP_OLDEST) copy them again.
+	do
+	{
+		rd = pStream->rd_seq;
+		wr = pStream->wr_seq;
+		n = (long)(U32)(wr - rd);
+		if (n > nFrames)
+			n = nFrames;
+		if (n <= 0)
+			return 0;
+
+		slot = (U32)rd & mask;
+		if (frm_incr == EZ_SENSE_FRAME_SIZE)
+		{
+			// Same spacing as the host ring buffer -- copy in (at most) two pieces
+			n1 = pStream->nSlots - slot;
+			if (n1 > (U32)n)
+				n1 = n;
+			memcpy(pFrame, pStream->pRing + slot * EZ_SENSE_FRAME_SIZE, n1 * EZ_SENSE_FRAME_SIZE);
+			memcpy((U8 *)pFrame + n1 * EZ_SENSE_FRAME_SIZE, pStream->pRing, (n - n1) * EZ_SENSE_FRAME_SIZE);
+		}
+		else
+		{
+			pDest = (U8 *) pFrame;
+			for (k = 0; k < n; k++)
+			{
+				memcpy(pDest, pStream->pRing + ((slot + k) & mask) * EZ_SENSE_FRAME_SIZE, frm_size - 4);
+				pDest += frm_incr;
+			}
+		}
+	}
+	while (InterlockedCompareExchange(&pStream->rd_seq, rd + n, rd) != rd);
+
+	InterlockedExchangeAdd((LONG volatile *)&pStream->stats.frames_delivered, n);
+	CheckFrameNo(card_ndx, pFrame, n, frm_incr);
+	return n;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartStreaming -- starts a thread that continuously moves the card's converted data
+//                            frames from the DSP ring buffer into a host ring buffer.
+//
+//                            While streaming, UPC2_PCI_GetData (UPC2_FROM_START_FRAME and
+//                            UPC2_NO_GAPS) copies frames from the host ring buffer instead of
+//                            reading the DSP and UPC2_PCI_GetUnreadFrameCount returns the number
+//                            of frames in the host ring buffer.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+//  nRingFrames -- long specifying the capacity of the host ring buffer in frames
+//                 (rounded up to a power of two)
+//
+//  policy      -- UPC2_STREAM_DROP_OLDEST, UPC2_STREAM_DROP_NEWEST or UPC2_STREAM_BLOCK
+//                 (what to do with new frames when the host ring buffer is full)
+//
+// Returns 		-- negative if an error occurs. 
+//			         UPC2_INVALID_INDEX   		if no UPC card with the specified index
+//			         UPC2_NO_CONNECTION	   	    if not connected
+//			         UPC2_STREAMING_ACTIVE   	if already streaming
+//			         UPC2_INVALID_PARAM   	    if nRingFrames or policy is invalid
+//			         UPC2_OUT_OF_MEMORY   	    if unable to allocate the ring buffer or thread
+//
+DllExport long __stdcall UPC2_PCI_StartStreaming(long card_ndx, long nRingFrames, long policy)
+{
+	long            ret_val;
+	U32             nSlots;
+	unsigned        thread_id;
+	UPC2_Stream_t * pStream;
+
+	if ((ret_val = IsConnected(card_ndx)) < 0)
+		return ret_val;
+
+	if (nRingFrames <= 0 || nRingFrames > UPC2_MAX_STREAM_FRAMES)
+		return UPC2_INVALID_PARAM;
+
+	if (policy != UPC2_STREAM_DROP_OLDEST && policy != UPC2_STREAM_DROP_NEWEST && policy != UPC2_STREAM_BLOCK)
+		return UPC2_INVALID_PARAM;
+
+	// Round up to a power of two so that the sequence numbers wrap cleanly
+	for (nSlots = 1; nSlots < (U32)nRingFrames; nSlots <<= 1)
+		;
+
+	// Held until the stream is in place so two callers can't both start one (and a cursor
+	// can't be opened meanwhile, see UPC2_PCI_OpenCursor)
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	if (UPC2_Card[card_ndx].pStream != NULL)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return UPC2_STREAMING_ACTIVE;
+	}
+
+	if (UPC2_Card[card_ndx].nCursors > 0)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return UPC2_CURSORS_OPEN;
+	}
+
+	ret_val = UPC2_OUT_OF_MEMORY;
+	pStream = (UPC2_Stream_t *) calloc(1, sizeof(UPC2_Stream_t));
+	if (pStream != NULL)
+	{
+		pStream->pRing = (U8 *) malloc(nSlots * EZ_SENSE_FRAME_SIZE);
+		if (pStream->pRing == NULL)
+			free(pStream);
+		else
+		{
+			pStream->nSlots = nSlots;
+			pStream->policy = policy;
+			pStream->run = 1;
+			pStream->stats.nSlots = nSlots;
+
+			UPC2_Card[card_ndx].pStream = pStream;
+			pStream->hThread = (HANDLE) _beginthreadex(NULL, 0, StreamThread, (void *) card_ndx, 0, &thread_id);
+			if (pStream->hThread == 0)
+			{
+				UPC2_Card[card_ndx].pStream = NULL;
+				free(pStream->pRing);
+				free(pStream);
+			}
+			else
+			{
+				// Keep the drainer ahead of the consumers
+				SetThreadPriority(pStream->hThread, THREAD_PRIORITY_ABOVE_NORMAL);
+				InterlockedIncrement(&UPC2_Card[card_ndx].FrameNotify);
+				ret_val = UPC2_NORMAL_RETURN;
+			}
+		}
+	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+
+	return ret_val;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopStreaming -- stops the acquisition thread and frees the host ring buffer.
+//                           Frames still in the host ring buffer are discarded.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+//  The thread is given 5 s to finish (none while the DLL detaches). If it hasn't, the ring is
+//  kept and the card stays streaming -- call again before disconnecting. Readers of the
+//  stream wait for this call.
+//
+// Returns 		-- negative if an error occurs. 
+//			         UPC2_STREAMING_NOT_ACTIVE   	if not streaming
+//			         UPC2_STREAMING_ACTIVE   		if the thread hasn't finished yet
+//
+DllExport long __stdcall UPC2_PCI_StopStreaming(long card_ndx)
+{
+	UPC2_Stream_t * pStream;
+	HANDLE          hThread;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	// The acquisition thread never takes the lock, so it can be waited for with it held
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	if ((pStream = UPC2_Card[card_ndx].pStream) == NULL)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return UPC2_STREAMING_NOT_ACTIVE;
+	}
+
+	hThread = pStream->hThread;
+	if (pStream->run)
+	{
+		pStream->run = 0;
+		InterlockedDecrement(&UPC2_Card[card_ndx].FrameNotify);
+	}
+
+	// The thread can't finish while the loader lock is held (DLL being unloaded) so don't
+	// wait then. The ring is only freed once the thread has finished with it.
+	if (WaitForSingleObject(hThread, UPC2_Detaching ? 0 : 5000) != WAIT_OBJECT_0)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return UPC2_STREAMING_ACTIVE;
+	}
+
+	UPC2_Card[card_ndx].pStream = NULL;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+
+	free(pStream->pRing);
+	free(pStream);
+	CloseHandle(hThread);
+
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetStreamStats -- gets the streaming occupancy counters
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//
+//  pStats      -- pointer to a UPC2_StreamStats_t struct
+//
+// Returns 		-- negative if an error occurs. 
+//			         UPC2_NULL_PARAM   			if pStats is NULL
+//			         UPC2_STREAMING_NOT_ACTIVE   	if not streaming
+//
+DllExport long __stdcall UPC2_PCI_GetStreamStats(long card_ndx, UPC2_StreamStats_t * pStats)
+{
+	UPC2_Stream_t * pStream;
+
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (pStats == NULL)
+		return UPC2_NULL_PARAM;
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	if ((pStream = UPC2_Card[card_ndx].pStream) == NULL)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+		return UPC2_STREAMING_NOT_ACTIVE;
+	}
+
+	memcpy(pStats, &pStream->stats, sizeof(UPC2_StreamStats_t));
+	pStats->occupancy = (U32)(pStream->wr_seq - pStream->rd_seq);
+	LeaveCriticalSection(&UPC2_Card[card_ndx].StreamLock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Shared-memory frame bus (see UPC2_PCI_StartBus)
+//
+// Each process that opens a card competes for its StartFrame pointer, and each one polls the
+// card over the PCI bus. With the frame bus one process streams the cards (UPC2_PCI_StartStreaming)
+// and publishes every frame drained into a named file mapping. Other processes map it read only
+// and each reads at its own cursors, so the load on the card doesn't grow with the readers.
+//
+// BusPublish -- copies frames drained from a card to the bus (from the acquisition thread)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pSrc        -- frames at EZ_SENSE_FRAME_SIZE spacing
+//  nFrames     -- number of frames
+//  frm_size    -- frame size less check word
+//
+void BusPublish(long card_ndx, const U8 * pSrc, long nFrames, U32 frm_size)
+{
+	UPC2_BusHdr_t *   pHdr;
+	UPC2_BusCard_t *  pCard;
+	UPC2_BusSlot_t *  pSlot;
+	LONG              seq;
+	long              k;
+
+	// Only pin the mapping under the lock -- each card's thread writes its own ring, so the
+	// copies of several cards go on side by side (UPC2_PCI_StopBus waits for the pins)
+	EnterCriticalSection(&UPC2_BusLock);
+	if ((pHdr = pBus) != NULL)
+		InterlockedIncrement(&BusPins);
+	LeaveCriticalSection(&UPC2_BusLock);
+	if (pHdr == NULL)
+		return;
+
+	pCard = &pHdr->card[card_ndx];
+	pCard->frm_size = frm_size;
+	seq = pCard->wr_seq;
+	for (k = 0; k < nFrames; k++, seq++, pSrc += EZ_SENSE_FRAME_SIZE)
+	{
+		pSlot = (UPC2_BusSlot_t *)(pHdr + 1) + card_ndx * pHdr->nSlots + ((U32)seq & (pHdr->nSlots - 1));
+		InterlockedExchange(&pSlot->stamp, 2 * seq + 1);
+		memcpy(pSlot->frame, pSrc, frm_size);
+		InterlockedExchange(&pSlot->stamp, 2 * seq + 2);
+	}
+	InterlockedExchange(&pCard->wr_seq, seq);
+	InterlockedDecrement(&BusPins);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartBus -- publishes the frames of the streaming cards in a named file mapping
+//
+//  Every frame the acquisition thread of a card drains (see UPC2_PCI_StartStreaming) is also
+//  copied to the card's ring on the bus. If the mapping is still open in other processes (a
+//  publisher restarting) and has the same number of slots it is taken over, and the readers
+//  carry on.
+//
+// parameters:
+//
+//  pName       -- name of the file mapping (NULL => UPC2_BUS_NAME). For readers in other sessions
+//                 (a service publishing) use the "Global\" prefix.
+//  nSlots      -- frames per card (rounded up to a power of two, up to UPC2_MAX_BUS_FRAMES)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if nSlots is out of range
+//			  UPC2_BUS_EXISTS		if already publishing or the mapping exists with other slots
+//			  UPC2_OUT_OF_MEMORY	if unable to create or map the file mapping
+//
+DllExport long __stdcall UPC2_PCI_StartBus(char * pName, long nSlots)
+{
+	HANDLE            hMap;
+	UPC2_BusHdr_t *   pHdr;
+	U32               n, size;
+	BOOL              exists;
+
+	if (nSlots <= 0 || nSlots > UPC2_MAX_BUS_FRAMES)
+		return UPC2_INVALID_PARAM;
+	if (pBus != NULL)
+		return UPC2_BUS_EXISTS;
+
+	for (n = 1; n < (U32)nSlots; n <<= 1)
+		;
+	size = sizeof(UPC2_BusHdr_t) + MAX_PCI_CARDS * n * sizeof(UPC2_BusSlot_t);
+
+	hMap = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size,
+							 (pName != NULL) ? pName : UPC2_BUS_NAME);
+	if (hMap == NULL)
+		return UPC2_OUT_OF_MEMORY;
+	exists = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+	pHdr = (UPC2_BusHdr_t *) MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, 0);
+	if (pHdr == NULL)
+	{
+		CloseHandle(hMap);
+		return UPC2_OUT_OF_MEMORY;
+	}
+	if (exists && (pHdr->magic != BUS_MAGIC || pHdr->nSlots != n))
+	{
+		UnmapViewOfFile(pHdr);
+		CloseHandle(hMap);
+		return UPC2_BUS_EXISTS;
+	}
+	if (!exists)
+	{
+		// New mapping (zero filled) -- no frames yet
+		pHdr->nSlots = n;
+		InterlockedExchange((LONG volatile *)&pHdr->magic, BUS_MAGIC);
+	}
+
+	EnterCriticalSection(&UPC2_BusLock);
+	if (pBus != NULL)
+	{
+		// Another caller got in first
+		LeaveCriticalSection(&UPC2_BusLock);
+		UnmapViewOfFile(pHdr);
+		CloseHandle(hMap);
+		return UPC2_BUS_EXISTS;
+	}
+	hBusMap = hMap;
+	pBus = pHdr;
+	LeaveCriticalSection(&UPC2_BusLock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopBus -- stops publishing (the mapping lasts while readers have it open)
+//
+//  Waits for the BusPublish calls still copying to the mapping before it is unmapped (not when
+//  the DLL is detaching, see UPC2_Detaching).
+//
+DllExport long __stdcall UPC2_PCI_StopBus(void)
+{
+	UPC2_BusHdr_t *   pHdr;
+	HANDLE            hMap;
+
+	EnterCriticalSection(&UPC2_BusLock);
+	pHdr = pBus;
+	hMap = hBusMap;
+	pBus = NULL;
+	hBusMap = NULL;
+	LeaveCriticalSection(&UPC2_BusLock);
+
+	if (pHdr != NULL)
+	{
+		while (BusPins != 0 && !UPC2_Detaching)
+			Sleep(1);
+		UnmapViewOfFile(pHdr);
+		CloseHandle(hMap);
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_OpenBus -- maps a frame bus published by UPC2_PCI_StartBus (in any process)
+//
+// parameters:
+//
+//  pName       -- name of the file mapping (NULL => UPC2_BUS_NAME)
+//  from        -- UPC2_CURSOR_FROM_START  => the cursors start at the oldest frame on the bus
+//                 UPC2_CURSOR_FROM_NEWEST => the cursors start after the newest frame
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if from is invalid
+//			  UPC2_NO_BUS			if no bus is published with the name
+//			  UPC2_OUT_OF_MEMORY	if UPC2_MAX_BUS_SUBS buses are open
+//		   -- bus handle (0 to UPC2_MAX_BUS_SUBS - 1) for UPC2_PCI_ReadBus
+//
+DllExport long __stdcall UPC2_PCI_OpenBus(char * pName, long from)
+{
+	HANDLE                hMap;
+	const UPC2_BusHdr_t * pHdr;
+	LONG                  wr;
+	long                  bus, c;
+
+	if (from != UPC2_CURSOR_FROM_START && from != UPC2_CURSOR_FROM_NEWEST)
+		return UPC2_INVALID_PARAM;
+
+	hMap = OpenFileMapping(FILE_MAP_READ, FALSE, (pName != NULL) ? pName : UPC2_BUS_NAME);
+	if (hMap == NULL)
+		return UPC2_NO_BUS;
+	pHdr = (const UPC2_BusHdr_t *) MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	if (pHdr == NULL || pHdr->magic != BUS_MAGIC)
+	{
+		if (pHdr != NULL)
+			UnmapViewOfFile((void *) pHdr);
+		CloseHandle(hMap);
+		return UPC2_NO_BUS;
+	}
+
+	EnterCriticalSection(&UPC2_BusLock);
+	for (bus = 0; bus < UPC2_MAX_BUS_SUBS; bus++)
+		if (BusSub[bus].hMap == NULL)
+			break;
+	if (bus == UPC2_MAX_BUS_SUBS)
+	{
+		LeaveCriticalSection(&UPC2_BusLock);
+		UnmapViewOfFile((void *) pHdr);
+		CloseHandle(hMap);
+		return UPC2_OUT_OF_MEMORY;
+	}
+	BusSub[bus].hMap = hMap;
+	BusSub[bus].pHdr = pHdr;
+	for (c = 0; c < MAX_PCI_CARDS; c++)
+	{
+		wr = pHdr->card[c].wr_seq;
+		if (from == UPC2_CURSOR_FROM_NEWEST)
+			BusSub[bus].rd_seq[c] = wr;
+		else
+			BusSub[bus].rd_seq[c] = ((U32)wr > pHdr->nSlots) ? wr - (LONG)pHdr->nSlots : 0;
+	}
+	LeaveCriticalSection(&UPC2_BusLock);
+	return bus;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ReadBus -- reads a card's frames from a frame bus at the subscriber's cursor
+//
+//  The frames are those the publisher drained, in order. If the publisher laps the cursor
+//  (the reader is more than the bus's slots behind) the frames overwritten are skipped and
+//  counted. A frame overwritten while it is copied (its stamp changes) is skipped as well.
+//
+// parameters:
+//
+//  bus         -- from UPC2_PCI_OpenBus
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index (in the publishing process)
+//  nFrames     -- maximum number of frames to read
+//  pFrame      -- pointer to a destination buffer for the converted data frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//  pLost       -- pointer to a count the frames skipped are added to (or NULL)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if card_ndx is out of range
+//			  UPC2_NO_BUS			if the bus isn't open
+//			  UPC2_NULL_PARAM		if pFrame is NULL
+//			  UPC2_INVALID_PARAM	if frm_incr is too small
+//		   -- number of frames read (0 if the card isn't publishing)
+//
+DllExport long __stdcall UPC2_PCI_ReadBus(long bus, long card_ndx, long nFrames, void * pFrame, long frm_incr,
+										  long * pLost)
+{
+	const UPC2_BusHdr_t *   pHdr;
+	const UPC2_BusSlot_t *  pSlot;
+	U8 *                    pDest = (U8 *) pFrame;
+	LONG                    rd, wr, stamp;
+	U32                     frm_size, nSlots;
+	long                    n, k, lost = 0;
+
+	if (bus < 0 || bus >= UPC2_MAX_BUS_SUBS || (pHdr = BusSub[bus].pHdr) == NULL)
+		return UPC2_NO_BUS;
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+	if (pFrame == NULL)
+		return UPC2_NULL_PARAM;
+
+	frm_size = pHdr->card[card_ndx].frm_size;
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+	if (frm_size == 0)
+		return 0;
+	if ((U32)frm_incr < frm_size)
+		return UPC2_INVALID_PARAM;
+
+	nSlots = pHdr->nSlots;
+	rd = BusSub[bus].rd_seq[card_ndx];
+	wr = pHdr->card[card_ndx].wr_seq;
+	if ((U32)(wr - rd) > nSlots)
+	{
+		// Lapped -- carry on from the oldest frame on the bus
+		lost += (U32)(wr - rd) - nSlots;
+		rd = wr - nSlots;
+	}
+	n = (U32)(wr - rd);
+	if (n > nFrames)
+		n = nFrames;
+
+	// The stamp is read before and after the copy, fenced so neither read moves across it.
+	// A frame overwritten meanwhile is dropped.
+	for (k = 0; k < n; k++, rd++)
+	{
+		pSlot = (const UPC2_BusSlot_t *)(pHdr + 1) + card_ndx * nSlots + ((U32)rd & (nSlots - 1));
+		stamp = pSlot->stamp;
+		if (stamp == 2 * rd + 2)
+		{
+			MemoryBarrier();
+			memcpy(pDest, pSlot->frame, frm_size);
+			MemoryBarrier();
+			if (pSlot->stamp == stamp)
+			{
+				pDest += frm_incr;
+				continue;
+			}
+		}
+		lost++;
+	}
+	BusSub[bus].rd_seq[card_ndx] = rd;
+
+	if (pLost != NULL)
+		*pLost += lost;
+	return (pDest - (U8 *) pFrame) / frm_incr;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_CloseBus -- unmaps a frame bus opened by UPC2_PCI_OpenBus
+//
+DllExport long __stdcall UPC2_PCI_CloseBus(long bus)
+{
+	if (bus < 0 || bus >= UPC2_MAX_BUS_SUBS)
+		return UPC2_NO_BUS;
+
+	EnterCriticalSection(&UPC2_BusLock);
+	if (BusSub[bus].hMap != NULL)
+	{
+		UnmapViewOfFile((void *) BusSub[bus].pHdr);
+		CloseHandle(BusSub[bus].hMap);
+		BusSub[bus].hMap = NULL;
+		BusSub[bus].pHdr = NULL;
+	}
+	LeaveCriticalSection(&UPC2_BusLock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Streaming server (see UPC2_PCI_StartServer)
+//
+// The server thread reads each card's frames once, in batches (UPC2_PCI_GetBatch), and queues
+// a reference to each batch to every client subscribed to the card. Each client has its own
+// thread that codes and sends its queue, so a slow client only fills its own queue: batches that
+// don't fit are dropped for that client (and counted in its next message), and acquisition
+// carries on. A client is at most SERVER_QUEUE batches behind.
+//
+// RecvAll, SendAll -- receive or send n bytes (negative if the connection fails)
+//
+long RecvAll(SOCKET sock, void * buf, long n)
+{
+	char *  p = (char *) buf;
+	long    r;
+
+	while (n > 0)
+	{
+		if ((r = recv(sock, p, n, 0)) <= 0)
+			return UPC2_SOCKET_ERR;
+		p += r;
+		n -= r;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+
+long SendAll(SOCKET sock, const void * buf, long n)
+{
+	const char *  p = (const char *) buf;
+	long          r;
+
+	while (n > 0)
+	{
+		if ((r = send(sock, p, n, 0)) <= 0)
+			return UPC2_SOCKET_ERR;
+		p += r;
+		n -= r;
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ServerEncode -- puts a batch in a client's message buffer
+//
+//  With UPC2_SERVER_DELTA each word of the frame (frame_no, timestamp, then each item as its
+//  float bits) is coded down the batch as the difference from the frame before, zigzag mapped
+//  and sent 7 bits a byte. frame_no and timestamp take a byte or two and slowly changing items
+//  lose their repeated high bits. Each message decodes on its own.
+//
+// Returns -- bytes in the message
+//
+long ServerEncode(UPC2_SrvClient_t * pClient, const UPC2_Batch_t * pBatch, long dropped)
+{
+	UPC2_SrvMsg_t * pHdr = (UPC2_SrvMsg_t *) pClient->pMsg;
+	U8 *            p = pClient->pMsg + sizeof(UPC2_SrvMsg_t);
+	const U8 *      pF = (const U8 *) pBatch->pFrame;
+	long            w, k, nWords = pBatch->frm_incr / 4;
+	U32             v, d, prev;
+
+	if (pClient->options & UPC2_SERVER_DELTA)
+	{
+		for (w = 0; w < nWords; w++)
+		{
+			prev = 0;
+			for (k = 0; k < pBatch->nFrames; k++)
+			{
+				v = *(const U32 *)(pF + k * pBatch->frm_incr + 4 * w);
+				d = v - prev;
+				prev = v;
+				d = (d << 1) ^ (U32)((Int32)d >> 31);
+				while (d >= 0x80)
+				{
+					*p++ = (U8)(d | 0x80);
+					d >>= 7;
+				}
+				*p++ = (U8)d;
+			}
+		}
+	}
+	else
+	{
+		memcpy(p, pF, pBatch->nFrames * pBatch->frm_incr);
+		p += pBatch->nFrames * pBatch->frm_incr;
+	}
+
+	pHdr->magic = SERVER_MAGIC;
+	pHdr->card_ndx = pBatch->card_ndx;
+	pHdr->nFrames = pBatch->nFrames;
+	pHdr->frm_size = pBatch->frm_incr;
+	pHdr->options = pClient->options & UPC2_SERVER_DELTA;
+	pHdr->dropped = dropped;
+	pHdr->bytes = p - (pClient->pMsg + sizeof(UPC2_SrvMsg_t));
+	return p - pClient->pMsg;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ClientThread -- takes the client's hello, then codes and sends its queue (one per client)
+//
+unsigned __stdcall ClientThread(void * pArg)
+{
+	UPC2_SrvClient_t *  pClient = (UPC2_SrvClient_t *) pArg;
+	UPC2_Server_t *     pSrv = pClient->pSrv;
+	UPC2_Batch_t *      pBatch;
+	U32                 hello[3];
+	LONG                mask;
+	long                len, dropped, timeout = SERVER_TIMEOUT;
+
+	// Hello -- magic, cards, options. Reply with the frames per message.
+	setsockopt(pClient->sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
+	if (RecvAll(pClient->sock, hello, sizeof(hello)) < 0 || hello[0] != SERVER_MAGIC)
+		pClient->run = 0;
+	else
+	{
+		mask = (LONG) hello[1];
+		pClient->options = hello[2];
+		hello[1] = pSrv->nBatch;
+		if (SendAll(pClient->sock, hello, 2 * sizeof(U32)) < 0)
+			pClient->run = 0;
+		else
+			InterlockedExchange(&pClient->mask, mask);
+	}
+
+	while (pClient->run)
+	{
+		WaitForSingleObject(pClient->hReady, 100);
+		for (;;)
+		{
+			EnterCriticalSection(&pClient->Lock);
+			if (pClient->count == 0)
+			{
+				LeaveCriticalSection(&pClient->Lock);
+				break;
+			}
+			pBatch = pClient->queue[pClient->head];
+			pClient->head = (pClient->head + 1) % SERVER_QUEUE;
+			pClient->count--;
+			dropped = pClient->dropped;
+			pClient->dropped = 0;
+			LeaveCriticalSection(&pClient->Lock);
+
+			len = ServerEncode(pClient, pBatch, dropped);
+			UPC2_PCI_ReleaseBatch(pBatch);
+			if (SendAll(pClient->sock, pClient->pMsg, len) < 0)
+			{
+				pClient->run = 0;
+				break;
+			}
+			EnterCriticalSection(&pSrv->Lock);
+			pSrv->stats.messages_sent++;
+			pSrv->stats.bytes_sent += len;
+			LeaveCriticalSection(&pSrv->Lock);
+		}
+	}
+
+	// No more batches queued -- release those left
+	EnterCriticalSection(&pClient->Lock);
+	pClient->mask = 0;
+	while (pClient->count > 0)
+	{
+		UPC2_PCI_ReleaseBatch(pClient->queue[pClient->head]);
+		pClient->head = (pClient->head + 1) % SERVER_QUEUE;
+		pClient->count--;
+	}
+	LeaveCriticalSection(&pClient->Lock);
+	return 0;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ServerFanOut -- queues a batch to every client subscribed to its card (caller holds the
+//                 server's Lock)
+//
+void ServerFanOut(UPC2_Server_t * pSrv, UPC2_Batch_t * pBatch)
+{
+	UPC2_SrvClient_t *  pClient;
+	long                c;
+
+	for (c = 0; c < UPC2_MAX_CLIENTS; c++)
+	{
+		if ((pClient = pSrv->pClient[c]) == NULL || (pClient->mask & (1 << pBatch->card_ndx)) == 0)
+			continue;
+
+		// The client thread clears the mask under the lock as it finishes
+		EnterCriticalSection(&pClient->Lock);
+		if (pClient->mask & (1 << pBatch->card_ndx))
+		{
+			if (pClient->count < SERVER_QUEUE)
+			{
+				UPC2_PCI_HoldBatch(pBatch);
+				pClient->queue[(pClient->head + pClient->count) % SERVER_QUEUE] = pBatch;
+				pClient->count++;
+				pSrv->stats.frames_queued += pBatch->nFrames;
+				SetEvent(pClient->hReady);
+			}
+			else
+			{
+				pClient->dropped += pBatch->nFrames;
+				pSrv->stats.frames_dropped += pBatch->nFrames;
+			}
+		}
+		LeaveCriticalSection(&pClient->Lock);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ServerAccept -- frees the clients that have gone and takes a waiting connection
+//
+//  The client's buffers are allocated here, none as frames are served.
+//
+void ServerAccept(UPC2_Server_t * pSrv)
+{
+	UPC2_SrvClient_t *  pClient;
+	fd_set              fds;
+	struct timeval      tv = {0, 0};
+	SOCKET              sock;
+	unsigned            thread_id;
+	long                c, nodelay = 1;
+
+	for (c = 0; c < UPC2_MAX_CLIENTS; c++)
+	{
+		pClient = pSrv->pClient[c];
+		if (pClient != NULL && !pClient->run && WaitForSingleObject(pClient->hThread, 0) == WAIT_OBJECT_0)
+		{
+			EnterCriticalSection(&pSrv->Lock);
+			pSrv->pClient[c] = NULL;
+			pSrv->stats.nClients--;
+			LeaveCriticalSection(&pSrv->Lock);
+			CloseHandle(pClient->hThread);
+			closesocket(pClient->sock);
+			CloseHandle(pClient->hReady);
+			DeleteCriticalSection(&pClient->Lock);
+			free(pClient->pMsg);
+			free(pClient);
+		}
+	}
+
+	FD_ZERO(&fds);
+	FD_SET(pSrv->listen, &fds);
+	if (select(0, &fds, NULL, NULL, &tv) <= 0 || (sock = accept(pSrv->listen, NULL, NULL)) == INVALID_SOCKET)
+		return;
+
+	for (c = 0; c < UPC2_MAX_CLIENTS; c++)
+		if (pSrv->pClient[c] == NULL)
+			break;
+	pClient = (c < UPC2_MAX_CLIENTS) ? (UPC2_SrvClient_t *) calloc(1, sizeof(UPC2_SrvClient_t)) : NULL;
+	if (pClient != NULL)
+	{
+		// Largest message -- every word coded in 5 bytes
+		pClient->pMsg = (U8 *) malloc(sizeof(UPC2_SrvMsg_t) + pSrv->nBatch * (EZ_SENSE_FRAME_SIZE / 4) * 5);
+		pClient->hReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	if (pClient == NULL || pClient->pMsg == NULL || pClient->hReady == NULL)
+	{
+		if (pClient != NULL)
+		{
+			if (pClient->hReady != NULL)
+				CloseHandle(pClient->hReady);
+			free(pClient->pMsg);
+			free(pClient);
+		}
+		closesocket(sock);
+		return;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay, sizeof(nodelay));
+	pClient->sock = sock;
+	pClient->pSrv = pSrv;
+	pClient->run = 1;
+	InitializeCriticalSection(&pClient->Lock);
+
+	pClient->hThread = (HANDLE) _beginthreadex(NULL, 0, ClientThread, pClient, 0, &thread_id);
+	if (pClient->hThread == 0)
+	{
+		DeleteCriticalSection(&pClient->Lock);
+		CloseHandle(pClient->hReady);
+		free(pClient->pMsg);
+		free(pClient);
+		closesocket(sock);
+		return;
+	}
+	EnterCriticalSection(&pSrv->Lock);
+	pSrv->pClient[c] = pClient;
+	pSrv->stats.nClients++;
+	LeaveCriticalSection(&pSrv->Lock);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ServerThread -- reads the cards subscribed to and fans the batches out
+//
+//  Cards collecting data get a batch pool the first time a client subscribes to them. The
+//  thread reads again at once while any card gives a full batch, otherwise it waits the
+//  shortest interval the poll scheduler chose for the cards read (see SchedObserve).
+//
+unsigned __stdcall ServerThread(void * pArg)
+{
+	UPC2_Server_t *     pSrv = (UPC2_Server_t *) pArg;
+	UPC2_Batch_t *      pBatch;
+	LONG                mask;
+	long                c, card_ndx, n, wait;
+	BOOL                full;
+
+	while (pSrv->run)
+	{
+		ServerAccept(pSrv);
+
+		// Cards subscribed to
+		mask = 0;
+		for (c = 0; c < UPC2_MAX_CLIENTS; c++)
+			if (pSrv->pClient[c] != NULL)
+				mask |= pSrv->pClient[c]->mask;
+
+		full = FALSE;
+		wait = 10;
+		for (card_ndx = 0; card_ndx < MAX_PCI_CARDS; card_ndx++)
+		{
+			if ((mask & (1 << card_ndx)) == 0 || (UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
+				continue;
+			if (UPC2_Card[card_ndx].pBatchPool == NULL)
+			{
+				// A batch for each client's queue, and the one being read
+				if (UPC2_PCI_StartBatchPool(card_ndx, UPC2_MAX_CLIENTS * SERVER_QUEUE + 2, pSrv->nBatch) < 0)
+					continue;
+				pSrv->own_pool[card_ndx] = TRUE;
+			}
+
+			n = UPC2_PCI_GetBatch(card_ndx, UPC2_NO_GAPS, pSrv->nBatch, &pBatch);
+			if (n > 0)
+			{
+				EnterCriticalSection(&pSrv->Lock);
+				pSrv->stats.frames_read += n;
+				ServerFanOut(pSrv, pBatch);
+				LeaveCriticalSection(&pSrv->Lock);
+				UPC2_PCI_ReleaseBatch(pBatch);
+				if (n == pSrv->nBatch)
+					full = TRUE;
+			}
+			if (UPC2_Card[card_ndx].Sched.stats.interval_us / 1000 < wait)
+				wait = UPC2_Card[card_ndx].Sched.stats.interval_us / 1000;
+		}
+		if (!full)
+			Sleep(wait > 0 ? wait : 1);
+	}
+	return 0;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StartServer -- serves the cards' converted data frames to clients over TCP
+//                         (see UPC2_PCI_ConnectServer)
+//
+//  Each client subscribes to cards when it connects. A card is read (with UPC2_NO_GAPS, so
+//  from the host ring buffer if streaming) while a client is subscribed to it, so the frames
+//  don't go to local UPC2_PCI_GetData calls too. The frames are sent in messages of up to
+//  nBatch frames. A client that falls SERVER_QUEUE messages behind misses frames (counted)
+//  rather than hold up the others.
+//
+// parameters:
+//
+//  port        -- TCP port (0 => UPC2_SERVER_PORT)
+//  nBatch      -- most frames per message (0 => UPC2_SERVER_BATCH, up to UPC2_MAX_SERVER_BATCH)
+//  options     -- UPC2_SERVER_ANY_HOST => accept connections from other hosts (loopback only
+//                 otherwise)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_SERVER_ACTIVE	if already serving
+//			  UPC2_INVALID_PARAM	if port or nBatch is out of range
+//			  UPC2_SOCKET_ERR		if unable to listen on the port
+//			  UPC2_OUT_OF_MEMORY	if unable to allocate the server or its thread
+//
+DllExport long __stdcall UPC2_PCI_StartServer(long port, long nBatch, long options)
+{
+	UPC2_Server_t *     pSrv;
+	WSADATA             wsa;
+	struct sockaddr_in  addr;
+	unsigned            thread_id;
+
+	if (pServer != NULL)
+		return UPC2_SERVER_ACTIVE;
+	if (port == 0)
+		port = UPC2_SERVER_PORT;
+	if (nBatch == 0)
+		nBatch = UPC2_SERVER_BATCH;
+	if (port < 0 || port > 0xffff || nBatch < 1 || nBatch > UPC2_MAX_SERVER_BATCH)
+		return UPC2_INVALID_PARAM;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return UPC2_SOCKET_ERR;
+	if ((pSrv = (UPC2_Server_t *) calloc(1, sizeof(UPC2_Server_t))) == NULL)
+	{
+		WSACleanup();
+		return UPC2_OUT_OF_MEMORY;
+	}
+	pSrv->nBatch = nBatch;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short) port);
+	addr.sin_addr.s_addr = htonl((options & UPC2_SERVER_ANY_HOST) ? INADDR_ANY : INADDR_LOOPBACK);
+	pSrv->listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (pSrv->listen == INVALID_SOCKET || bind(pSrv->listen, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(pSrv->listen, UPC2_MAX_CLIENTS) != 0)
+	{
+		if (pSrv->listen != INVALID_SOCKET)
+			closesocket(pSrv->listen);
+		free(pSrv);
+		WSACleanup();
+		return UPC2_SOCKET_ERR;
+	}
+
+	pSrv->run = 1;
+	InitializeCriticalSection(&pSrv->Lock);
+	pServer = pSrv;
+	pSrv->hThread = (HANDLE) _beginthreadex(NULL, 0, ServerThread, pSrv, 0, &thread_id);
+	if (pSrv->hThread == 0)
+	{
+		pServer = NULL;
+		DeleteCriticalSection(&pSrv->Lock);
+		closesocket(pSrv->listen);
+		free(pSrv);
+		WSACleanup();
+		return UPC2_OUT_OF_MEMORY;
+	}
+	SetThreadPriority(pSrv->hThread, THREAD_PRIORITY_ABOVE_NORMAL);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_StopServer -- stops the server and disconnects its clients
+//
+// A thread that doesn't stop within 5 s (or at all while the DLL detaches)
+// keeps its memory -- the server and client blocks are freed only once
+// their threads have exited. At process exit the sockets are left to the
+// system (see UPC2_ProcessExit).
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_SERVER_ACTIVE	if a thread is still running (the server is stopped, its memory kept)
+//
+DllExport long __stdcall UPC2_PCI_StopServer(void)
+{
+	UPC2_Server_t *     pSrv = pServer;
+	UPC2_SrvClient_t *  pClient;
+	DWORD               wait = UPC2_Detaching ? 0 : 5000;
+	BOOL                done;
+	long                c;
+
+	if (pSrv == NULL)
+		return UPC2_NORMAL_RETURN;
+
+	pServer = NULL;
+	pSrv->run = 0;
+
+	// The threads are gone and Winsock may already be unloaded
+	if (UPC2_ProcessExit)
+		return UPC2_NORMAL_RETURN;
+
+	if (WaitForSingleObject(pSrv->hThread, wait) != WAIT_OBJECT_0)
+		return UPC2_SERVER_ACTIVE;		// still reaping and adding clients
+	CloseHandle(pSrv->hThread);
+	closesocket(pSrv->listen);
+
+	// Unblock the client threads (a send to a slow client) and wait for them
+	done = TRUE;
+	for (c = 0; c < UPC2_MAX_CLIENTS; c++)
+	{
+		if ((pClient = pSrv->pClient[c]) == NULL)
+			continue;
+		pClient->run = 0;
+		shutdown(pClient->sock, SD_BOTH);
+		SetEvent(pClient->hReady);
+		if (WaitForSingleObject(pClient->hThread, wait) != WAIT_OBJECT_0)
+		{
+			done = FALSE;
+			continue;
+		}
+		CloseHandle(pClient->hThread);
+		closesocket(pClient->sock);
+		CloseHandle(pClient->hReady);
+		DeleteCriticalSection(&pClient->Lock);
+		free(pClient->pMsg);
+		free(pClient);
+	}
+	if (!done)
+		return UPC2_SERVER_ACTIVE;		// a client thread still uses pSrv
+
+	for (c = 0; c < MAX_PCI_CARDS; c++)
+		if (pSrv->own_pool[c])
+			UPC2_PCI_StopBatchPool(c);
+	DeleteCriticalSection(&pSrv->Lock);
+	free(pSrv);
+	WSACleanup();
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetServerStats -- gets the streaming server's counters
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_NULL_PARAM		if pStats is NULL
+//			  UPC2_SOCKET_ERR		if not serving
+//
+DllExport long __stdcall UPC2_PCI_GetServerStats(UPC2_ServerStats_t * pStats)
+{
+	if (pStats == NULL)
+		return UPC2_NULL_PARAM;
+	if (pServer == NULL)
+		return UPC2_SOCKET_ERR;
+
+	EnterCriticalSection(&pServer->Lock);
+	memcpy(pStats, &pServer->stats, sizeof(UPC2_ServerStats_t));
+	LeaveCriticalSection(&pServer->Lock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ConnectServer -- connects to a streaming server (see UPC2_PCI_StartServer)
+//
+// parameters:
+//
+//  pHost       -- host name or dotted address of the server (NULL => loopback)
+//  port        -- TCP port (0 => UPC2_SERVER_PORT)
+//  card_mask   -- cards to receive (bit n => card n)
+//  options     -- UPC2_SERVER_DELTA => the server delta codes the frames (less to send)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if port or card_mask is invalid
+//			  UPC2_SOCKET_ERR		if unable to connect (or no reply from the server)
+//			  UPC2_OUT_OF_MEMORY	if UPC2_MAX_SERVER_CONNS connections are open
+//		   -- connection handle (0 to UPC2_MAX_SERVER_CONNS - 1) for UPC2_PCI_ReadServer
+//
+DllExport long __stdcall UPC2_PCI_ConnectServer(char * pHost, long port, long card_mask, long options)
+{
+	UPC2_SrvConn_t *    pConn;
+	WSADATA             wsa;
+	struct sockaddr_in  addr;
+	struct hostent *    pEnt;
+	U32                 hello[3];
+	long                conn, timeout = SERVER_TIMEOUT;
+	SOCKET              sock;
+
+	if (port == 0)
+		port = UPC2_SERVER_PORT;
+	if (port < 0 || port > 0xffff || card_mask == 0 || (card_mask >> MAX_PCI_CARDS) != 0)
+		return UPC2_INVALID_PARAM;
+
+	for (conn = 0; conn < UPC2_MAX_SERVER_CONNS; conn++)
+		if (SrvConn[conn].pMsg == NULL)
+			break;
+	if (conn == UPC2_MAX_SERVER_CONNS)
+		return UPC2_OUT_OF_MEMORY;
+	pConn = &SrvConn[conn];
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return UPC2_SOCKET_ERR;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short) port);
+	if (pHost == NULL)
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else if ((addr.sin_addr.s_addr = inet_addr(pHost)) == INADDR_NONE)
+	{
+		if ((pEnt = gethostbyname(pHost)) == NULL)
+		{
+			WSACleanup();
+			return UPC2_SOCKET_ERR;
+		}
+		memcpy(&addr.sin_addr, pEnt->h_addr_list[0], sizeof(addr.sin_addr));
+	}
+
+	// Connect and exchange hellos
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	hello[0] = SERVER_MAGIC;
+	hello[1] = card_mask;
+	hello[2] = options;
+	if (sock == INVALID_SOCKET)
+	{
+		WSACleanup();
+		return UPC2_SOCKET_ERR;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || SendAll(sock, hello, sizeof(hello)) < 0 ||
+		RecvAll(sock, hello, 2 * sizeof(U32)) < 0 || hello[0] != SERVER_MAGIC ||
+		hello[1] < 1 || hello[1] > UPC2_MAX_SERVER_BATCH)
+	{
+		closesocket(sock);
+		WSACleanup();
+		return UPC2_SOCKET_ERR;
+	}
+
+	pConn->nBatch = hello[1];
+	pConn->pFrames = (U8 *) malloc(pConn->nBatch * EZ_SENSE_FRAME_SIZE);
+	pConn->pMsg = (U8 *) malloc(pConn->nBatch * (EZ_SENSE_FRAME_SIZE / 4) * 5);
+	if (pConn->pFrames == NULL || pConn->pMsg == NULL)
+	{
+		free(pConn->pFrames);
+		free(pConn->pMsg);
+		pConn->pFrames = pConn->pMsg = NULL;
+		closesocket(sock);
+		WSACleanup();
+		return UPC2_OUT_OF_MEMORY;
+	}
+	pConn->sock = sock;
+	pConn->nFrames = pConn->next = 0;
+	pConn->dropped = 0;
+	return conn;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_ReadServer -- reads converted data frames from a streaming server
+//
+//  The frames come a message (one card's batch) at a time. A call returns frames of one card,
+//  the rest of the message going to the next calls.
+//
+// parameters:
+//
+//  conn        -- from UPC2_PCI_ConnectServer
+//  pCard       -- set to the card the frames are from
+//  nFrames     -- maximum number of frames to read
+//  pFrame      -- pointer to a destination buffer for the converted data frames
+//  frm_incr    -- spacing of the frames in bytes (0 => EZ_SENSE_FRAME_SIZE as UPC2_PCI_GetData)
+//  timeout     -- longest wait (msecs) for a message
+//  pDropped    -- pointer to a count the frames the server dropped for the client are added
+//                 to (or NULL)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_PARAM	if conn isn't open or frm_incr is too small
+//			  UPC2_NULL_PARAM		if pCard or pFrame is NULL
+//			  UPC2_SOCKET_ERR		if the connection failed (disconnect it)
+//		   -- number of frames read (0 if none came within the timeout)
+//
+DllExport long __stdcall UPC2_PCI_ReadServer(long conn, long * pCard, long nFrames, void * pFrame, long frm_incr,
+											 long timeout, long * pDropped)
+{
+	UPC2_SrvConn_t *    pConn;
+	UPC2_SrvMsg_t       Msg;
+	fd_set              fds;
+	struct timeval      tv;
+	const U8 *          p;
+	const U8 *          pEnd;
+	U8 *                pDest;
+	U32                 v, d, shift;
+	long                w, k, n;
+
+	if (conn < 0 || conn >= UPC2_MAX_SERVER_CONNS || SrvConn[conn].pMsg == NULL)
+		return UPC2_INVALID_PARAM;
+	if (pCard == NULL || pFrame == NULL)
+		return UPC2_NULL_PARAM;
+	pConn = &SrvConn[conn];
+	if (frm_incr == 0)
+		frm_incr = EZ_SENSE_FRAME_SIZE;
+
+	if (pConn->next == pConn->nFrames)
+	{
+		// Wait for a message
+		FD_ZERO(&fds);
+		FD_SET(pConn->sock, &fds);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (select(0, &fds, NULL, NULL, &tv) <= 0)
+			return 0;
+
+		if (RecvAll(pConn->sock, &Msg, sizeof(Msg)) < 0)
+			return UPC2_SOCKET_ERR;
+		if (Msg.magic != SERVER_MAGIC || Msg.card_ndx >= MAX_PCI_CARDS || Msg.nFrames > (U32)pConn->nBatch ||
+			Msg.frm_size > EZ_SENSE_FRAME_SIZE || (Msg.frm_size & 3) != 0 ||
+			Msg.bytes > (U32)pConn->nBatch * (EZ_SENSE_FRAME_SIZE / 4) * 5)
+			return UPC2_SOCKET_ERR;
+		if (RecvAll(pConn->sock, pConn->pMsg, Msg.bytes) < 0)
+			return UPC2_SOCKET_ERR;
+
+		// Decode (columns of zigzag differences, see ServerEncode) or copy
+		p = pConn->pMsg;
+		pEnd = p + Msg.bytes;
+		if (Msg.options & UPC2_SERVER_DELTA)
+		{
+			for (w = 0; w < (long)Msg.frm_size / 4; w++)
+			{
+				v = 0;
+				for (k = 0; k < (long)Msg.nFrames; k++)
+				{
+					d = 0;
+					shift = 0;
+					do
+					{
+						if (p == pEnd || shift > 28)
+							return UPC2_SOCKET_ERR;
+						d |= (U32)(*p & 0x7f) << shift;
+						shift += 7;
+					}
+					while (*p++ & 0x80);
+					v += (d >> 1) ^ (U32)(-(Int32)(d & 1));
+					*(U32 *)(pConn->pFrames + k * Msg.frm_size + 4 * w) = v;
+				}
+			}
+		}
+		else if (Msg.bytes == Msg.nFrames * Msg.frm_size)
+			memcpy(pConn->pFrames, p, Msg.bytes);
+		else
+			return UPC2_SOCKET_ERR;
+
+		pConn->card_ndx = Msg.card_ndx;
+		pConn->frm_size = Msg.frm_size;
+		pConn->nFrames = Msg.nFrames;
+		pConn->next = 0;
+		pConn->dropped += Msg.dropped;
+	}
+
+	if (frm_incr < pConn->frm_size)
+		return UPC2_INVALID_PARAM;
+
+	n = pConn->nFrames - pConn->next;
+	if (n > nFrames)
+		n = nFrames;
+	pDest = (U8 *) pFrame;
+	for (k = 0; k < n; k++, pDest += frm_incr)
+		memcpy(pDest, pConn->pFrames + (pConn->next + k) * pConn->frm_size, pConn->frm_size);
+	pConn->next += n;
+
+	*pCard = pConn->card_ndx;
+	if (pDropped != NULL)
+		*pDropped += pConn->dropped;
+	pConn->dropped = 0;
+	return n;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_DisconnectServer -- closes a connection to a streaming server
+//
+//  At process exit the socket is left to the system (see UPC2_ProcessExit).
+//
+DllExport long __stdcall UPC2_PCI_DisconnectServer(long conn)
+{
+	if (conn < 0 || conn >= UPC2_MAX_SERVER_CONNS)
+		return UPC2_INVALID_PARAM;
+
+	if (SrvConn[conn].pMsg != NULL)
+	{
+		// Winsock may already be unloaded at process exit
+		if (!UPC2_ProcessExit)
+			closesocket(SrvConn[conn].sock);
+		free(SrvConn[conn].pMsg);
+		free(SrvConn[conn].pFrames);
+		SrvConn[conn].pMsg = NULL;
+		SrvConn[conn].pFrames = NULL;
+		if (!UPC2_ProcessExit)
+			WSACleanup();
+	}
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SetFramePeriod -- caches the frame period used to pace UPC2_PCI_WaitForFrames
+//
+//                   period (usec) = scan_interval * nSbits * McBSP0_clk_div / 4
+//                   (McBSP0_clk_div = 40 => 10 usec per sbit)
+//
+void SetFramePeriod(long card_ndx, UPC2_Config_t * pUPC2_Config)
+{
+	U32   clk_div = pUPC2_Config->McBSP0_clk_div;
+
+	if (clk_div == 0)
+		clk_div = 40;
+	UPC2_Card[card_ndx].FramePeriod = (pUPC2_Config->scan_interval * pUPC2_Config->nSbits * clk_div) / 4;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// StartHintNotify -- starts a thread that turns the DSP's HINT (PLX 9030 LINTi1) into a
+//                    FrameEvent notification. Only built with UPC2_HINT_INTERRUPT
+//                    (requires DSP code that raises HINT as frames are converted).
+//
+// StopHintNotify  -- stops the thread
+//
+#ifdef UPC2_HINT_INTERRUPT
+unsigned __stdcall HintThread(void * pArg)
+{
+	long      card_ndx = (long) pArg;
+	PLX_INTR  PlxIntr;
+	HANDLE    hIntrEvent;
+
+	memset(&PlxIntr, 0, sizeof(PLX_INTR));
+	PlxIntr.PciMainInt  = 1;
+	PlxIntr.IopToPciInt = 1;		// LINTi1 <- HINT
+
+	while (UPC2_Card[card_ndx].HintRun)
+	{
+		// The driver disables the interrupt each time it fires, so re-arm every pass
+		if (PlxIntrAttach(UPC2_Card[card_ndx].hDevice, PlxIntr, &hIntrEvent) != ApiSuccess)
+			break;
+		PlxIntrEnable(UPC2_Card[card_ndx].hDevice, &PlxIntr);
+
+		if (WaitForSingleObject(hIntrEvent, 100) == WAIT_OBJECT_0)
+		{
+			// Clear HINT (write 1), keep HWOB = 1
+			EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+			UPC2_Card[card_ndx].pHpi->WriteHPIC(card_ndx, 0x00050005);
+			LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+
+			SetEvent(UPC2_Card[card_ndx].FrameEvent);
+		}
+	}
+
+	PlxIntrDisable(UPC2_Card[card_ndx].hDevice, &PlxIntr);
+	InterlockedDecrement(&UPC2_Card[card_ndx].FrameNotify);
+	return 0;
+}
+#endif
+
+void StartHintNotify(long card_ndx)
+{
+#ifdef UPC2_HINT_INTERRUPT
+	unsigned  thread_id;
+
+	UPC2_Card[card_ndx].HintRun = 1;
+	InterlockedIncrement(&UPC2_Card[card_ndx].FrameNotify);
+	UPC2_Card[card_ndx].hHintThread = (HANDLE) _beginthreadex(NULL, 0, HintThread, (void *) card_ndx, 0, &thread_id);
+	if (UPC2_Card[card_ndx].hHintThread == 0)
+		InterlockedDecrement(&UPC2_Card[card_ndx].FrameNotify);
+#endif
+}
+
+void StopHintNotify(long card_ndx)
+{
+#ifdef UPC2_HINT_INTERRUPT
+	if (UPC2_Card[card_ndx].hHintThread == 0)
+		return;
+	UPC2_Card[card_ndx].HintRun = 0;
+	WaitForSingleObject(UPC2_Card[card_ndx].hHintThread, 1000);
+	CloseHandle(UPC2_Card[card_ndx].hHintThread);
+	UPC2_Card[card_ndx].hHintThread = 0;
+#endif
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// UPC2_PCI_GetData -- reads converted data from the ring buffer and updates the converted data
-//					   frame header and the frame status word.
-//
-//					  If access method is UPC2_NEWEST_DATA a single frame is read
-//
-//					  If access method is UPC2_NO_GAPS or UPC2_START_FROM_FRAME N, frames are 
-//                       read where  N = min(nFrames , number of frames unread) and the number
-//                       read is returned to the caller
-//
-//					  If UPC2_NO_GAPS is specified the frames are transferred directly
-//                       from DSP memory to the caller. Otherwise the data is read a 
-//                       a frame at a time assuming the caller has specified 24 items/frame
+// UPC2_PCI_WaitForFrames -- waits until at least minFrames converted data frames are unread
+//                           (or the timeout expires)
 //
-//					   	 Additionally, the StartFrame pointer is advanced to the next
-//                   	   available frame.
+//                           The wait blocks on the card's frame-ready event when something
+//                           raises it (the streaming thread, or the HINT interrupt thread when
+//                           built with UPC2_HINT_INTERRUPT). Otherwise the pool header is polled
+//                           at an interval based on the time the missing frames should take
+//                           (scan_interval * nSbits), so a large minFrames doesn't poll per frame.
 //
 // parameters:
 //
 //  card_ndx    -- long 0, 1, 2, .. representing the card's index
 //
-//  access_type -- UPC2_NO_GAPS, UPC2_FROM_START_FRAME, UPC2_NEWEST_DATA or UPC2_FROM_LOAD_PTR
-//
-//	 nFrames 	-- long specifying the number of frames to read (not used if NEWEST)
+//  minFrames   -- long specifying the number of unread frames to wait for
 //
-//  pFrame 		-- pointer to a destination buffer for the converted data frame(s)
+//  timeout     -- long specifying the maximum wait in msecs (INFINITE = no timeout)
 //
 // Returns 		-- negative if an error occurs. 
-//			         UPC2_INVALID_INDEX   		 		if no UPC card with the specified index
-//			         UPC2_NO_CONNECTION	  	     		if not connected
-//                   UPC2_DATA_COLLECTION_NOT_STARTED	if data not being collected
-//
-//         		-- number of frames read if no error
+//			         UPC2_INVALID_INDEX   			 if no UPC card with the specified index
+//			         UPC2_DATA_COLLECTION_NOT_STARTED if data collection not started
+//			         UPC2_INVALID_PARAM   	    	 if minFrames < 1
+//         		-- number of unread frames (less than minFrames if the timeout expired)
 //
-DllExport long __stdcall UPC2_PCI_GetData(long card_ndx, long access_type, long nFrames, void * pFrame)
+DllExport long __stdcall UPC2_PCI_WaitForFrames(long card_ndx, long minFrames, long timeout)
 {
-	UPC2_ConvertedDataFramePoolHdr_t FrameHdrImage;
-	UPC2_ConvertedDataFrame_t * pF = (UPC2_ConvertedDataFrame_t *)pFrame;
-	long			ret_val;
-	U32				FrameAddr;		// local address of converted frame
-	long			nFramesToEnd, pFrames;
-	long			nFramesUnread;
-	long			i, j, nItems, fcnt, fread;
-	U32			    t0, t1, t; 
-	float			val;
-	U32			    pFrame0 = (U32) pFrame;
-	long			jmax = 3;
-	static  long    retry_count = 0;
-	U32				frm_size, frm_incr;
+	long    ret_val;
+	long    nFrames;
+	U32     t0, elapsed, wait, period;
 
-	if ((UPC2_DSP_State[card_ndx] & DSP_DATA_COLLECTION_STARTED) == 0)
-	{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (minFrames < 1)
+		return UPC2_INVALID_PARAM;
+
+	if ((UPC2_Card[card_ndx].DSP_State & DSP_DATA_COLLECTION_STARTED) == 0)
 		return UPC2_DATA_COLLECTION_NOT_STARTED;
-	}
 
-	if ((ret_val = IsConnected(card_ndx)) < 0)
+	t0 = GetTickCount();
+	for (;;)
 	{
-		////////////////////////////////////////////////////////////////////////////////   
-		//    	D E M O    M O D E
-		////////////////////////////////////////////////////////////////////////////////   
-
-		// Not connected. Send data based on demo_config
-		nItems = demo_config[card_ndx].nItems;
-		if (access_type == UPC2_FROM_START_FRAME)
+		if ((ret_val = IsConnected(card_ndx)) < 0)
 		{
-			t0 = demo_config[card_ndx].time_in_ms;
-			t1 = GetTickCount();
-			demo_config[card_ndx].time_in_ms = t1;
-
-			if (t1 > t0)
-				t = t1 - t0;
-			else
-				t = 0xffffffff - t1 + t0;
-
-			// frames read = time in usec / (number of frames * frame scan time in usecs)
-			//             = (time in mscec * 1000) / (number of frames * nSbits * 10)   
-			//             = (time in mscec * 100) / (number of frames * nSbits)   
-
-			fread = (100 * t) / (demo_config[card_ndx].scan_interval * demo_config[card_ndx].nSbits); 
-			fcnt = (nFrames > fread) ? fread : nFrames;
+			// DEMO mode -- frames accumulate since the last UPC2_PCI_GetData (see UPC2_PCI_GetData)
+			if (UPC2_Card[card_ndx].Demo.scan_interval * UPC2_Card[card_ndx].Demo.nSbits == 0)
+				return UPC2_NO_CONFIG;
+			nFrames = (100 * (GetTickCount() - UPC2_Card[card_ndx].Demo.time_in_ms)) /
+					  (UPC2_Card[card_ndx].Demo.scan_interval * UPC2_Card[card_ndx].Demo.nSbits);
 		}
 		else
-			fcnt = 1;
-
-		for (j = 0; j < fcnt; j++)
+			nFrames = UPC2_PCI_GetUnreadFrameCount(card_ndx);
+
+		if (nFrames < 0 || nFrames >= minFrames)
+			return nFrames;
+
+		elapsed = GetTickCount() - t0;
+		if (timeout != INFINITE && elapsed >= (U32)timeout)
+			return nFrames;
+
+		// Time (msecs) until the missing frames should be there
+		period = UPC2_Card[card_ndx].FramePeriod;
+		if (period == 0)
+			period = 1000;			// no config -- 1 msec per frame
+		wait = ((minFrames - nFrames) * period) / 1000;
+		if (wait < 1)
+			wait = 1;
+		if (timeout != INFINITE && wait > (U32)timeout - elapsed)
+			wait = (U32)timeout - elapsed;
+
+		if (UPC2_Card[card_ndx].FrameNotify > 0)
 		{
-			pF->frame_no = demo_config[card_ndx].frame_no++;
-			val = (pF->frame_no % 10) * 0.1f;  // sawtooth that goes 0 to 1 in 10 steps
-			pF->timestamp = pF->frame_no * demo_config[card_ndx].scan_interval * demo_config[card_ndx].nSbits;
-			for (i = 0; i < nItems; i++)
-			{
-				//  Random number returned by the following
-				//   pF->data[i] = (i + 1 + rand()) * demo_config[card_ndx].scale[i] + demo_config[card_ndx].offset[i];
-				// Sawtooth function returned by the following
-				pF->data[i] = (i + 1 + val) * demo_config[card_ndx].scale[i] + demo_config[card_ndx].offset[i];
-			}
-			// Bump to next frame
-			//pF = (UPC2_ConvertedDataFrame_t *)((Uint32)(pF) + demo_config[card_ndx].nItems * 4 + 8);
-			// 4-21-05 for the time being always assume data aray has room for 24 items ( = 4*24 + 8 = 104)
-			pF = (UPC2_ConvertedDataFrame_t *)((Uint32)(pF) + 104);
+			// Woken early as frames arrive. Still bounded so a lost notification can't stall us.
+			WaitForSingleObject(UPC2_Card[card_ndx].FrameEvent, wait + 10);
 		}
-		return fcnt;
-	}
-	// Test for Data started
-
-	////////////////////////////////////////////////////////////////////////////////   
-	//    	R E A L   D A T A   M O D E
-	////////////////////////////////////////////////////////////////////////////////   
-
-	// Read the pool header
-	ReadFromLocalAddressSpace(card_ndx, CONVERTED_DATA_FRAMES_POOL_HDR_ADDR,
-									  &FrameHdrImage, sizeof(FrameHdrImage));
-
-	frm_size = FrameHdrImage.FrameSize;   // includes check word
-	
-	if (access_type == UPC2_NO_GAPS)
-		frm_incr =  frm_size - 4;
-	else
-		// EaesySense array has room for 24 items ( = 4*24 + 8 = 104)
-		frm_incr = EZ_SENSE_FRAME_SIZE;
-
-
-	if (access_type == UPC2_FROM_LOAD_PTR)
-    {
-		//////////////////////////////////////////////////////
-		// Process Read from Load Pointer request
-		//////////////////////////////////////////////////////
-		FrameAddr = (U32)FrameHdrImage.pLoad;
-
-		// Read the data frame(s)
-		ret_val = ReadFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, FrameHdrImage.FrameSize);
-        if (ret_val < 0)
-            return ret_val;
-        nFrames = 1;
-    }
-    else if (access_type == UPC2_NEWEST_DATA)
-    {
-		//////////////////////////////////////////////////////
-		// Process NEWEST request
-		//////////////////////////////////////////////////////
-		FrameAddr = (U32)FrameHdrImage.pNew;
-
-		// Read the data frame(s)
-		ret_val = ReadFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, FrameHdrImage.FrameSize);
-        if (ret_val < 0)
-            return ret_val;
-		nFrames = 1;
-    }
-    else
-    {
-		//////////////////////////////////////////////////////
-		// Process START_FROM_FRAME request
-		//////////////////////////////////////////////////////
-
-		FrameAddr = (U32)FrameHdrImage.pStart;
-
-		// Determine nFramesUnread
-		if (FrameHdrImage.pNew < FrameHdrImage.pStart)
-			nFramesUnread = FrameHdrImage.MaxFrames - ((U32)FrameHdrImage.pStart - (U32)FrameHdrImage.pNew) / frm_size;
 		else
-			nFramesUnread = ((U32)FrameHdrImage.pNew - (U32)FrameHdrImage.pStart) / frm_size;
-
-		if (nFramesUnread == 0)
-			return 0;
+			Sleep(wait);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SchedObserve -- poll scheduler. Records a poll of the pool header and plans the next one
+//                 (caller holds HpiLock).
+//
+//  The frames arriving between polls and the time between them are averaged to measure the
+//  frame rate (until then the frame period from the config is used). The next poll is due
+//  after the target latency, or sooner if the unread frames left would reach the watermark
+//  first. The batch is the frames left plus those expected by then.
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  nUnread     -- unread frames in the DSP ring buffer when polled
+//  nMax        -- frames in the DSP ring buffer
+//  nRead       -- frames taken (read or skipped)
+//
+void SchedObserve(long card_ndx, long nUnread, long nMax, long nRead)
+{
+	UPC2_Sched_t *      pSched = &UPC2_Card[card_ndx].Sched;
+	UPC2_PollStats_t *  pStats = &pSched->stats;
+	LARGE_INTEGER       t, frq;
+	double              dt, period, interval;
+	long                pct, left;
 
-		// Reset nFrames if request too large 
-		if (nFrames > nFramesUnread)
-			nFrames = nFramesUnread -1;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&frq);
 
-		// Determine nFramesToEnd
-		nFramesToEnd = ((U32)FrameHdrImage.pLast - (U32)FrameHdrImage.pStart)/frm_size + 1;
+	if (nRead < 0)
+		nRead = 0;
+	else if (nRead > nUnread)
+		nRead = nUnread;
+	left = nUnread - nRead;
 
-		// Read the data frame(s)
-		if (nFrames < nFramesToEnd)
+	if (pSched->t_last.QuadPart != 0)
+	{
+		dt = (double)(t.QuadPart - pSched->t_last.QuadPart) / (double)frq.QuadPart;
+		if (pStats->polls == 1)
 		{
-			//////////////////////////////////////////////////////
-			// request does not wrap 
-			//////////////////////////////////////////////////////
-			for (i = 0; i < nFrames; i++)
-			{
-				ret_val = ReadWithCheckFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, frm_size);
-				if (ret_val < 0)
-					return ret_val;
-                //CheckFrame(frm_size, pFrame);
-				FrameAddr += frm_size;
-				(U32) pFrame += frm_incr;
-			}
-			newFrameAddr = (U32)FrameHdrImage.pStart + (U32)frm_size * nFrames;
+			pSched->arrived = nUnread - pSched->left;
+			pSched->dt = dt;
+			pStats->avg_batch = nRead;
 		}
 		else
 		{
-			//////////////////////////////////////////////////////
-			// request wraps -- read to end
-			//////////////////////////////////////////////////////
-			for (i = 0; i < nFramesToEnd; i++)
-			{
-				ret_val = ReadWithCheckFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, frm_size);
-				if (ret_val < 0)
-					return ret_val;
-                //CheckFrame(frm_size, pFrame);
-				FrameAddr += frm_size;
-				(U32) pFrame += frm_incr;
-			}
-
-			//////////////////////////////////////////////////////
-			// then read balance from start of buffer
-			//////////////////////////////////////////////////////
-			FrameAddr = (U32)FrameHdrImage.pFrame1;
-			pFrames = nFrames - nFramesToEnd; 
-			for (i = 0; i < pFrames; i++)
-			{
-				ret_val = ReadWithCheckFromLocalAddressSpace(card_ndx, FrameAddr, pFrame, frm_size);
-				if (ret_val < 0)
-					return ret_val;
-                //CheckFrame(frm_size, pFrame);
-				FrameAddr += frm_size;
-				(U32) pFrame += frm_incr;
-			}
-			newFrameAddr = (U32)FrameHdrImage.pFrame1 + (U32)frm_size * pFrames;
+			pSched->arrived += (nUnread - pSched->left - pSched->arrived) / SCHED_EWMA;
+			pSched->dt += (dt - pSched->dt) / SCHED_EWMA;
+			pStats->avg_batch += (nRead - pStats->avg_batch) / SCHED_EWMA;
+		}
+		if (pSched->dt > 0)
+		{
+			pStats->poll_rate = 1.0 / pSched->dt;
+			pStats->frame_rate = (pSched->arrived > 0) ? pSched->arrived / pSched->dt : 0;
 		}
-		// Update pointer in the header
-		WriteToLocalAddressSpace(card_ndx, &newFrameAddr,
-										 CONVERTED_DATA_FRAMES_POOL_HDR_ADDR + PSTART_OFFSET, sizeof(U32));
 	}
-	return nFrames;
+	pSched->t_last = t;
+	pSched->left = left;
+	pStats->polls++;
+	pStats->occupancy = nUnread;
+	if (nUnread > pStats->peak_occupancy)
+		pStats->peak_occupancy = nUnread;
+	pStats->nMax = nMax;
+
+	// Plan the next poll
+	pStats->latency_us = (pSched->latency_us != 0) ? pSched->latency_us : UPC2_POLL_LATENCY;
+	pct = (pSched->watermark_pct != 0) ? pSched->watermark_pct : UPC2_POLL_WATERMARK;
+	pStats->watermark = (nMax * pct) / 100;
+	if (pStats->watermark < 1)
+		pStats->watermark = 1;
+	pStats->frame_period_us = UPC2_Card[card_ndx].FramePeriod;
+
+	if (pStats->frame_rate > 0 && pStats->polls > SCHED_EWMA)
+		period = 1000000.0 / pStats->frame_rate;
+	else if (pStats->frame_period_us > 0)
+		period = pStats->frame_period_us;
+	else
+		period = 1000.0;				// no config -- 1 msec per frame
+
+	// Until the latency is up or the watermark would be reached (under the Sleep resolution => now)
+	interval = (pStats->watermark - left) * period;
+	if (interval > pStats->latency_us)
+		interval = pStats->latency_us;
+	if (interval < SCHED_MIN_INTERVAL)
+		interval = 0;
+	pStats->interval_us = (long)interval;
+
+	pStats->batch = left + (long)(interval / period + 0.999);
+	if (pStats->batch < 1)
+		pStats->batch = 1;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SchedReset -- forgets the polls seen (keeps the target)
+//
+void SchedReset(long card_ndx)
+{
+	UPC2_Sched_t *  pSched = &UPC2_Card[card_ndx].Sched;
+
+	pSched->t_last.QuadPart = 0;
+	pSched->left = 0;
+	pSched->arrived = 0;
+	pSched->dt = 0;
+	memset(&pSched->stats, 0, sizeof(UPC2_PollStats_t));
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_SetPollTarget -- sets the latency and occupancy the poll scheduler aims for
+//
+//                           The streaming thread paces itself with the scheduler. Callers of
+//                           UPC2_PCI_GetData (UPC2_FROM_START_FRAME or UPC2_NO_GAPS) can
+//                           take the time of their next call and the frames to ask for from
+//                           UPC2_PCI_GetPollStats (interval_us and batch).
+//
+// parameters:
+//
+//  card_ndx      -- long 0, 1, 2, .. representing the card's index
+//  latency_us    -- longest time (usecs) a frame should wait to be read (0 => UPC2_POLL_LATENCY)
+//  watermark_pct -- percent of the DSP ring buffer the unread frames should stay below
+//                   (0 => UPC2_POLL_WATERMARK)
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_INVALID_PARAM	if latency_us < 0 or watermark_pct isn't 0 to 100
+//
+DllExport long __stdcall UPC2_PCI_SetPollTarget(long card_ndx, long latency_us, long watermark_pct)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (latency_us < 0 || watermark_pct < 0 || watermark_pct > 100)
+		return UPC2_INVALID_PARAM;
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	UPC2_Card[card_ndx].Sched.latency_us = latency_us;
+	UPC2_Card[card_ndx].Sched.watermark_pct = watermark_pct;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return UPC2_NORMAL_RETURN;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UPC2_PCI_GetPollStats -- gets the poll scheduler's plan for the next poll and the poll rate,
+//                          batch size and occupancy achieved (reset by
+//                          UPC2_PCI_StartDataCollection)
+//
+// parameters:
+//
+//  card_ndx    -- long 0, 1, 2, .. representing the card's index
+//  pStats      -- pointer to a UPC2_PollStats_t struct
+//
+// Returns -- negative if an error occurs. 
+//			  UPC2_INVALID_INDEX	if no UPC card with the specified index
+//			  UPC2_NULL_PARAM		if pStats is NULL
+//		   -- number of polls seen (the plan is empty until the first)
+//
+DllExport long __stdcall UPC2_PCI_GetPollStats(long card_ndx, UPC2_PollStats_t * pStats)
+{
+	if (card_ndx >= MAX_PCI_CARDS || card_ndx < 0)
+		return UPC2_INVALID_INDEX;
+
+	if (pStats == NULL)
+		return UPC2_NULL_PARAM;
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	memcpy(pStats, &UPC2_Card[card_ndx].Sched.stats, sizeof(UPC2_PollStats_t));
+	LeaveCriticalSection(&UPC2_Card[card_ndx].HpiLock);
+	return pStats->polls;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -2547,6 +8962,8 @@ DllExport long __stdcall UPC2_PCI_StopDataCollection(long card_ndx)
 		return ret_val;
 	}
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 //#ifdef USE_SEND_COMMAND
 	ret_val = SendCommand(card_ndx, UPC2_DSP_STOP_DATA_COLLECTION, 100);
 //#else
@@ -2567,7 +8984,7 @@ DllExport long __stdcall UPC2_PCI_StopDataCollection(long card_ndx)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -2577,14 +8994,14 @@ DllExport long __stdcall UPC2_PCI_StopDataCollection(long card_ndx)
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 
@@ -2598,12 +9015,13 @@ DllExport long __stdcall UPC2_PCI_StopDataCollection(long card_ndx)
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
 	if (i == SEND_CMD_MAX_TRIES)
 		ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 //#endif
 	return ret_val;
@@ -2639,7 +9057,7 @@ DllExport long __stdcall UPC2_PCI_SaveConfigToFlash(long card_ndx)
 		return ret_val;
 
 	// Verify UPC2_Config loaded
-	if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config == 0)
 		return UPC2_NO_CONFIG;
 
 #ifdef USE_SEND_COMMAND
@@ -2648,6 +9066,8 @@ DllExport long __stdcall UPC2_PCI_SaveConfigToFlash(long card_ndx)
 
 
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -2665,7 +9085,7 @@ DllExport long __stdcall UPC2_PCI_SaveConfigToFlash(long card_ndx)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -2675,26 +9095,27 @@ DllExport long __stdcall UPC2_PCI_SaveConfigToFlash(long card_ndx)
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
 	if (i == SEND_CMD_MAX_TRIES)
 		ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 #endif
 	return ret_val;
@@ -2732,6 +9153,8 @@ DllExport long __stdcall UPC2_PCI_LoadConfigFromFlash(long card_ndx)
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
 		return ret_val;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -2749,7 +9172,7 @@ DllExport long __stdcall UPC2_PCI_LoadConfigFromFlash(long card_ndx)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -2759,28 +9182,31 @@ DllExport long __stdcall UPC2_PCI_LoadConfigFromFlash(long card_ndx)
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
 	if (i == SEND_CMD_MAX_TRIES)
 		ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 #endif
+	// DSP rewrites the IRAM copy and memory map entry
+	InvalidateShadow(card_ndx, SHADOW_MEMORY_MAP | SHADOW_CONFIG);
 	return ret_val;
 }
 
@@ -2806,21 +9232,12 @@ DllExport long __stdcall UPC2_PCI_GetNumberOfItems(long card_ndx)
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
-	if ((ret_val = GetMemoryMapPlus(card_ndx)) < 0)
-		return ret_val;
-
-	// Verify UPC2_Config loaded
-	if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
-		return UPC2_NO_CONFIG;
-
-	// Copy UPC2_Config to DLL's buffer
-	ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CONFIG_STRUCT_ADDR,
-													&UPC2_Config, sizeof(UPC2_Config_t));
-	if (ret_val < 0)
+	// Verify UPC2_Config loaded (shadow copy)
+	if ((ret_val = GetShadowConfig(card_ndx)) < 0)
 		return ret_val;
 
 	// Get number of items
-	ret_val = UPC2_Config.nItems;
+	ret_val = UPC2_Card[card_ndx].Config.nItems;
    return ret_val;
 
 }
@@ -2848,17 +9265,13 @@ DllExport long __stdcall UPC2_PCI_DownloadConfig(long card_ndx, UPC2_Config_t *
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
-	if ((ret_val = GetMemoryMapPlus(card_ndx)) < 0)
+	// Verify UPC2_Config loaded (shadow copy)
+	if ((ret_val = GetShadowConfig(card_ndx)) < 0)
 		return ret_val;
 
-	// Verify UPC2_Config loaded
-	if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
-		return UPC2_NO_CONFIG;
-
 	// Copy UPC2_Config to user's buffer
-	ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CONFIG_STRUCT_ADDR,
-													pUPC2_Config, sizeof(UPC2_Config_t));
-	return ret_val;
+	memcpy(pUPC2_Config, &UPC2_Card[card_ndx].Config, sizeof(UPC2_Config_t));
+	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -2886,6 +9299,7 @@ DllExport long __stdcall UPC2_PCI_InCircuitProgram(long card_ndx, long dest, cha
 	long i,j;
 	long  pgm_size;
 	U32  CRC;
+	U8 * pImage;
 	UPC2_CommandBuffer_t     CommandBuffer;
 	//  char str[80];
 
@@ -2901,15 +9315,24 @@ DllExport long __stdcall UPC2_PCI_InCircuitProgram(long card_ndx, long dest, cha
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
 		return ret_val;
 
-	if ((pgm_size = DownloadHexFile(pFilePath)) < 0)
+	if ((pImage = (U8 *) malloc(PGM_BUF_SIZE)) == NULL)
+		return UPC2_OUT_OF_MEMORY;
+
+	if ((pgm_size = DownloadHexFile(pFilePath, pImage, PGM_BUF_SIZE)) < 0)
+	{
+		free(pImage);
 		return pgm_size;
+	}
+
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 	// Copy CRC of binary image to CommandDataBuffer
-	CRC = Calculate32BitCRC(pgm_size, pgm_buf);
+	CRC = Calculate32BitCRC(pgm_size, pImage);
 	WriteToLocalAddressSpace(card_ndx, &CRC, COMMAND_DATA_BUFFER_ADDR, sizeof(U32));
 
 	// Copy binary image to Command Data Buffer + 4
-	WriteToLocalAddressSpace(card_ndx, pgm_buf, COMMAND_DATA_BUFFER_ADDR+4, pgm_size);
+	WriteToLocalAddressSpace(card_ndx, pImage, COMMAND_DATA_BUFFER_ADDR+4, pgm_size);
+	free(pImage);
 
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
@@ -2939,21 +9362,25 @@ DllExport long __stdcall UPC2_PCI_InCircuitProgram(long card_ndx, long dest, cha
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 40000*BUSY_TEST_TRIES)
 			continue;
 
 		// Retry if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 			continue;
 
 		// Return if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
+		{
+			LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 			return UPC2_NORMAL_RETURN;
+		}
 
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return UPC2_EXCEEDED_CMD_RETRY_LIMIT;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -2996,6 +9423,8 @@ DllExport long __stdcall UPC2_PCI_DownloadProgram(long card_ndx, long src, void
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
 		return ret_val;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -3017,7 +9446,7 @@ DllExport long __stdcall UPC2_PCI_DownloadProgram(long card_ndx, long src, void
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -3027,21 +9456,21 @@ DllExport long __stdcall UPC2_PCI_DownloadProgram(long card_ndx, long src, void
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 	}
 	if (i == SEND_CMD_MAX_TRIES)
@@ -3061,6 +9490,7 @@ DllExport long __stdcall UPC2_PCI_DownloadProgram(long card_ndx, long src, void
 		if (CRC != *((U32 *)pBuf+sw_info.code_size+sizeof(sw_info)+sizeof(U32)))
 			ret_val = UPC2_BAD_CRC;
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 	return ret_val;
 }
@@ -3093,7 +9523,7 @@ DllExport long __stdcall UPC2_PCI_UploadCalibrationData(long card_ndx, UPC2_Cali
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
 		return ret_val;
 
-	if (SDRAM_Image.MemoryMap.pUPC2_Config == 0)
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Config == 0)
 		return UPC2_NO_CONFIG;
 
 	// Copy calibration data to SDRAM
@@ -3102,6 +9532,11 @@ DllExport long __stdcall UPC2_PCI_UploadCalibrationData(long card_ndx, UPC2_Cali
 	// Set SDRAM Memory map entry 
 	WriteToLocalAddressSpace(card_ndx, &addr, 
 									 UPC2_CALIB_STRUCT_TABLE_MM_ADDR, sizeof(U32));
+
+	// Keep the shadow copy in step with IRAM
+	memcpy(&UPC2_Card[card_ndx].Calib, pUPC2_Calib_data, sizeof(UPC2_Calib_data_t));
+	UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Calib = (UPC2_Calib_data_t*)addr;
+	UPC2_Card[card_ndx].ShadowValid |= SHADOW_CALIB;
 	return ret_val;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -3130,17 +9565,13 @@ DllExport long __stdcall UPC2_PCI_DownloadCalibrationData(long card_ndx, UPC2_Ca
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
-	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
+	// Verify that Calibration data is loaded (shadow copy)
+	if ((ret_val = GetShadowCalib(card_ndx)) < 0)
 		return ret_val;
 
-	// Verify that Calibration data is loaded 
-	if (SDRAM_Image.MemoryMap.pUPC2_Calib == 0)
-		return UPC2_NO_CALIB_DATA;
-
 	// Copy UPC2_Calib_data to user's buffer
-	ret_val = ReadFromLocalAddressSpace(card_ndx, UPC2_CALIB_STRUCT_TABLE_ADDR,
-													pUPC2_Calib_data, sizeof(UPC2_Calib_data_t));
-	return ret_val;
+	memcpy(pUPC2_Calib_data, &UPC2_Card[card_ndx].Calib, sizeof(UPC2_Calib_data_t));
+	return UPC2_NORMAL_RETURN;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -3177,9 +9608,11 @@ DllExport long __stdcall UPC2_PCI_SaveCalibrationDataToFlash(long card_ndx)
 		return ret_val;
 
 	// Verify calibration data loaded
-	if (SDRAM_Image.MemoryMap.pUPC2_Calib == 0)
+	if (UPC2_Card[card_ndx].SDRAM_Image.MemoryMap.pUPC2_Calib == 0)
 		return UPC2_NO_CALIB_DATA;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -3199,10 +9632,10 @@ DllExport long __stdcall UPC2_PCI_SaveCalibrationDataToFlash(long card_ndx)
 				continue;
 
 			// for DEBUG don't allow the case of status not set
-			if (cmd_status == 0)
+			if (UPC2_Card[card_ndx].cmd_status == 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -3212,25 +9645,26 @@ DllExport long __stdcall UPC2_PCI_SaveCalibrationDataToFlash(long card_ndx)
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 	}
 	if (i == SEND_CMD_MAX_TRIES)
 		ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 #endif
 	return ret_val;
@@ -3273,6 +9707,8 @@ DllExport long __stdcall UPC2_PCI_LoadCalibrationDataFromFlash(long card_ndx)
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
 		return ret_val;
 
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	{
@@ -3290,7 +9726,7 @@ DllExport long __stdcall UPC2_PCI_LoadCalibrationDataFromFlash(long card_ndx)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == 100*BUSY_TEST_TRIES)
@@ -3300,28 +9736,31 @@ DllExport long __stdcall UPC2_PCI_LoadCalibrationDataFromFlash(long card_ndx)
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
 	if (i == SEND_CMD_MAX_TRIES)
 		ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 
 #endif
+	// DSP rewrites the IRAM copy and memory map entry
+	InvalidateShadow(card_ndx, SHADOW_MEMORY_MAP | SHADOW_CALIB);
 	return ret_val;
 }
 
@@ -3366,6 +9805,8 @@ DllExport long __stdcall UPC2_PCI_WriteSystemSerialNumber(long card_ndx, U32 sn)
       if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
           return ret_val;
 
+      EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+
    	  // Try n-times
 	  for (i=0; i < SEND_CMD_MAX_TRIES; i++)
 	  {
@@ -3385,20 +9826,24 @@ DllExport long __stdcall UPC2_PCI_WriteSystemSerialNumber(long card_ndx, U32 sn)
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		 }
 		 if (j == 1000*BUSY_TEST_TRIES)
 			continue;
 
 		 // Retry if bad CRC
-		 if (cmd_status & UPC2_DSP_BAD_CRC)
+		 if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 			continue;
 
 		 // Return if completed OK
-		 if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		 if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
+		 {
+			LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 			return UPC2_NORMAL_RETURN;
+		 }
 	  }
+      LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
    }
    if (i == SEND_CMD_MAX_TRIES)
 	   ret_val = UPC2_EXCEEDED_CMD_RETRY_LIMIT;
@@ -3431,7 +9876,7 @@ DllExport long __stdcall UPC2_PCI_WriteSystemSerialNumberToEEPROM(long card_ndx,
 
 	// Write custom data to non-PLX used EEPROM space 
 	rc = PlxVpdWrite(
-						 UPC2_hDevice[card_ndx],
+						 UPC2_Card[card_ndx].hDevice,
 						 0xc0,		 // start of VPD area
 						 sn 
 						 ); 
@@ -3574,7 +10019,7 @@ DllExport long __stdcall UPC2_PCI_ReadSystemSerialNumberFromEEPROM(long card_ndx
 		return ret_val;
 
 	*psn = PlxVpdRead(
-						  UPC2_hDevice[card_ndx],
+						  UPC2_Card[card_ndx].hDevice,
 						  0xc0,		  // start of VPD area
 						  &rc
 						  ); 
@@ -3614,21 +10059,25 @@ DllExport long __stdcall UPC2_PCI_GetSysInfo(long card_ndx, sw_info_t * pSWinfo,
 #endif	
    sw_info_t    DLLinfo =
 	{
-		"Prod 1.0.0.21",
+		"Prod 1.0.0.46",
 		__DATE__,
 		__TIME__,
 		81920				  // size of DLL in bytes
 	};
 
-#ifdef USE_SEND_COMMAND
-	ret_val = SendCommandEx(card_ndx, UPC2_DSP_GET_SYSTEM_INFO, 1);
-#else
-
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
+	// Keep other commands out until the reply is read
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+#ifdef USE_SEND_COMMAND
+	ret_val = SendCommandEx(card_ndx, UPC2_DSP_GET_SYSTEM_INFO, 1);
+#else
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 		return ret_val;
+	}
 
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
@@ -3647,7 +10096,7 @@ DllExport long __stdcall UPC2_PCI_GetSysInfo(long card_ndx, sw_info_t * pSWinfo,
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == BUSY_TEST_TRIES)
@@ -3657,21 +10106,21 @@ DllExport long __stdcall UPC2_PCI_GetSysInfo(long card_ndx, sw_info_t * pSWinfo,
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
@@ -3687,6 +10136,7 @@ DllExport long __stdcall UPC2_PCI_GetSysInfo(long card_ndx, sw_info_t * pSWinfo,
 
 		memcpy(pDLLinfo, &DLLinfo, sizeof(sw_info_t));
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return ret_val;
 
 }
@@ -3713,19 +10163,24 @@ DllExport long __stdcall UPC2_PCI_GetSysInfo(long card_ndx, sw_info_t * pSWinfo,
 DllExport long __stdcall UPC2_PCI_GetSysOpInfo(long card_ndx, op_info_t * pOPinfo)
 {
 	long ret_val;
-
-#ifdef USE_SEND_COMMAND
-	ret_val = SendCommandEx(card_ndx, UPC2_DSP_GET_SYSTEM_OP_INFO, 1);
-#else
-
+#ifndef USE_SEND_COMMAND
 	long i,j;
 	UPC2_CommandBuffer_t    CommandBuffer;
+#endif
 
 	if ((ret_val = IsConnected(card_ndx)) < 0)
 		return ret_val;
 
+	// Keep other commands out until the reply is read
+	EnterCriticalSection(&UPC2_Card[card_ndx].CmdLock);
+#ifdef USE_SEND_COMMAND
+	ret_val = SendCommandEx(card_ndx, UPC2_DSP_GET_SYSTEM_OP_INFO, 1);
+#else
 	if ((ret_val = IsAwaitingCommand(card_ndx)) < 0)
+	{
+		LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 		return ret_val;
+	}
 
 	// Try n-times
 	for (i=0; i < SEND_CMD_MAX_TRIES; i++)
@@ -3744,7 +10199,7 @@ DllExport long __stdcall UPC2_PCI_GetSysOpInfo(long card_ndx, op_info_t * pOPinf
 			if ((ret_val = GetStatus(card_ndx)) < 0)
 				continue;
 
-			if ((cmd_status & UPC2_DSP_BUSY) == 0)
+			if ((UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BUSY) == 0)
 				break;
 		}
 		if (j == BUSY_TEST_TRIES)
@@ -3754,21 +10209,21 @@ DllExport long __stdcall UPC2_PCI_GetSysOpInfo(long card_ndx, op_info_t * pOPinf
 		}
 
 		// Break out if bad CRC
-		if (cmd_status & UPC2_DSP_BAD_CRC)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_BAD_CRC)
 		{
 			ret_val = UPC2_COMM_ERR;
 			break;
 		}
 
 		// Break out if completed OK
-		if (cmd_status & UPC2_DSP_COMPLETED_OK)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_OK)
 		{
 			ret_val = UPC2_NORMAL_RETURN;
 			break;
 		}
 
 		// Set ret_val if completed NG
-		if (cmd_status & UPC2_DSP_COMPLETED_NG)
+		if (UPC2_Card[card_ndx].cmd_status & UPC2_DSP_COMPLETED_NG)
 			ret_val = UPC2_DSP_COMMAND_NG;
 
 	}
@@ -3782,6 +10237,7 @@ DllExport long __stdcall UPC2_PCI_GetSysOpInfo(long card_ndx, op_info_t * pOPinf
 		ReadFromLocalAddressSpace(card_ndx, COMMAND_DATA_BUFFER_ADDR,
 										  pOPinfo, sizeof(op_info_t));
 	}
+	LeaveCriticalSection(&UPC2_Card[card_ndx].CmdLock);
 	return ret_val;
 
 }
@@ -9,6 +9,180 @@ extern "C"   {
 #define DllExport __declspec(dllexport)
 #endif
 
+// Types
+
+// Streaming statistics (see UPC2_PCI_GetStreamStats)
+typedef struct
+{
+	long	nSlots;				// capacity of the host ring buffer (frames)
+	long	occupancy;			// frames currently in the host ring buffer
+	long	high_water;			// highest occupancy seen
+	long	frames_drained;		// frames read from the DSP ring buffer
+	long	frames_delivered;	// frames returned by UPC2_PCI_GetData
+	long	frames_dropped;		// frames discarded by the backpressure policy
+	long	polls;				// pool header reads
+	long	errors;				// unsuccessful drain passes
+} UPC2_StreamStats_t;
+
+// Raw conversion engine (see RawToFloat_Scalar)
+typedef void (*RawToFloat_t)(const short * src, const float * A, const float * B, float * dst, long n);
+
+// Host moving average engine (see AvgUpdate_Scalar)
+typedef void (*AvgUpdate_t)(double * sum, const float * add, const float * sub, long n);
+
+// 32 to 64-bit count extension engine (see UnwrapWords_Scalar)
+typedef void (*UnwrapWords_t)(const U32 * v, long n, LONGLONG * pLast, LONGLONG * out);
+
+// frame_no continuity check engine (see FindBreak_Scalar)
+typedef long (*FindBreak_t)(const U32 * v, long n, U32 prev);
+
+// HPI transport (see HpiHwOps). Every HPI register access goes through the card's ops so
+// the card can be the PLX BAR or the emulator (see UPC2_PCI_ConnectSimulated).
+typedef struct
+{
+	void (*WriteHPIC)(long card_ndx, U32 value);
+	U32  (*ReadHPIC)(long card_ndx);
+	void (*WriteHPIA)(long card_ndx, U32 local_addr);
+	U32  (*ReadHPIA)(long card_ndx);
+	U32  (*ReadHPID)(long card_ndx, U32 * dest, U32 nwords);	// auto-increment, returns the sum
+	U32  (*ReadHPIDFixed)(long card_ndx);						// one fixed-mode read
+	void (*WriteHPID)(long card_ndx, U32 * src, U32 nwords);	// auto-increment
+	void (*WriteHPIDFixed)(long card_ndx, U32 value);			// one fixed-mode write
+} UPC2_HpiOps_t;
+
+// Segment of a vectored HPI transfer (see ReadFromLocalAddressSpaceV)
+typedef struct
+{
+	U32		local_addr;			// DSP address (multiple of 4)
+	void *	buf;				// host buffer
+	U32		size;				// bytes (multiple of 4)
+	long	status;				// set on return: UPC2_NORMAL_RETURN or a negative error
+} UPC2_HpiSegment_t;
+
+// Destination of UPC2_PCI_GetDataEx
+typedef struct
+{
+	long	layout;					// UPC2_LAYOUT_ROWS or UPC2_LAYOUT_COLUMNS
+	long	nItems;					// set on return: items per frame
+
+	// UPC2_LAYOUT_ROWS
+	void *	pRows;					// frame_no, timestamp, data[nItems] per row
+	long	stride;					// bytes between rows (0 => packed, 8 + 4*nItems)
+
+	// UPC2_LAYOUT_COLUMNS (arrays of nFrames, NULL => not wanted)
+	Int32 *	pFrameNo;
+	Int32 *	pTimestamp;				// usecs x 10
+	float *	pItem[MAX_ITEMS];		// pItem[i][k] = item i of frame k
+	LONGLONG * pFrameNo64;			// 64 bits (see UPC2_PCI_UnwrapFrames)
+	LONGLONG * pTimestamp64;
+} UPC2_DataLayout_t;
+
+// Break in the frame_no sequence (see UPC2_PCI_GetLossStats)
+typedef struct
+{
+	long	index;					// frame of the batch at the break
+	Int32	expected;				// frame_no expected
+	Int32	frame_no;				// frame_no read
+} UPC2_FrameGap_t;
+
+// Frame loss and DSP overrun counters (see UPC2_PCI_GetLossStats)
+typedef struct
+{
+	long	status;					// UPC2_DSP_DATA_OVERRUN if the DSP ring buffer has been full
+	long	overruns;				// pool header reads that found the DSP ring buffer full
+	long	clipped;				// reads cut short to one less than the unread frames
+	long	frames_checked;
+	long	gaps;					// breaks forward in frame_no
+	long	frames_lost;			// frames missing in the gaps
+	long	repeats;				// breaks back (frames read again or out of order)
+	long	cksum_errors;			// frames whose check word failed the burst read (re-read)
+	long	cksum_failed;			// frames that failed READ_DATA_MAX_TRIES re-reads as well
+	long	retries;				// single-frame reads tried again after a check word failure
+	long	batch_frames;			// frames in the last batch read
+	long	nGaps;					// breaks in the last batch (the first UPC2_MAX_GAPS in gap[])
+	UPC2_FrameGap_t gap[UPC2_MAX_GAPS];
+} UPC2_LossStats_t;
+
+// Frame batch shared by reference (see UPC2_PCI_GetBatch). Read only -- the frames stay put
+// until the last reference is released.
+typedef struct
+{
+	long	card_ndx;
+	long	nFrames;				// frames in the batch
+	long	frm_incr;				// bytes between frames (frame size less check word)
+	const void * pFrame;			// first frame (frame_no, timestamp, data[nItems])
+	volatile LONG refs;				// references (UPC2_PCI_HoldBatch, UPC2_PCI_ReleaseBatch)
+	void *	pPool;					// internal
+	long	next;					// internal
+} UPC2_Batch_t;
+
+// Streaming server counters (see UPC2_PCI_GetServerStats)
+typedef struct
+{
+	long	nClients;				// clients connected
+	long	frames_read;			// frames read from the cards
+	long	frames_queued;			// frames queued to clients (a batch counts once per client)
+	long	frames_dropped;			// frames not queued because a client's queue was full
+	long	messages_sent;
+	double	bytes_sent;
+} UPC2_ServerStats_t;
+
+// Poll scheduler plan and counters (see UPC2_PCI_GetPollStats)
+typedef struct
+{
+	long	latency_us;				// target latency
+	long	watermark;				// occupancy limit (frames)
+	long	frame_period_us;		// from the config (scan_interval * nSbits * McBSP0_clk_div / 4)
+	double	frame_rate;				// frames per second seen arriving (0 until measured)
+	long	interval_us;			// time until the next poll (0 => poll again now)
+	long	batch;					// frames to ask for at the next poll
+	long	polls;					// pool header reads seen
+	double	poll_rate;				// polls per second achieved
+	double	avg_batch;				// frames taken per poll
+	long	occupancy;				// unread frames in the DSP ring buffer at the last poll
+	long	peak_occupancy;
+	long	nMax;					// frames in the DSP ring buffer
+} UPC2_PollStats_t;
+
+// Fit of a card's clock against the host clock (see UPC2_PCI_GetClockFit)
+typedef struct
+{
+	long	nSamples;
+	double	rate;					// card timestamp counts per host second (nominally UPC2_TIMESTAMP_RATE)
+	double	drift_ppm;				// card clock fast (+) or slow (-) in parts per million
+	double	host_at_zero;			// host time (secs) of card timestamp 0 (nearest the latest sample)
+	double	resid_usecs;			// median absolute residual of the samples
+	double	rtt_min_usecs;			// timestamp read round trip (shortest, median)
+	double	rtt_median_usecs;
+} UPC2_ClockFit_t;
+
+// Frame of the merged stream (see UPC2_PCI_GetMergedData)
+typedef struct
+{
+	long	card_ndx;
+	Int32	timestamp;				// host time or card timestamp, corrected (see UPC2_PCI_StartMerge)
+	Int32	frame_no;				// the card's frame (as UPC2_ConvertedDataFrame_t)
+	Int32	card_timestamp;
+	float	data[MAX_ITEMS];
+} UPC2_MergedFrame_t;
+
+// Results of UPC2_PCI_BenchmarkGetData
+typedef struct
+{
+	long	access_type;
+	long	calls;
+	long	frames;				// frames returned
+	long	errors;				// calls returning an error
+	double	bytes;				// frame data returned (excluding check words)
+	double	seconds;
+	double	frames_per_sec;
+	double	bytes_per_sec;
+	double	lat_p50;			// per-call latency percentiles (usecs)
+	double	lat_p90;
+	double	lat_p99;
+	double	lat_max;
+} UPC2_Benchmark_t;
+
 // Prototypes 
 
 // Test code
@@ -17,17 +191,28 @@ DllExport long __stdcall UPC2_PCI_UploadArray(long size, void * pFile);
 DllExport long __stdcall UPC2_PCI_DownloadArray(long * pSize, void * pFile);
 
 DllExport long __stdcall UPC2_PCI_Test(void);
+DllExport long __stdcall UPC2_PCI_BenchmarkCRC(long size, long nIter, double * pMBps);
+DllExport long __stdcall UPC2_PCI_BenchmarkGetData(long card_ndx, long access_type, long nCalls, long nFrames,
+												   UPC2_Benchmark_t * pResult);
+DllExport long __stdcall UPC2_PCI_BenchmarkDataPath(long frames_per_sec, long nCalls, long nFrames,
+													UPC2_Benchmark_t * pResults);
 
 // Internal support
 
-void CheckFrameNo(void * pframe, long nFrames, U32 fsize);
-
-void  BuildCRCTable(void);
+void  SelectCRCEngine(void);
 U32   Calculate32BitCRC( long count, void * buffer );
+U32   Calculate32BitCRC_Bytewise( long count, void * buffer );
+U32   CRC32_Slice8(U32 crc, const U8 * p, long count);
+U32   CRC32_Pclmul(U32 crc, const U8 * p, long count);
 
 long  GetStatus(long card_ndx);
 long  GetMemoryMapPlus(long card_ndx);
 long  GetConvertedDataFramePoolHdr(long card_ndx);
+long  GetShadowMemoryMap(long card_ndx);
+long  GetShadowConfig(long card_ndx);
+long  GetShadowCalib(long card_ndx);
+void  InvalidateShadow(long card_ndx, U32 regions);
+long  WriteConfigDelta(long card_ndx, UPC2_Config_t * pUPC2_Config);
 
 long  IsConnected(long card_ndx);
 long  IsAwaitingCommand(long card_ndx);
@@ -40,9 +225,41 @@ long  Map_BAR(long card_ndx);
 void  UnMap_BAR(long card_ndx);
 long  ClosePCI(HANDLE DrvHandle);
 
+U32  HpidReadSum_Fac1(U32 Va, U32 * dest, U32 nwords);
+U32  HpidReadSum_Fac200(U32 Va, U32 * dest, U32 nwords);
+void HpiHw_WriteHPIC(long card_ndx, U32 value);
+U32  HpiHw_ReadHPIC(long card_ndx);
+void HpiHw_WriteHPIA(long card_ndx, U32 local_addr);
+U32  HpiHw_ReadHPIA(long card_ndx);
+U32  HpiHw_ReadHPID(long card_ndx, U32 * dest, U32 nwords);
+U32  HpiHw_ReadHPIDFixed(long card_ndx);
+void HpiHw_WriteHPID(long card_ndx, U32 * src, U32 nwords);
+void HpiHw_WriteHPIDFixed(long card_ndx, U32 value);
+void HpiSim_WriteHPIC(long card_ndx, U32 value);
+U32  HpiSim_ReadHPIC(long card_ndx);
+void HpiSim_WriteHPIA(long card_ndx, U32 local_addr);
+U32  HpiSim_ReadHPIA(long card_ndx);
+U32  HpiSim_ReadHPID(long card_ndx, U32 * dest, U32 nwords);
+U32  HpiSim_ReadHPIDFixed(long card_ndx);
+void HpiSim_WriteHPID(long card_ndx, U32 * src, U32 nwords);
+void HpiSim_WriteHPIDFixed(long card_ndx, U32 value);
+void StopSimulation(long card_ndx);
+void ResetClock(long card_ndx);
+
 DllExport long __stdcall WriteToLocalAddressSpace(long card_ndx, void * src, U32 local_addr, U32 size);
 DllExport long __stdcall ReadFromLocalAddressSpace(long card_ndx, U32 local_addr, void * dest, U32 size);
 DllExport long __stdcall ReadWithCheckFromLocalAddressSpace(long card_ndx, U32 local_addr, void * dest, U32 size);
+DllExport long __stdcall ReadFramesWithCheckFromLocalAddressSpace(long card_ndx, U32 local_addr, long nFrames,
+                                                                  U32 frm_size, void * dest, U32 frm_incr);
+DllExport long __stdcall WriteToLocalAddressSpaceV(long card_ndx, UPC2_HpiSegment_t * pSeg, long nSegs);
+DllExport long __stdcall ReadFromLocalAddressSpaceV(long card_ndx, UPC2_HpiSegment_t * pSeg, long nSegs);
+long ReadFramesVerified(long card_ndx, U32 local_addr, long nFrames, U32 frm_size, void * dest,
+						U32 frm_incr, long * pGood);
+long SetHPIA(long card_ndx, U32 local_addr);
+void HpidWrite(long card_ndx, U32 * src, U32 nwords, BOOL last);
+int  CompareSegAddr(const void * a, const void * b);
+int  CompareSegOrder(const void * a, const void * b);
+long SortSegments(UPC2_HpiSegment_t * pSeg, long nSegs, UPC2_HpiSegment_t ** ppSeg);
 
 // Vestigial
 DllExport long __stdcall UPC2_PCI_WriteToLocalBus(long card_ndx, void * src, U32 dest, U32 size);
@@ -55,6 +272,7 @@ long SendCommand(long card_ndx, U32 command, long retry_mult);
 // Connect/Disconnect/Reset/SetTimestamp
 DllExport long __stdcall UPC2_PCI_GetInventory(long * psn);
 DllExport long __stdcall UPC2_PCI_Connect(long card_ndx);
+DllExport long __stdcall UPC2_PCI_ConnectSimulated(long card_ndx, long frames_per_sec);
 DllExport long __stdcall UPC2_PCI_Disconnect(long card_ndx);
 DllExport long __stdcall UPC2_PCI_Reset(long card_ndx);
 DllExport long __stdcall UPC2_PCI_SetTimestamp(long timestamp);
@@ -65,13 +283,108 @@ DllExport long __stdcall UPC2_PCI_UploadConfigFromPath(long card_ndx, char * pFi
 DllExport long __stdcall UPC2_PCI_StartDataCollection(long card_ndx);
 DllExport long __stdcall UPC2_PCI_SetStartFrame(long card_ndx);
 DllExport long __stdcall UPC2_PCI_GetUnreadFrameCount(long card_ndx);
+DllExport long __stdcall UPC2_PCI_GetLossStats(long card_ndx, UPC2_LossStats_t * pStats);
+DllExport long __stdcall UPC2_PCI_ResetLossStats(long card_ndx);
 DllExport long __stdcall UPC2_PCI_GetData(long card_ndx, long access_type, long nFrames, void * pFrame);
+DllExport long __stdcall UPC2_PCI_OpenCursor(long card_ndx, long from);
+DllExport long __stdcall UPC2_PCI_ReadCursor(long card_ndx, long cursor, long nFrames, void * pFrame, long frm_incr);
+DllExport long __stdcall UPC2_PCI_CloseCursor(long card_ndx, long cursor);
+DllExport long __stdcall UPC2_PCI_SeekCursor(long card_ndx, long cursor, long timestamp);
+DllExport long __stdcall UPC2_PCI_GetDataSince(long card_ndx, long timestamp, long nFrames, void * pFrame, long frm_incr);
+DllExport long __stdcall UPC2_PCI_GetDataEx(long card_ndx, long access_type, long nFrames, UPC2_DataLayout_t * pLayout);
+DllExport long __stdcall UPC2_PCI_GetRawData(long card_ndx, long access_type, long nFrames, void * pFrame);
+DllExport long __stdcall UPC2_PCI_ConvertRawFrames(long card_ndx, long nFrames, void * pRaw, long raw_incr,
+												   void * pFrame, long frm_incr);
+DllExport long __stdcall UPC2_PCI_UnwrapFrames(long card_ndx, long nFrames, void * pFrame, long frm_incr,
+											   LONGLONG * pFrameNo, LONGLONG * pTimestamp);
+DllExport long __stdcall UPC2_PCI_ResetUnwrap(long card_ndx);
+DllExport long __stdcall UPC2_PCI_StartHostAverage(long card_ndx, long nWindows, long * pWindowLen);
+DllExport long __stdcall UPC2_PCI_AddFramesToAverage(long card_ndx, long nFrames, void * pFrame, long frm_incr,
+													 float * pAverage);
+DllExport long __stdcall UPC2_PCI_GetHostAverage(long card_ndx, float * pAverage);
+DllExport long __stdcall UPC2_PCI_StopHostAverage(long card_ndx);
+DllExport long __stdcall UPC2_PCI_StartBatchPool(long card_ndx, long nBatches, long nFrames);
+DllExport long __stdcall UPC2_PCI_GetBatch(long card_ndx, long access_type, long nFrames, UPC2_Batch_t ** ppBatch);
+DllExport long __stdcall UPC2_PCI_HoldBatch(UPC2_Batch_t * pBatch);
+DllExport long __stdcall UPC2_PCI_ReleaseBatch(UPC2_Batch_t * pBatch);
+DllExport long __stdcall UPC2_PCI_StopBatchPool(long card_ndx);
+DllExport long __stdcall UPC2_PCI_StartMerge(long nCards, long * pCards, long nBatch);
+DllExport long __stdcall UPC2_PCI_GetMergedData(long nFrames, UPC2_MergedFrame_t * pFrame);
+DllExport long __stdcall UPC2_PCI_SetTimeOffset(long card_ndx, long offset);
+DllExport long __stdcall UPC2_PCI_StopMerge(void);
+DllExport long __stdcall UPC2_PCI_StartClockSync(long period_ms);
+DllExport long __stdcall UPC2_PCI_StopClockSync(void);
+DllExport long __stdcall UPC2_PCI_SampleClock(long card_ndx);
+DllExport long __stdcall UPC2_PCI_GetClockFit(long card_ndx, UPC2_ClockFit_t * pFit);
+DllExport long __stdcall UPC2_PCI_HostTimeFor(long card_ndx, long timestamp, double * pHostTime);
 DllExport long __stdcall UPC2_PCI_StopDataCollection(long card_ndx);
 DllExport long __stdcall UPC2_PCI_SaveConfigToFlash(long card_ndx);
 DllExport long __stdcall UPC2_PCI_LoadConfigFromFlash(long card_ndx);
 DllExport long __stdcall UPC2_PCI_GetNumberOfItems(long card_ndx);
 DllExport long __stdcall UPC2_PCI_DownloadConfig(long card_ndx, UPC2_Config_t * addr);
 
+// Streaming (background acquisition into a host ring buffer)
+long ReadFromStartFrame(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr,
+						long nFrames, void * pFrame, U32 frm_incr);
+long ReadNewestFrames(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr,
+					  long nFrames, void * pFrame, U32 frm_incr);
+long DrainToStream(long card_ndx);
+long GetStreamData(long card_ndx, long nFrames, void * pFrame, U32 frm_incr);
+long GetDataRows(long card_ndx, long access_type, long nFrames, void * pFrame, U32 frm_incr);
+
+void SelectRawEngine(void);
+void RawToFloat_Scalar(const short * src, const float * A, const float * B, float * dst, long n);
+void RawToFloat_SSE2(const short * src, const float * A, const float * B, float * dst, long n);
+void RawToFloat_AVX2(const short * src, const float * A, const float * B, float * dst, long n);
+void AvgUpdate_Scalar(double * sum, const float * add, const float * sub, long n);
+void AvgUpdate_SSE2(double * sum, const float * add, const float * sub, long n);
+void UnwrapWords_Scalar(const U32 * v, long n, LONGLONG * pLast, LONGLONG * out);
+void UnwrapWords_SSE2(const U32 * v, long n, LONGLONG * pLast, LONGLONG * out);
+long FindBreak_Scalar(const U32 * v, long n, U32 prev);
+long FindBreak_SSE2(const U32 * v, long n, U32 prev);
+long CheckFrameNo(long card_ndx, void * pFrame, long nFrames, U32 frm_incr);
+void CheckOverrun(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr);
+void CursorCommit(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr, BOOL force);
+long FindFrameSince(long card_ndx, UPC2_ConvertedDataFramePoolHdr_t * pFrameHdr, Int32 timestamp, U32 * pIndex);
+void UnwrapColumn(long card_ndx, long nFrames, const void * pFrame, U32 frm_incr, U32 offset, LONGLONG * pOut);
+
+DllExport long __stdcall UPC2_PCI_StartStreaming(long card_ndx, long nRingFrames, long policy);
+DllExport long __stdcall UPC2_PCI_StopStreaming(long card_ndx);
+DllExport long __stdcall UPC2_PCI_GetStreamStats(long card_ndx, UPC2_StreamStats_t * pStats);
+
+// Shared-memory frame bus (one process drains the cards, any number read)
+void BusPublish(long card_ndx, const U8 * pSrc, long nFrames, U32 frm_size);
+
+DllExport long __stdcall UPC2_PCI_StartBus(char * pName, long nSlots);
+DllExport long __stdcall UPC2_PCI_StopBus(void);
+DllExport long __stdcall UPC2_PCI_OpenBus(char * pName, long from);
+DllExport long __stdcall UPC2_PCI_ReadBus(long bus, long card_ndx, long nFrames, void * pFrame, long frm_incr,
+										  long * pLost);
+DllExport long __stdcall UPC2_PCI_CloseBus(long bus);
+
+// Streaming server (frames to clients over TCP)
+DllExport long __stdcall UPC2_PCI_StartServer(long port, long nBatch, long options);
+DllExport long __stdcall UPC2_PCI_StopServer(void);
+DllExport long __stdcall UPC2_PCI_GetServerStats(UPC2_ServerStats_t * pStats);
+DllExport long __stdcall UPC2_PCI_ConnectServer(char * pHost, long port, long card_mask, long options);
+DllExport long __stdcall UPC2_PCI_ReadServer(long conn, long * pCard, long nFrames, void * pFrame, long frm_incr,
+											 long timeout, long * pDropped);
+DllExport long __stdcall UPC2_PCI_DisconnectServer(long conn);
+
+// Frame-ready wait
+void SetFramePeriod(long card_ndx, UPC2_Config_t * pUPC2_Config);
+void StartHintNotify(long card_ndx);
+void StopHintNotify(long card_ndx);
+
+DllExport long __stdcall UPC2_PCI_WaitForFrames(long card_ndx, long minFrames, long timeout);
+
+// Poll scheduler
+void SchedObserve(long card_ndx, long nUnread, long nMax, long nRead);
+void SchedReset(long card_ndx);
+
+DllExport long __stdcall UPC2_PCI_SetPollTarget(long card_ndx, long latency_us, long watermark_pct);
+DllExport long __stdcall UPC2_PCI_GetPollStats(long card_ndx, UPC2_PollStats_t * pStats);
+
 // In-circuit programming
 DllExport long __stdcall UPC2_PCI_InCircuitProgram(long card_ndx, long dest, char * pFilepath);
 DllExport long __stdcall UPC2_PCI_DownloadProgram(long card_ndx, long src, void * pBuf);